@@ -46,6 +46,11 @@ struct dt {
     dt(int64_t ms):t(ms){}
 };
 
+/*
+  tagged union, scalars are stored inline, containers are heap allocated
+  and owned by the pointer. so a scalar value costs no allocation and
+  copying/moving a vp does not touch the unused types
+*/
 class intf {
     enum {
         t_i32,
@@ -59,166 +64,202 @@ class intf {
         t_dt,
         t_double,
         t_vdouble,
+        t_vu32,     // vector<uint32_t> kept in vi64, int32 in bson like vi32
     };
     friend class Convert;
 public:
-    intf(bool v):_type(t_bool),_i64(v){}
-    intf(int32_t v):_type(t_i32),_i64(v){}
-    intf(int64_t v):_type(t_i64),_i64(v){}
-    intf(const dt&v):_type(t_dt),_i64(v.t){}
-    intf(const vi32& v):_type(t_vi32){
-        _vi64.resize(v.size());
-        for (size_t i=0; i<v.size(); ++i) {
-            _vi64[i] = v[i];
-        }
-    }
-    intf(const vi64& v):_type(t_vi64),_vi64(v){}
-    intf(const std::string& v):_type(t_s),_s(v){}
-    intf(const vs& v):_type(t_vs),_vs(v){}
-    intf(const vp& v):_type(t_mi),_vp(v){}
+    intf(bool v):_type(t_bool){_v.i64 = v;}
+    intf(int32_t v):_type(t_i32){_v.i64 = v;}
+    intf(int64_t v):_type(t_i64){_v.i64 = v;}
+    intf(const dt&v):_type(t_dt){_v.i64 = v.t;}
+    intf(const vi32& v):_type(t_vi32){_v.p = new vi32(v);}
+    intf(const vi64& v):_type(t_vi64){_v.p = new vi64(v);}
+    intf(const std::string& v):_type(t_s){_v.p = new std::string(v);}
+    intf(const vs& v):_type(t_vs){_v.p = new vs(v);}
+    intf(const vp& v):_type(t_mi){_v.p = new vp(v);}
 
     // fix type
-    intf(const char* v):_type(t_s),_s(v){}
-    intf(uint32_t v):_type(t_i32),_i64(v){}
-    intf(uint64_t v):_type(t_i64),_i64(v){}
-    intf(const std::vector<uint32_t>& v):_type(t_vi32){
-        _vi64.resize(v.size());
-        for (size_t i=0; i<v.size(); ++i) {
-            _vi64[i] = v[i];
+    intf(const char* v):_type(t_s){_v.p = new std::string(v);}
+    intf(uint32_t v):_type(t_i32){_v.i64 = v;}
+    intf(uint64_t v):_type(t_i64){_v.i64 = (int64_t)v;}
+    intf(const std::vector<uint32_t>& v):_type(t_vu32){_v.p = new vi64(v.begin(), v.end());}
+    intf(const std::vector<uint64_t>& v):_type(t_vi64){_v.p = new vi64(v.begin(), v.end());}
+    intf(double v):_type(t_double){_v.db = v;}
+    intf(float v):_type(t_double){_v.db = v;}
+    intf(const std::vector<double>& v):_type(t_vdouble){_v.p = new std::vector<double>(v);}
+    intf(const std::vector<float>& v):_type(t_vdouble){_v.p = new std::vector<double>(v.begin(), v.end());}
+
+    intf(const intf& o):_type(o._type) {
+        switch (_type) {
+          case t_vi32: _v.p = new vi32(o.ref<vi32>()); break;
+          case t_vi64:
+          case t_vu32: _v.p = new vi64(o.ref<vi64>()); break;
+          case t_vdouble: _v.p = new std::vector<double>(o.ref<std::vector<double> >()); break;
+          case t_s: _v.p = new std::string(o.ref<std::string>()); break;
+          case t_vs: _v.p = new vs(o.ref<vs>()); break;
+          case t_mi: _v.p = new vp(o.ref<vp>()); break;
+          default: _v = o._v;
         }
     }
-    intf(const std::vector<uint64_t>& v):_type(t_vi64){
-        _vi64.resize(v.size());
-        for (size_t i=0; i<v.size(); ++i) {
-            _vi64[i] = v[i];
-        }
+    intf& operator = (const intf& o) {
+        intf t(o);
+        swap(t);
+        return *this;
     }
-    intf(double v):_type(t_double),_db(v){}
-    intf(float v):_type(t_double),_db(v){}
-    intf(const std::vector<double>& v):_type(t_vdouble),_vdb(v){}
-    intf(const std::vector<float>& v):_type(t_vdouble){
-        _vdb.resize(v.size());
-        for (size_t i=0; i<v.size(); ++i) {
-            _vdb[i] = v[i];
+    ~intf() {
+        switch (_type) {
+          case t_vi32: delete (vi32*)_v.p; break;
+          case t_vi64:
+          case t_vu32: delete (vi64*)_v.p; break;
+          case t_vdouble: delete (std::vector<double>*)_v.p; break;
+          case t_s: delete (std::string*)_v.p; break;
+          case t_vs: delete (vs*)_v.p; break;
+          case t_mi: delete (vp*)_v.p; break;
         }
     }
+    void swap(intf& o) {
+        std::swap(_type, o._type);
+        std::swap(_v, o._v);
+    }
+
+#if __cplusplus >= 201103L
+    intf(vi32&& v):_type(t_vi32){_v.p = new vi32(std::move(v));}
+    intf(vi64&& v):_type(t_vi64){_v.p = new vi64(std::move(v));}
+    intf(std::string&& v):_type(t_s){_v.p = new std::string(std::move(v));}
+    intf(vs&& v):_type(t_vs){_v.p = new vs(std::move(v));}
+    intf(vp&& v):_type(t_mi){_v.p = new vp(std::move(v));}
+    intf(std::vector<double>&& v):_type(t_vdouble){_v.p = new std::vector<double>(std::move(v));}
+
+    // noexcept so vp grows by move
+    intf(intf&& o) noexcept:_type(o._type),_v(o._v) {
+        o._type = t_i64;
+    }
+    intf& operator = (intf&& o) noexcept {
+        swap(o);
+        return *this;
+    }
+#endif
 private:
+    template <typename T>
+    const T& ref() const {
+        return *(const T*)_v.p;
+    }
+
     int _type;
-    int64_t _i64;
-    std::string _s;
-    vi64  _vi64;
-    double _db;
-    std::vector<double> _vdb;
-    vs  _vs;
-    vp  _vp;
+    union {
+        int64_t i64;
+        double db;
+        void* p;
+    } _v;
 };
 
 class Convert {
 public:
-    enum {
-        bb_top,
-        bb_doc,
-        bb_array
-    };
-
-    static std::string build(const vp&m, _bson_t*parent, const std::string&pname, int type) {
-        bson_t _static;
-        bson_t *root = &_static;
-
-        if (type == bb_top) {
-            if (0 != parent) {
-                root = parent;
-            } else {
-                root = &_static;
-            }
-            bson_init(root);
-        } else if (type == bb_doc) {
-            bson_append_document_begin((bson_t*)parent, pname.c_str(), pname.length(), root);
-        } else {
-            bson_append_array_begin((bson_t*)parent, pname.c_str(), pname.length(), root);
-        }
-
+    static void append(const vp&m, _bson_t*root) {
         for (vp::const_iterator iter=m.begin(); iter!=m.end(); ++iter) {
-            switch (iter->second._type) {
+            const char* key = iter->first.c_str();
+            int klen = (int)iter->first.length();
+            const intf& v = iter->second;
+            switch (v._type) {
               case intf::t_i32:
-                bson_append_int32(root, iter->first.c_str(), iter->first.length(), iter->second._i64);
+                bson_append_int32(root, key, klen, (int32_t)v._v.i64);
                 break;
               case intf::t_i64:
-                bson_append_int64(root, iter->first.c_str(), iter->first.length(), iter->second._i64);
+                bson_append_int64(root, key, klen, v._v.i64);
                 break;
               case intf::t_dt:
-                bson_append_date_time(root, iter->first.c_str(), iter->first.length(), iter->second._i64);
+                bson_append_date_time(root, key, klen, v._v.i64);
                 break;
               case intf::t_bool:
-                bson_append_bool(root, iter->first.c_str(), iter->first.length(), iter->second._i64);
+                bson_append_bool(root, key, klen, v._v.i64 != 0);
                 break;
               case intf::t_double:
-                bson_append_double(root, iter->first.c_str(), iter->first.length(), iter->second._db);
+                bson_append_double(root, key, klen, v._v.db);
                 break;
               case intf::t_vi32: {
+                    const vi32& vv = v.ref<vi32>();
                     bson_t child;
-                    bson_append_array_begin(root, iter->first.c_str(), iter->first.length(), &child);
-                    for (size_t i=0; i<iter->second._vi64.size(); ++i) {
-                        std::string index = x2struct::Util::tostr(i);
-                        bson_append_int32(&child, index.c_str(), index.length(), iter->second._vi64[i]);
+                    bson_append_array_begin(root, key, klen, &child);
+                    x2struct::BsonIndexKey index;
+                    for (size_t i=0; i<vv.size(); ++i, index.next()) {
+                        bson_append_int32(&child, index.key().name, (int)index.key().len, vv[i]);
+                    }
+                    bson_append_array_end(root, &child);
+                }
+                break;
+              case intf::t_vu32: {
+                    const vi64& vv = v.ref<vi64>();
+                    bson_t child;
+                    bson_append_array_begin(root, key, klen, &child);
+                    x2struct::BsonIndexKey index;
+                    for (size_t i=0; i<vv.size(); ++i, index.next()) {
+                        bson_append_int32(&child, index.key().name, (int)index.key().len, (int32_t)vv[i]);
                     }
                     bson_append_array_end(root, &child);
                 }
                 break;
               case intf::t_vi64: {
+                    const vi64& vv = v.ref<vi64>();
                     bson_t child;
-                    bson_append_array_begin(root, iter->first.c_str(), iter->first.length(), &child);
-                    for (size_t i=0; i<iter->second._vi64.size(); ++i) {
-                        std::string index = x2struct::Util::tostr(i);
-                        bson_append_int64(&child, index.c_str(), index.length(), iter->second._vi64[i]);
+                    bson_append_array_begin(root, key, klen, &child);
+                    x2struct::BsonIndexKey index;
+                    for (size_t i=0; i<vv.size(); ++i, index.next()) {
+                        bson_append_int64(&child, index.key().name, (int)index.key().len, vv[i]);
                     }
                     bson_append_array_end(root, &child);
                 }
                 break;
               case intf::t_vdouble: {
+                    const std::vector<double>& vv = v.ref<std::vector<double> >();
                     bson_t child;
-                    bson_append_array_begin(root, iter->first.c_str(), iter->first.length(), &child);
-                    for (size_t i=0; i<iter->second._vdb.size(); ++i) {
-                        std::string index = x2struct::Util::tostr(i);
-                        bson_append_double(&child, index.c_str(), index.length(), iter->second._vdb[i]);
+                    bson_append_array_begin(root, key, klen, &child);
+                    x2struct::BsonIndexKey index;
+                    for (size_t i=0; i<vv.size(); ++i, index.next()) {
+                        bson_append_double(&child, index.key().name, (int)index.key().len, vv[i]);
                     }
                     bson_append_array_end(root, &child);
                 }
                 break;
-              case intf::t_s:
-                bson_append_utf8(root, iter->first.c_str(), iter->first.length(), iter->second._s.c_str(), iter->second._s.length());
+              case intf::t_s: {
+                    const std::string& str = v.ref<std::string>();
+                    bson_append_utf8(root, key, klen, str.c_str(), (int)str.length());
+                }
                 break;
               case intf::t_vs: {
+                    const vs& vv = v.ref<vs>();
                     bson_t child;
-                    bson_append_array_begin(root, iter->first.c_str(), iter->first.length(), &child);
-                    for (size_t i=0; i<iter->second._vs.size(); ++i) {
-                        std::string index = x2struct::Util::tostr(i);
-                        bson_append_utf8(&child, index.c_str(), index.length(), iter->second._vs[i].c_str(), iter->second._vs[i].length());
+                    bson_append_array_begin(root, key, klen, &child);
+                    x2struct::BsonIndexKey index;
+                    for (size_t i=0; i<vv.size(); ++i, index.next()) {
+                        bson_append_utf8(&child, index.key().name, (int)index.key().len, vv[i].c_str(), (int)vv[i].length());
                     }
                     bson_append_array_end(root, &child);
                 }
                 break;
-              case intf::t_mi:
-                build(iter->second._vp, root, iter->first, bb_doc);
+              case intf::t_mi: {
+                    bson_t child;
+                    bson_append_document_begin(root, key, klen, &child);
+                    append(v.ref<vp>(), &child);
+                    bson_append_document_end(root, &child);
+                }
                 break;
             }
         }
+    }
 
-        if (type == bb_top) {
-            if (0 != parent) {
-                return "";
-            } else {
-                std::string data((const char*)bson_get_data(root), root->len);
-                bson_destroy(root);
-                return data;
-            }
-        } else if (type == bb_doc) {
-            bson_append_document_end((bson_t*)parent, root);
-        } else {
-            bson_append_array_end((bson_t*)parent, root);
+    static std::string build(const vp&m, _bson_t*ret) {
+        if (0 != ret) {
+            bson_init(ret);
+            append(m, ret);
+            return "";
         }
 
-        return "";
+        bson_t root;
+        bson_init(&root);
+        append(m, &root);
+        std::string data((const char*)bson_get_data(&root), root.len);
+        bson_destroy(&root);
+        return data;
     }
     static void json(const vp&m, const std::string& space, std::string&root) {
         root.append("{").append(space);
@@ -234,59 +275,59 @@ public:
               case intf::t_i32:
               case intf::t_i64:
               case intf::t_dt:
-                root.append(x2struct::Util::tostr(iter->second._i64));
+                root.append(x2struct::Util::tostr(iter->second._v.i64));
                 break;
               case intf::t_bool:
-                root.append(iter->second._i64?"true":"false");
+                root.append(iter->second._v.i64?"true":"false");
                 break;
               case intf::t_double:
-                root.append(x2struct::Util::tostr(iter->second._db));
+                root.append(x2struct::Util::tostr(iter->second._v.db));
                 break;
               case intf::t_vi32:
-              case intf::t_vi64:{
-                    root.append("[").append(space);
-                    for (size_t i=0; i<iter->second._vi64.size(); ++i) {
-                        if (i > 0) {
-                            root.append(space).append(",").append(space);
-                        }
-                        root.append(x2struct::Util::tostr(iter->second._vi64[i]));
-                    }
-                    root.append(space).append("]");
-                }
+                json(iter->second.ref<vi32>(), space, root);
                 break;
-              case intf::t_vdouble: {
-                    root.append("[").append(space);
-                    for (size_t i=0; i<iter->second._vdb.size(); ++i) {
-                        if (i > 0) {
-                            root.append(space).append(",").append(space);
-                        }
-                        root.append(x2struct::Util::tostr(iter->second._vdb[i]));
-                    }
-                    root.append(space).append("]");
-                }
+              case intf::t_vi64:
+              case intf::t_vu32:
+                json(iter->second.ref<vi64>(), space, root);
+                break;
+              case intf::t_vdouble:
+                json(iter->second.ref<std::vector<double> >(), space, root);
                 break;
               case intf::t_s:
-                root.append("\"").append(iter->second._s).append("\"");
+                root.append("\"").append(iter->second.ref<std::string>()).append("\"");
                 break;
-              case intf::t_vs: {
-                    root.append("[").append(space);
-                    for (size_t i=0; i<iter->second._vs.size(); ++i) {
-                        if (i > 0) {
-                            root.append(space).append(",").append(space);
-                        }
-                        root.append("\"").append(iter->second._vs[i]).append("\"");
-                    }
-                    root.append(space).append("]");
-                }
+              case intf::t_vs:
+                json(iter->second.ref<vs>(), space, root);
                 break;
               case intf::t_mi:
-                json(iter->second._vp, space, root);
+                json(iter->second.ref<vp>(), space, root);
                 break;
             }
         }
 
         root.append(space).append("}");
     }
+    template <typename T>
+    static void json(const std::vector<T>&v, const std::string& space, std::string&root) {
+        root.append("[").append(space);
+        for (size_t i=0; i<v.size(); ++i) {
+            if (i > 0) {
+                root.append(space).append(",").append(space);
+            }
+            root.append(x2struct::Util::tostr(v[i]));
+        }
+        root.append(space).append("]");
+    }
+    static void json(const vs&v, const std::string& space, std::string&root) {
+        root.append("[").append(space);
+        for (size_t i=0; i<v.size(); ++i) {
+            if (i > 0) {
+                root.append(space).append(",").append(space);
+            }
+            root.append("\"").append(v[i]).append("\"");
+        }
+        root.append(space).append("]");
+    }
 };
 
 /*
@@ -295,7 +336,12 @@ if ret is not nil, data will return as bson_t* and !!!need to call bson_destroy(
 */
 //std::string build(const vp&m, _bson_t**ret, void*parent=0, const std::string&pname="", bool bdoc=false);
 inline std::string build(const vp&m, _bson_t*ret) {
-    return Convert::build(m, ret, "", Convert::bb_top);
+    return Convert::build(m, ret);
+}
+
+// append m to an initialized doc(e.g. a query filter being built), no intermediate copy
+inline void append(const vp&m, _bson_t*doc) {
+    Convert::append(m, doc);
 }
 
 // translate vp to json string
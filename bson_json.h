@@ -0,0 +1,574 @@
+﻿/*
+* Copyright (C) 2017 YY Inc. All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License"); 
+* you may not use this file except in compliance with the License. 
+* You may obtain a copy of the License at
+*
+*	http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, 
+* software distributed under the License is distributed on an "AS IS" BASIS, 
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. 
+* See the License for the specific language governing permissions and 
+* limitations under the License.
+*/
+
+#ifndef __X_BSON_JSON_H
+#define __X_BSON_JSON_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "thirdparty/rapidjson/reader.h"
+#include "thirdparty/rapidjson/writer.h"
+
+#include "util.h"
+#include "bson_native.h"
+
+// extended types of bson<->json transcoding, or-ed together
+#define X2STRUCT_BSON_JSON_OID      0x01    // ObjectId as {"$oid":"hex"}, else "hex"
+#define X2STRUCT_BSON_JSON_DATE     0x02    // date as {"$date":ms}, else ms
+#define X2STRUCT_BSON_JSON_LONG     0x04    // int64 as {"$numberLong":"n"}, else n(may lose precision in javascript)
+#define X2STRUCT_BSON_JSON_DEFAULT  (X2STRUCT_BSON_JSON_OID|X2STRUCT_BSON_JSON_DATE)   // libbson bson_as_json style
+
+namespace x2struct {
+
+/*
+  rapidjson SAX handler that appends the bson document of the json to out, no DOM and no struct.
+  numbers become int32 if they fit, else int64, else double. an object whose first key is
+  $oid/$date/$numberLong, if enabled in ext, is a wrapper of ObjectId/date/int64:
+  {"$oid":"24 hex"}, {"$date":ms}, {"$date":{"$numberLong":"ms"}}, {"$numberLong":"n"}.
+  a wrapper with a bad value or another member fails the parse, it is not kept as a normal
+  document like libbson relaxed mode does. if the type is not enabled it is a normal document.
+  out is only appended, so one string can collect many documents.
+*/
+class JsonToBson {
+    enum {
+        w_none,
+        w_oid,
+        w_date,
+        w_long,
+        w_date_object,  // {"$date":{ waiting for $numberLong
+        w_date_long,    // {"$date":{"$numberLong": waiting for the string
+        w_date_end,     // date written, waiting for the inner }
+        w_done,     // wrapped value written, waiting for the }
+    };
+    struct Level {
+        size_t start;   // offset of the length
+        bool array;
+        size_t count;
+    };
+public:
+    JsonToBson(std::string& out, int ext=X2STRUCT_BSON_JSON_DEFAULT):_out(out),_ext(ext),_pending(false),_wrap(w_none),_done(false) {
+    }
+    bool done() const {
+        return _done;
+    }
+
+    bool Null() {
+        return _wrap==w_none && head(xbson::t_null);
+    }
+    bool Bool(bool b) {
+        if (_wrap!=w_none || !head(xbson::t_bool)) {
+            return false;
+        }
+        _out.push_back(b?'\1':'\0');
+        return true;
+    }
+    bool Int(int i) {
+        return integer(i);
+    }
+    bool Uint(unsigned u) {
+        return integer((int64_t)u);
+    }
+    bool Int64(int64_t i) {
+        return integer(i);
+    }
+    bool Uint64(uint64_t u) {
+        if (u >= ((uint64_t)1<<63)) {
+            return Double((double)u);
+        }
+        return integer((int64_t)u);
+    }
+    bool Double(double d) {
+        if (_wrap!=w_none || !head(xbson::t_double)) {
+            return false;
+        }
+        uint64_t v;
+        memcpy(&v, &d, sizeof(v));
+        put64(v);
+        return true;
+    }
+    bool RawNumber(const char*, rapidjson::SizeType, bool) {
+        return false;
+    }
+    bool String(const char* str, rapidjson::SizeType len, bool) {
+        switch (_wrap) {
+          case w_none:
+            if (!head(xbson::t_utf8)) {
+                return false;
+            }
+            put32((uint32_t)len+1);
+            _out.append(str, len).push_back('\0');
+            return true;
+          case w_oid:
+            return oid(str, len);
+          case w_date_long: {
+            int64_t v;
+            if (!parse_int64(str, len, v)) {
+                return false;
+            }
+            head(xbson::t_date_time);
+            put64((uint64_t)v);
+            _wrap = w_date_end;
+            return true;
+          }
+          case w_long: {
+            int64_t v;
+            if (!parse_int64(str, len, v)) {
+                return false;
+            }
+            head(xbson::t_int64);
+            put64((uint64_t)v);
+            _wrap = w_done;
+            return true;
+          }
+          default:
+            return false;
+        }
+    }
+    bool StartObject() {
+        if (_wrap == w_date) {
+            _wrap = w_date_object;
+            return true;
+        } else if (_wrap != w_none) {
+            return false;
+        }
+        if (_levels.empty()) {
+            if (_done) {
+                return false;
+            }
+            open(false);
+            return true;
+        }
+        if (_pending && !flush_pending()) {
+            return false;
+        }
+        _pending = true;    // document or wrapper, the first key tells
+        return true;
+    }
+    bool Key(const char* str, rapidjson::SizeType len, bool) {
+        if (_wrap==w_date_object && len==11 && 0==memcmp(str, "$numberLong", 11)) {
+            _wrap = w_date_long;
+            return true;
+        } else if (_wrap != w_none) {
+            return false;   // a wrapper has only one member
+        }
+        if (0 != memchr(str, 0, len)) {
+            return false;   // bson key is a cstring, \u0000 would cut it
+        }
+        if (_pending) {
+            _wrap = wrapper(str, len);
+            if (_wrap != w_none) {
+                _pending = false;
+                return true;
+            }
+            if (!flush_pending()) {
+                return false;
+            }
+        }
+        _key.assign(str, len);
+        return true;
+    }
+    bool EndObject(rapidjson::SizeType) {
+        if (_wrap == w_date_end) {
+            _wrap = w_done;
+            return true;
+        } else if (_wrap == w_done) {
+            _wrap = w_none;
+            return true;
+        } else if (_wrap != w_none) {
+            return false;
+        }
+        if (_pending && !flush_pending()) {
+            return false;
+        }
+        return close();
+    }
+    bool StartArray() {
+        if (_wrap!=w_none || _levels.empty()) {
+            return false;   // bson top level is a document
+        }
+        if (_pending && !flush_pending()) {
+            return false;
+        }
+        if (!head(xbson::t_array)) {
+            return false;
+        }
+        open(true);
+        return true;
+    }
+    bool EndArray(rapidjson::SizeType) {
+        return close();
+    }
+private:
+    int wrapper(const char* key, size_t len) const {
+        if (len<4 || key[0]!='$') {
+            return w_none;
+        }
+        if ((_ext&X2STRUCT_BSON_JSON_OID) && len==4 && 0==memcmp(key, "$oid", 4)) {
+            return w_oid;
+        }
+        if ((_ext&X2STRUCT_BSON_JSON_DATE) && len==5 && 0==memcmp(key, "$date", 5)) {
+            return w_date;
+        }
+        if ((_ext&X2STRUCT_BSON_JSON_LONG) && len==11 && 0==memcmp(key, "$numberLong", 11)) {
+            return w_long;
+        }
+        return w_none;
+    }
+    bool flush_pending() {
+        _pending = false;
+        if (!head(xbson::t_document)) {
+            return false;
+        }
+        open(false);
+        return true;
+    }
+    bool integer(int64_t v) {
+        if (_wrap == w_date) {
+            head(xbson::t_date_time);
+            put64((uint64_t)v);
+            _wrap = w_done;
+            return true;
+        } else if (_wrap != w_none) {
+            return false;
+        }
+        if (v>=-2147483647-1 && v<=2147483647) {
+            if (!head(xbson::t_int32)) {
+                return false;
+            }
+            put32((uint32_t)v);
+        } else {
+            if (!head(xbson::t_int64)) {
+                return false;
+            }
+            put64((uint64_t)v);
+        }
+        return true;
+    }
+    bool oid(const char* str, size_t len) {
+        if (len != 24) {
+            return false;
+        }
+        char bytes[12];
+        for (size_t i=0; i<12; ++i) {
+            int h = hex(str[2*i]);
+            int l = hex(str[2*i+1]);
+            if (h<0 || l<0) {
+                return false;
+            }
+            bytes[i] = (char)(h<<4|l);
+        }
+        head(xbson::t_oid);
+        _out.append(bytes, 12);
+        _wrap = w_done;
+        return true;
+    }
+    static int hex(char c) {
+        if (c>='0' && c<='9') {
+            return c-'0';
+        } else if (c>='a' && c<='f') {
+            return c-'a'+10;
+        } else if (c>='A' && c<='F') {
+            return c-'A'+10;
+        }
+        return -1;
+    }
+    static bool parse_int64(const char* s, size_t len, int64_t& v) {
+        size_t i = (len>0 && s[0]=='-')?1:0;
+        if (i == len) {
+            return false;
+        }
+        uint64_t u = 0;
+        for (; i<len; ++i) {
+            if (s[i]<'0' || s[i]>'9' || u>((uint64_t)1<<63)/10) {
+                return false;
+            }
+            u = u*10+(uint64_t)(s[i]-'0');
+        }
+        if (s[0] == '-') {
+            if (u > ((uint64_t)1<<63)) {
+                return false;
+            }
+            v = (int64_t)(0-u);
+        } else {
+            if (u >= ((uint64_t)1<<63)) {
+                return false;
+            }
+            v = (int64_t)u;
+        }
+        return true;
+    }
+
+    // type and key of the next element, key is the array index inside an array
+    bool head(uint8_t type) {
+        if (_levels.empty()) {
+            return false;
+        }
+        _out.push_back((char)type);
+        Level& l = _levels.back();
+        if (l.array) {
+            BsonIndexKey index(l.count++);
+            _out.append(index.key().name, index.key().len);
+        } else {
+            _out.append(_key);
+        }
+        _out.push_back('\0');
+        return true;
+    }
+    void open(bool array) {
+        Level l;
+        l.start = _out.size();
+        l.array = array;
+        l.count = 0;
+        _levels.push_back(l);
+        _out.append(4, '\0');
+    }
+    bool close() {
+        if (_levels.empty()) {
+            return false;
+        }
+        _out.push_back('\0');
+        size_t start = _levels.back().start;
+        xbson::put32(&_out[start], (uint32_t)(_out.size()-start));
+        _levels.pop_back();
+        _done = _levels.empty();
+        return true;
+    }
+    void put32(uint32_t v) {
+        char b[4];
+        xbson::put32(b, v);
+        _out.append(b, 4);
+    }
+    void put64(uint64_t v) {
+        char b[8];
+        xbson::put64(b, v);
+        _out.append(b, 8);
+    }
+
+    std::string& _out;
+    int _ext;
+    std::vector<Level> _levels;
+    std::string _key;
+    bool _pending;      // { seen in a document, not yet known to be a document or a wrapper
+    int _wrap;
+    bool _done;
+};
+
+/*
+  bson document to json events of a rapidjson Writer/PrettyWriter, so the json goes straight to
+  the writer's stream(StringBuffer, XOStream...) without a temporary string or a struct.
+  ObjectId/date/int64 follow ext, other extended types are written in the libbson legacy form
+  ({"$binary":..,"$type":..}, {"$timestamp":{"t":..,"i":..}} ...). decimal128, dbpointer and
+  code with scope are not supported.
+*/
+class BsonJson {
+public:
+    template <class WRITER>
+    static void tojson(const uint8_t* data, size_t length, WRITER& w, int ext=X2STRUCT_BSON_JSON_DEFAULT) {
+        if (length<5 || xbson::get32(data)!=length || 0!=data[length-1]) {
+            xbson::bad("document length");
+        }
+        w.StartObject();
+        elements(data+4, data+length-1, false, w, ext);
+        w.EndObject();
+    }
+
+    // parse json from a rapidjson input stream(StringStream, FileReadStream...), append the bson to out
+    template <class INSTREAM>
+    static void tobson(INSTREAM& is, std::string& out, int ext=X2STRUCT_BSON_JSON_DEFAULT) {
+        size_t size = out.size();
+        JsonToBson h(out, ext);
+        rapidjson::Reader reader;
+        rapidjson::ParseResult r = reader.Parse(is, h);
+        if (r.IsError() || !h.done()) {
+            out.resize(size);
+            throw std::runtime_error("Json to bson fail at offset "+Util::tostr((int64_t)r.Offset()));
+        }
+    }
+private:
+    template <class WRITER>
+    static void elements(const uint8_t* p, const uint8_t* end, bool array, WRITER& w, int ext) {
+        xbson::Elem e;
+        for (; xbson::parse(p, end, e); p = e.next) {
+            if (!array) {
+                w.Key(e.key, (rapidjson::SizeType)((const char*)e.value-e.key-1));
+            }
+            value(e, w, ext);
+        }
+    }
+    template <class WRITER>
+    static void value(const xbson::Elem& e, WRITER& w, int ext) {
+        const uint8_t* v = e.value;
+        switch (e.type) {
+          case xbson::t_double: {
+                uint64_t u = xbson::get64(v);
+                double d;
+                memcpy(&d, &u, sizeof(d));
+                if (!w.Double(d)) {
+                    throw std::runtime_error("Bson to json: nan or inf");
+                }
+            }
+            break;
+          case xbson::t_utf8:
+          case xbson::t_symbol:
+            w.String((const char*)v+4, (rapidjson::SizeType)(xbson::get32(v)-1));
+            break;
+          case xbson::t_document:
+          case xbson::t_array: {
+                bool array = e.type==xbson::t_array;
+                if (array) {
+                    w.StartArray();
+                } else {
+                    w.StartObject();
+                }
+                elements(v+4, e.next-1, array, w, ext);
+                if (array) {
+                    w.EndArray();
+                } else {
+                    w.EndObject();
+                }
+            }
+            break;
+          case xbson::t_binary: {
+                std::string b64;
+                base64(v+5, xbson::get32(v), b64);
+                char type[3] = {hexc(v[4]>>4), hexc(v[4]&0xf), '\0'};
+                w.StartObject();
+                w.Key("$binary", 7);
+                w.String(b64.data(), (rapidjson::SizeType)b64.length());
+                w.Key("$type", 5);
+                w.String(type, 2);
+                w.EndObject();
+            }
+            break;
+          case xbson::t_undefined:
+            w.StartObject();
+            w.Key("$undefined", 10);
+            w.Bool(true);
+            w.EndObject();
+            break;
+          case xbson::t_oid: {
+                char hex[24];
+                for (int i=0; i<12; ++i) {
+                    hex[2*i] = hexc(v[i]>>4);
+                    hex[2*i+1] = hexc(v[i]&0xf);
+                }
+                if (ext & X2STRUCT_BSON_JSON_OID) {
+                    w.StartObject();
+                    w.Key("$oid", 4);
+                    w.String(hex, 24);
+                    w.EndObject();
+                } else {
+                    w.String(hex, 24);
+                }
+            }
+            break;
+          case xbson::t_bool:
+            w.Bool(v[0] != 0);
+            break;
+          case xbson::t_date_time:
+            if (ext & X2STRUCT_BSON_JSON_DATE) {
+                w.StartObject();
+                w.Key("$date", 5);
+                w.Int64((int64_t)xbson::get64(v));
+                w.EndObject();
+            } else {
+                w.Int64((int64_t)xbson::get64(v));
+            }
+            break;
+          case xbson::t_null:
+            w.Null();
+            break;
+          case xbson::t_regex: {
+                size_t plen = strlen((const char*)v);
+                w.StartObject();
+                w.Key("$regex", 6);
+                w.String((const char*)v, (rapidjson::SizeType)plen);
+                w.Key("$options", 8);
+                w.String((const char*)v+plen+1, (rapidjson::SizeType)(e.next-v-plen-2));
+                w.EndObject();
+            }
+            break;
+          case xbson::t_code:
+            w.StartObject();
+            w.Key("$code", 5);
+            w.String((const char*)v+4, (rapidjson::SizeType)(xbson::get32(v)-1));
+            w.EndObject();
+            break;
+          case xbson::t_int32:
+            w.Int((int32_t)xbson::get32(v));
+            break;
+          case xbson::t_timestamp:
+            w.StartObject();
+            w.Key("$timestamp", 10);
+            w.StartObject();
+            w.Key("t", 1);
+            w.Uint(xbson::get32(v+4));
+            w.Key("i", 1);
+            w.Uint(xbson::get32(v));
+            w.EndObject();
+            w.EndObject();
+            break;
+          case xbson::t_int64:
+            if (ext & X2STRUCT_BSON_JSON_LONG) {
+                std::string n = Util::tostr((int64_t)xbson::get64(v));
+                w.StartObject();
+                w.Key("$numberLong", 11);
+                w.String(n.data(), (rapidjson::SizeType)n.length());
+                w.EndObject();
+            } else {
+                w.Int64((int64_t)xbson::get64(v));
+            }
+            break;
+          case xbson::t_minkey:
+          case xbson::t_maxkey:
+            w.StartObject();
+            w.Key(e.type==xbson::t_minkey?"$minKey":"$maxKey", 7);
+            w.Int(1);
+            w.EndObject();
+            break;
+          default:
+            throw std::runtime_error("Bson to json: unsupported type "+Util::tostr((int)e.type));
+        }
+    }
+    static char hexc(int v) {
+        return "0123456789abcdef"[v&0xf];
+    }
+    static void base64(const uint8_t* p, size_t n, std::string& out) {
+        static const char* t = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        out.reserve((n+2)/3*4);
+        for (size_t i=0; i<n; i+=3) {
+            uint32_t v = (uint32_t)p[i]<<16;
+            if (i+1 < n) {
+                v |= (uint32_t)p[i+1]<<8;
+            }
+            if (i+2 < n) {
+                v |= p[i+2];
+            }
+            out.push_back(t[v>>18]);
+            out.push_back(t[(v>>12)&0x3f]);
+            out.push_back(i+1<n?t[(v>>6)&0x3f]:'=');
+            out.push_back(i+2<n?t[v&0x3f]:'=');
+        }
+    }
+};
+
+}
+
+#endif
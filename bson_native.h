@@ -0,0 +1,873 @@
+﻿/*
+* Copyright (C) 2017 YY Inc. All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License"); 
+* you may not use this file except in compliance with the License. 
+* You may obtain a copy of the License at
+*
+*	http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, 
+* software distributed under the License is distributed on an "AS IS" BASIS, 
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. 
+* See the License for the specific language governing permissions and 
+* limitations under the License.
+*/
+
+#ifndef __X_BSON_NATIVE_H
+#define __X_BSON_NATIVE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <stdexcept>
+
+#include "util.h"
+#include "xreader.h"
+#include "xtypes.h"
+#include "bson_packed.h"
+
+#define X2STRUCT_BSON_NATIVE_WRAPS 4    // out of order lookups before a sub-document gets a sorted index
+
+namespace x2struct {
+
+/*
+  bson codec without libbson, header only like json/xml.
+  BsonNativeWriter output is byte for byte the same as BsonWriter, BsonNativeReader reads what
+  BsonReader reads with the same conversions. X::tobson/loadbson use them if XTOSTRUCT_BSON_NATIVE
+  is defined, which doesn't need libbson at all.
+  BsonNativeWriter has no parallel mode, BsonWriter::parallel is libbson only.
+*/
+namespace xbson {
+
+enum {
+    t_double = 0x01,
+    t_utf8 = 0x02,
+    t_document = 0x03,
+    t_array = 0x04,
+    t_binary = 0x05,
+    t_undefined = 0x06,
+    t_oid = 0x07,
+    t_bool = 0x08,
+    t_date_time = 0x09,
+    t_null = 0x0A,
+    t_regex = 0x0B,
+    t_dbpointer = 0x0C,
+    t_code = 0x0D,
+    t_symbol = 0x0E,
+    t_codewscope = 0x0F,
+    t_int32 = 0x10,
+    t_timestamp = 0x11,
+    t_int64 = 0x12,
+    t_decimal128 = 0x13,
+    t_maxkey = 0x7F,
+    t_minkey = 0xFF
+};
+
+inline uint32_t get32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+inline uint64_t get64(const uint8_t* p) {
+    return (uint64_t)get32(p) | ((uint64_t)get32(p+4)<<32);
+}
+inline void put32(char* p, uint32_t v) {
+    p[0] = (char)v;
+    p[1] = (char)(v>>8);
+    p[2] = (char)(v>>16);
+    p[3] = (char)(v>>24);
+}
+inline void put64(char* p, uint64_t v) {
+    put32(p, (uint32_t)v);
+    put32(p+4, (uint32_t)(v>>32));
+}
+
+// element of a document: type, key, value. next is where the following element starts
+struct Elem {
+    const uint8_t* head;
+    const char* key;
+    const uint8_t* value;
+    const uint8_t* next;
+    uint8_t type;
+};
+
+inline void bad(const char* what) {
+    throw std::runtime_error(std::string("Bad bson: ")+what);
+}
+
+// parse element at p, end is the terminator of the document. false at the terminator
+inline bool parse(const uint8_t* p, const uint8_t* end, Elem& e) {
+    if (p>=end || 0==*p) {
+        return false;
+    }
+    e.head = p;
+    e.type = *p;
+    e.key = (const char*)p+1;
+    const uint8_t* z = (const uint8_t*)memchr(p+1, 0, (size_t)(end-p-1));
+    if (0 == z) {
+        bad("key not terminated");
+    }
+    const uint8_t* v = z+1;
+    size_t left = (size_t)(end-v);
+    size_t size = 0;
+    switch (e.type) {
+      case t_double: case t_date_time: case t_timestamp: case t_int64:
+        size = 8;
+        break;
+      case t_int32:
+        size = 4;
+        break;
+      case t_bool:
+        size = 1;
+        break;
+      case t_oid:
+        size = 12;
+        break;
+      case t_decimal128:
+        size = 16;
+        break;
+      case t_undefined: case t_null: case t_maxkey: case t_minkey:
+        size = 0;
+        break;
+      case t_utf8: case t_code: case t_symbol:
+        if (left < 4 || get32(v) < 1) {
+            bad("string length");
+        }
+        size = 4+(size_t)get32(v);
+        break;
+      case t_dbpointer:
+        if (left < 4) {
+            bad("dbpointer length");
+        }
+        size = 4+(size_t)get32(v)+12;
+        break;
+      case t_document: case t_array: case t_codewscope:
+        if (left < 4 || get32(v) < 5) {
+            bad("document length");
+        }
+        size = (size_t)get32(v);
+        break;
+      case t_binary:
+        if (left < 5) {
+            bad("binary length");
+        }
+        size = 5+(size_t)get32(v);
+        break;
+      case t_regex: {
+        const uint8_t* a = (const uint8_t*)memchr(v, 0, left);
+        const uint8_t* b = (0==a)?0:(const uint8_t*)memchr(a+1, 0, (size_t)(end-a-1));
+        if (0 == b) {
+            bad("regex not terminated");
+        }
+        size = (size_t)(b+1-v);
+        break;
+      }
+      default:
+        bad("unknown type");
+    }
+    if (size > left) {
+        bad("value out of document");
+    }
+    if ((e.type==t_document || e.type==t_array) && 0!=v[size-1]) {
+        bad("document not terminated");
+    }
+    e.value = v;
+    e.next = v+size;
+    return true;
+}
+
+/*
+  shared by all readers of one document, owned by the root reader.
+  entries are sorted child indexes of the sub-documents that needed one, readers keep offsets.
+*/
+struct Doc {
+    struct EntryLess {
+        bool operator()(const Elem& a, const Elem& b) const {
+            return strcmp(a.key, b.key) < 0;
+        }
+    };
+    struct EntryOrder {     // keys point into the document, equal keys keep document order
+        bool operator()(const Elem& a, const Elem& b) const {
+            int c = strcmp(a.key, b.key);
+            return c<0 || (c==0 && a.key<b.key);
+        }
+    };
+    std::string data;
+    std::vector<Elem> entries;
+};
+
+}
+
+/*
+  same lookup as BsonReader: members are found by a cursor moving forward from the last match,
+  a sorted index is built only after a key is missing or lookups keep wrapping around,
+  array elements are visited by a sequential cursor. nothing is copied unless copy is true.
+*/
+class BsonNativeReader:public XReader<BsonNativeReader> {
+public:
+    using xdoc_type::convert;
+    BsonNativeReader(const uint8_t*data, size_t length, bool copy=true):xdoc_type(0, ""),_doc(new xbson::Doc) {
+        try {
+            init(data, length, copy);
+        } catch (...) {
+            delete _doc;
+            throw;
+        }
+    }
+    BsonNativeReader(const std::string&data, bool copy=true):xdoc_type(0, ""),_doc(new xbson::Doc) {
+        try {
+            init((const uint8_t*)data.data(), data.length(), copy);
+        } catch (...) {
+            delete _doc;
+            throw;
+        }
+    }
+    ~BsonNativeReader() {
+        if (0 != _doc) {
+            delete _doc;
+        }
+    }
+public:
+    void convert(std::string &val) {
+        if (_valid && _e.type==xbson::t_utf8) {
+            val.assign((const char*)_e.value+4, xbson::get32(_e.value)-1);
+        }
+    }
+    void convert(XStrView &val) {
+        if (0==_pool || !_pool->data.empty()) {
+            throw std::runtime_error("XStrView needs a zero-copy BsonNativeReader(copy=false)");
+        }
+        if (_valid && _e.type==xbson::t_utf8) {
+            val = XStrView((const char*)_e.value+4, xbson::get32(_e.value)-1);
+        }
+    }
+    // packed arithmetic vector(option pk, see BsonPacked) is detected by binary subtype
+    template <typename TYPE>
+    void convert(std::vector<TYPE> &val) {
+        if (_valid && !_top && _e.type==xbson::t_binary) {
+            int subtype = _e.value[4];
+            if (BsonPack::packed(subtype) && BsonPack::unpack(subtype, _e.value+5, xbson::get32(_e.value), val)) {
+                return;
+            }
+        }
+        xdoc_type::convert(val);
+    }
+    void convert(bool &val) {
+        val = (bool)as_int64();
+    }
+    void convert(int16_t &val) {
+        val = (int16_t)as_int64();
+    }
+    void convert(uint16_t &val) {
+        val = (uint16_t)as_int64();
+    }
+    void convert(int32_t &val) {
+        val = (int32_t)as_int64();
+    }
+    void convert(uint32_t &val) {
+        val = (uint32_t)as_int64();
+    }
+    void convert(int64_t &val) {
+        val = as_int64();
+    }
+    void convert(uint64_t &val) {
+        val = (uint64_t)as_int64();
+    }
+    void convert(double &val) {
+        val = as_double();
+    }
+    void convert(float &val) {
+        val = (float)as_double();
+    }
+
+    const std::string& type() {
+        static std::string t("bson");
+        return t;
+    }
+    bool has(const char*key) {
+        xbson::Elem e;
+        return find(key, e);
+    }
+    bool null() const {
+        return !_top && _valid && xbson::t_null==_e.type;
+    }
+    size_t size(bool to_vec=true) {
+        (void)to_vec;
+        if (!_valid || _top || xbson::t_array!=_e.type) {
+            return 0;
+        }
+        if (_count == npos) {
+            xbson::Elem c;
+            c.next = _begin;
+            for (_count=0; xbson::parse(c.next, _end, c); ++_count) {
+            }
+        }
+        return _count;
+    }
+    BsonNativeReader operator[](const char *key) {
+        xbson::Elem e;
+        if (find(key, e)) {
+            return BsonNativeReader(&e, this, e.key);
+        } else {
+            throw std::runtime_error(std::string("Did not have ")+key);
+        }
+    }
+    BsonNativeReader operator[](size_t index) {
+        if (index < size()) {
+            if (!_cursor_init || _cursor_pos>index+1) { // sequential access is the common case, restart only when going back
+                reset();
+            }
+            while (_cursor_pos <= index) {
+                xbson::parse(_cursor.next, _end, _cursor);
+                ++_cursor_pos;
+            }
+            return BsonNativeReader(&_cursor, this, index);
+        } else {
+            throw std::runtime_error("Out of index");
+        }
+    }
+    BsonNativeReader begin() {
+        if (reset() && xbson::parse(_cursor.next, _end, _cursor)) {
+            ++_cursor_pos;
+            return BsonNativeReader(&_cursor, this, _cursor.key);
+        } else {
+            return BsonNativeReader(0, this, "");
+        }
+    }
+    BsonNativeReader next() {
+        if (0==_parent || !_parent->_valid) {
+            throw std::runtime_error("parent null");
+        }
+        if (xbson::parse(_parent->_cursor.next, _parent->_end, _parent->_cursor)) {
+            ++_parent->_cursor_pos;
+            return BsonNativeReader(&_parent->_cursor, _parent, _parent->_cursor.key);
+        } else {
+            return BsonNativeReader(0, _parent, "");
+        }
+    }
+    operator bool() const {
+        return _valid;
+    }
+
+private:
+    static const size_t npos = (size_t)-1;
+
+    void init(const uint8_t*data, size_t length, bool copy) {
+        if (length>0 && length<5) {
+            xbson::bad("document length");
+        }
+        uint32_t len = xbson::get32(data);
+        if (len<5 || (length>0 && len>length)) {
+            xbson::bad("document length");
+        }
+        if (copy) {
+            _doc->data.assign((const char*)data, len);
+            data = (const uint8_t*)_doc->data.data();
+        }
+        if (0 != data[len-1]) {
+            xbson::bad("document not terminated");
+        }
+        _pool = _doc;
+        _top = true;
+        _valid = true;
+        _e.type = xbson::t_document;
+        _e.value = data;
+        _begin = data+4;
+        _end = data+len-1;
+        init_state();
+    }
+    BsonNativeReader(const xbson::Elem* e, const BsonNativeReader*parent, const char*key):xdoc_type(parent, key) {
+        init_child(e, parent);
+    }
+    BsonNativeReader(const xbson::Elem* e, const BsonNativeReader*parent, size_t index):xdoc_type(parent, index) {
+        init_child(e, parent);
+    }
+    void init_child(const xbson::Elem* e, const BsonNativeReader*parent) {
+        _doc = 0;
+        _pool = (0!=parent)?parent->_pool:0;
+        _top = false;
+        _valid = (0 != e);
+        _begin = 0;
+        _end = 0;
+        if (_valid) {
+            _e = *e;
+            if (_e.type==xbson::t_document || _e.type==xbson::t_array) {
+                _begin = _e.value+4;
+                _end = _e.next-1;
+            }
+        }
+        init_state();
+    }
+    void init_state() {
+        _cursor_init = false;
+        _cursor_pos = 0;
+        _count = npos;
+        _wraps = 0;
+        _indexed = false;
+        _idx_begin = 0;
+        _idx_end = 0;
+    }
+
+    // bson_iter_as_int64 and bson_iter_double of libbson
+    int64_t as_int64() const {
+        if (!_valid) {
+            return 0;
+        }
+        switch (_e.type) {
+          case xbson::t_bool:
+            return 0!=_e.value[0];
+          case xbson::t_double:
+            return (int64_t)as_double();
+          case xbson::t_int64:
+            return (int64_t)xbson::get64(_e.value);
+          case xbson::t_int32:
+            return (int32_t)xbson::get32(_e.value);
+          default:
+            return 0;
+        }
+    }
+    double as_double() const {
+        double d = 0;
+        if (_valid && _e.type==xbson::t_double) {
+            uint64_t v = xbson::get64(_e.value);
+            memcpy(&d, &v, sizeof(d));
+        }
+        return d;
+    }
+
+    // cursor before the first child, false if this is not a document/array
+    bool reset() {
+        _cursor_init = (0 != _begin);
+        _cursor_pos = 0;
+        _cursor.next = _begin;
+        return _cursor_init;
+    }
+    bool find(const char* key, xbson::Elem& e) {
+        if (_indexed) {
+            return index_find(key, e);
+        }
+        if (!_cursor_init && !reset()) {
+            return false;
+        }
+        // has() is followed by operator[] with the same key
+        if (_cursor_pos>0 && 0==strcmp(_cursor.key, key)) {
+            e = _cursor;
+            return true;
+        }
+        xbson::Elem c = _cursor;
+        size_t pos = _cursor_pos;
+        while (xbson::parse(c.next, _end, c)) {
+            ++pos;
+            if (0 == strcmp(c.key, key)) {
+                return found(c, pos, e);
+            }
+        }
+        // wrap around, up to the cursor
+        size_t limit = _cursor_pos;
+        c.next = _begin;
+        for (pos=0; pos<limit && xbson::parse(c.next, _end, c);) {
+            ++pos;
+            if (0 == strcmp(c.key, key)) {
+                if (++_wraps >= X2STRUCT_BSON_NATIVE_WRAPS) {
+                    build_index();
+                }
+                return found(c, pos, e);
+            }
+        }
+        build_index(); // missing key costs a full scan, later lookups use the index
+        return false;
+    }
+    bool found(const xbson::Elem& c, size_t pos, xbson::Elem& e) {
+        _cursor = c;
+        _cursor_pos = pos;
+        e = c;
+        return true;
+    }
+    void build_index() {
+        std::vector<xbson::Elem>& entries = _pool->entries;
+        _indexed = true;
+        _idx_begin = entries.size();
+        xbson::Elem c;
+        c.next = _begin;
+        while (xbson::parse(c.next, _end, c)) {
+            entries.push_back(c);
+        }
+        _idx_end = entries.size();
+        std::sort(entries.begin()+_idx_begin, entries.end(), xbson::Doc::EntryOrder());
+    }
+    bool index_find(const char* key, xbson::Elem& e) const {
+        const std::vector<xbson::Elem>& entries = _pool->entries;
+        xbson::Elem k;
+        k.key = key;
+        std::vector<xbson::Elem>::const_iterator r;
+        r = std::lower_bound(entries.begin()+_idx_begin, entries.begin()+_idx_end, k, xbson::Doc::EntryLess());
+        if (r!=entries.begin()+_idx_end && 0==strcmp(r->key, key)) {
+            e = *r;
+            return true;
+        }
+        return false;
+    }
+
+    xbson::Doc *_doc;     // root only
+    xbson::Doc *_pool;    // root's _doc
+
+    xbson::Elem _e;       // this value, value is the document itself for root
+    const uint8_t* _begin;      // first child, 0 if not a document/array
+    const uint8_t* _end;        // terminator of the document
+    bool _top;
+    bool _valid;
+
+    mutable xbson::Elem _cursor;  // child at _cursor_pos-1, next is the one after
+    bool _cursor_init;
+    mutable size_t _cursor_pos;
+    size_t _count;              // array size, npos if not counted yet
+    int _wraps;
+    bool _indexed;              // child index, pool->entries[_idx_begin, _idx_end)
+    size_t _idx_begin;
+    size_t _idx_end;
+};
+
+/*
+  the whole document is built in one std::string: child documents and arrays are written in place
+  and their length patched when they end, nothing is allocated but the output.
+  the output can be the caller's string, documents are appended to it and reuse its capacity.
+*/
+class BsonNativeWriter {
+public:
+    BsonNativeWriter():_out(&_own),_omit_default(false),_done(false),_depth(0) {
+        begin();
+    }
+    /* append a document to out. call done() when it is complete, a writer destroyed
+       before that(e.g. convert threw) truncates out back to where the document started */
+    explicit BsonNativeWriter(std::string& out):_out(&out),_omit_default(false),_done(false),_depth(0) {
+        begin();
+    }
+    ~BsonNativeWriter() {
+        if (_out == &_own) {
+            return;
+        }
+        if (_done) {
+            _out->push_back('\0');
+            xbson::put32(&(*_out)[_start], (uint32_t)(_out->size()-_start));
+        } else {
+            _out->resize(_start);
+        }
+    }
+    // the document appended to out is complete, see BsonNativeWriter(std::string&)
+    void done() {
+        _done = true;
+    }
+public:
+    std::string toStr() const {
+        std::string doc(*_out, _start, std::string::npos);
+        doc.push_back('\0');
+        xbson::put32(&doc[0], (uint32_t)doc.length());
+        return doc;
+    }
+    const std::string&type() {
+        static std::string t("bson");
+        return t;
+    }
+    // skip member with default value(0, false, empty string/container), see Util::is_default
+    void omit_default(bool omit) {
+        _omit_default = omit;
+    }
+    bool omit_default() const {
+        return _omit_default;
+    }
+
+    BsonNativeWriter& convert(const XKey& key, const char* data) {
+        return utf8(key, data, strlen(data));
+    }
+    BsonNativeWriter& convert(const XKey& key, const std::string& data) {
+        return utf8(key, data.data(), data.length());
+    }
+    BsonNativeWriter& convert(const XKey& key, const XStrView& data) {
+        return utf8(key, data.data(), data.size());
+    }
+    BsonNativeWriter& convert(const XKey& key, int16_t data) {
+        return int32(key, (int32_t)data);
+    }
+    BsonNativeWriter& convert(const XKey& key, uint16_t data) {
+        return int32(key, (int32_t)data);
+    }
+    BsonNativeWriter& convert(const XKey& key, int32_t data) {
+        return int32(key, data);
+    }
+    BsonNativeWriter& convert(const XKey& key, uint32_t data) {
+        return int32(key, (int32_t)data);
+    }
+    BsonNativeWriter& convert(const XKey& key, int64_t data) {
+        xbson::put64(element(xbson::t_int64, key, 8), (uint64_t)data);
+        return *this;
+    }
+    BsonNativeWriter& convert(const XKey& key, uint64_t data) {
+        xbson::put64(element(xbson::t_int64, key, 8), data);
+        return *this;
+    }
+    BsonNativeWriter& convert(const XKey& key, float data) {
+        return convert(key, (double)data);
+    }
+    BsonNativeWriter& convert(const XKey& key, double data) {
+        uint64_t v;
+        memcpy(&v, &data, sizeof(v));
+        xbson::put64(element(xbson::t_double, key, 8), v);
+        return *this;
+    }
+    BsonNativeWriter& convert(const XKey& key, bool data) {
+        *element(xbson::t_bool, key, 1) = data?1:0;
+        return *this;
+    }
+
+    template<typename T>
+    BsonNativeWriter& convert(const XKey& key, const std::vector<T>&data) {
+        size_t doc = begin_doc(xbson::t_array, key);
+        BsonIndexKey k;
+        for (size_t i=0; i<data.size(); ++i, k.next()) {
+            convert(k.key(), data[i]);
+        }
+        end_doc(doc);
+        return *this;
+    }
+    // arithmetic vector as one binary, see BsonPacked and option pk. other vectors are written as array
+    template<typename T>
+    BsonNativeWriter& convert_packed(const XKey& key, const std::vector<T>&data) {
+        if (0 == BsonPacked<T>::code) {
+            return convert(key, data);
+        }
+        std::vector<uint8_t> swap;
+        size_t len = data.size()*sizeof(T);
+        char* p = element(xbson::t_binary, key, 5+len);
+        xbson::put32(p, (uint32_t)len);
+        p[4] = (char)(X2STRUCT_BSON_PACKED+BsonPacked<T>::code);
+        memcpy(p+5, BsonPack::bytes(data, swap), len);
+        return *this;
+    }
+    template<typename T>
+    BsonNativeWriter& convert(const XKey& key, const std::set<T>&data) {
+        size_t doc = begin_doc(xbson::t_array, key);
+        BsonIndexKey k;
+        for (typename std::set<T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter,k.next()) {
+            convert(k.key(), *iter);
+        }
+        end_doc(doc);
+        return *this;
+    }
+    template<typename T>
+    BsonNativeWriter& convert(const XKey& key, const std::map<std::string, T>&data) {
+        size_t doc = open(key);
+        for (typename std::map<std::string, T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
+            convert(XKey(iter->first), iter->second);
+        }
+        close(doc);
+        return *this;
+    }
+    template <typename K, typename T>
+    BsonNativeWriter& convert(const XKey& key, const std::map<K, T> &data) {
+        size_t doc = open(key);
+        for (typename std::map<K, T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
+            convert(Util::tostr(iter->first), iter->second);
+        }
+        close(doc);
+        return *this;
+    }
+
+    template <typename T>
+    BsonNativeWriter& convert(const XKey& key, const T& data) {
+        size_t doc = open(key);
+        data.__struct_to_str(*this, "");
+        close(doc);
+        return *this;
+    }
+
+    template <typename T>
+    void convert(const XKey& key, const XType<T>& data) {
+        data.__struct_to_str(*this, key);
+    }
+
+    // splice cached document, the bytes are shared with BsonWriter
+    template <typename T>
+    BsonNativeWriter& convert(const XKey& key, const XCached<T>& data) {
+        if (_omit_default || (0==_depth && key.empty())) {
+            return this->convert(key, data.get());
+        }
+        const std::string* bytes = data.cache_get(X2STRUCT_CACHE_BSON);
+        if (0 == bytes) {
+            BsonNativeWriter writer;
+            writer.convert("", data.get());
+            std::string str = writer.toStr();
+            bytes = &data.cache_set(X2STRUCT_CACHE_BSON, str);
+        }
+        memcpy(element(xbson::t_document, key, bytes->length()), bytes->data(), bytes->length());
+        return *this;
+    }
+
+    // delta encoding, see X::tobson_delta and JsonWriterT::convert_delta
+    BsonNativeWriter& convert_delta(const XKey& key, const std::string& cur, const std::string& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonNativeWriter& convert_delta(const XKey& key, const XStrView& cur, const XStrView& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonNativeWriter& convert_delta(const XKey& key, bool cur, bool base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonNativeWriter& convert_delta(const XKey& key, int16_t cur, int16_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonNativeWriter& convert_delta(const XKey& key, uint16_t cur, uint16_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonNativeWriter& convert_delta(const XKey& key, int32_t cur, int32_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonNativeWriter& convert_delta(const XKey& key, uint32_t cur, uint32_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonNativeWriter& convert_delta(const XKey& key, int64_t cur, int64_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonNativeWriter& convert_delta(const XKey& key, uint64_t cur, uint64_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonNativeWriter& convert_delta(const XKey& key, double cur, double base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonNativeWriter& convert_delta(const XKey& key, float cur, float base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    template <typename T>
+    BsonNativeWriter& convert_delta(const XKey& key, const std::vector<T>& cur, const std::vector<T>& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    template <typename T>
+    BsonNativeWriter& convert_delta(const XKey& key, const std::set<T>& cur, const std::set<T>& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    template <typename T>
+    void convert_delta(const XKey& key, const XType<T>& cur, const XType<T>& base) {
+        (void)base;
+        convert(key, cur);
+    }
+    // removed key is written as null
+    template <typename K, typename T>
+    BsonNativeWriter& convert_delta(const XKey& key, const std::map<K, T>& cur, const std::map<K, T>& base) {
+        size_t doc = open(key);
+        typename std::map<K, T>::const_iterator ib = base.begin();
+        for (typename std::map<K, T>::const_iterator ic=cur.begin(); ic!=cur.end(); ++ic) {
+            for (; ib!=base.end() && ib->first<ic->first; ++ib) {
+                element(xbson::t_null, Util::tostr(ib->first), 0);
+            }
+            if (ib!=base.end() && !(ic->first<ib->first)) {
+                if (!Util::equal(ic->second, ib->second)) {
+                    this->convert_delta(Util::tostr(ic->first), ic->second, ib->second);
+                }
+                ++ib;
+            } else {
+                this->convert(Util::tostr(ic->first), ic->second);
+            }
+        }
+        for (; ib!=base.end(); ++ib) {
+            element(xbson::t_null, Util::tostr(ib->first), 0);
+        }
+        close(doc);
+        return *this;
+    }
+    template <typename T>
+    BsonNativeWriter& convert_delta(const XKey& key, const T& cur, const T& base) {
+        size_t doc = open(key);
+        cur.__struct_to_delta(*this, base);
+        close(doc);
+        return *this;
+    }
+private:
+    BsonNativeWriter(const BsonNativeWriter&);
+    BsonNativeWriter& operator=(const BsonNativeWriter&);
+
+    void begin() {
+        _start = _out->size();
+        _out->append(4, '\0');
+    }
+    // type + key + '\0', return where size bytes of value go
+    char* element(uint8_t type, const XKey& key, size_t size) {
+        size_t old = _out->size();
+        _out->resize(old+1+key.len+1+size);
+        char* p = &(*_out)[old];
+        *p++ = (char)type;
+        memcpy(p, key.name, key.len);
+        p += key.len;
+        *p++ = '\0';
+        return p;
+    }
+    BsonNativeWriter& utf8(const XKey& key, const char* data, size_t len) {
+        char* p = element(xbson::t_utf8, key, 4+len+1);
+        xbson::put32(p, (uint32_t)(len+1));
+        memcpy(p+4, data, len);
+        p[4+len] = '\0';
+        return *this;
+    }
+    BsonNativeWriter& int32(const XKey& key, int32_t data) {
+        xbson::put32(element(xbson::t_int32, key, 4), (uint32_t)data);
+        return *this;
+    }
+    // child document/array, its length is written by end_doc
+    size_t begin_doc(uint8_t type, const XKey& key) {
+        element(type, key, 4);
+        ++_depth;
+        return _out->size()-4;
+    }
+    void end_doc(size_t doc) {
+        --_depth;
+        _out->push_back('\0');
+        xbson::put32(&(*_out)[doc], (uint32_t)(_out->size()-doc));
+    }
+    // struct/map at the top with empty key is the document itself
+    size_t open(const XKey& key) {
+        if (0==_depth && key.empty()) {
+            return std::string::npos;
+        }
+        return begin_doc(xbson::t_document, key);
+    }
+    void close(size_t doc) {
+        if (doc != std::string::npos) {
+            end_doc(doc);
+        }
+    }
+
+    std::string _own;
+    std::string* _out;
+    size_t _start;
+    bool _omit_default;
+    bool _done;
+    int _depth;
+};
+
+template <typename T>
+inline void packed_convert(BsonNativeWriter& obj, const XKey& key, const std::vector<T>& data) {
+    obj.convert_packed(key, data);
+}
+template <typename T>
+inline void packed_delta(BsonNativeWriter& obj, const XKey& key, const std::vector<T>& cur, const std::vector<T>& base) {
+    (void)base;
+    obj.convert_packed(key, cur);
+}
+
+}
+
+#endif
@@ -0,0 +1,195 @@
+﻿/*
+* Copyright (C) 2017 YY Inc. All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License"); 
+* you may not use this file except in compliance with the License. 
+* You may obtain a copy of the License at
+*
+*	http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, 
+* software distributed under the License is distributed on an "AS IS" BASIS, 
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. 
+* See the License for the specific language governing permissions and 
+* limitations under the License.
+*/
+
+#ifndef __X_BSON_PACKED_H
+#define __X_BSON_PACKED_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <limits>
+#include <stdexcept>
+
+#define X2STRUCT_BSON_PACKED 0x80   // binary subtype of packed vector is X2STRUCT_BSON_PACKED+element code
+
+namespace x2struct {
+
+/*
+  arithmetic vector packed into one bson binary, elements little endian back to back.
+  element type is kept in the subtype(user defined range), so a reader of the same type
+  decodes with one memcpy and other arithmetic types are converted element by element,
+  an integer target must hold the value exactly(range, fraction, nan), a floating target
+  only checks the range and rounds like a plain array. otherwise runtime_error is thrown.
+*/
+template <typename T>
+struct BsonPacked {
+    enum {code = 0};  // not packable
+};
+template <> struct BsonPacked<int16_t>  {enum {code = 1};};
+template <> struct BsonPacked<uint16_t> {enum {code = 2};};
+template <> struct BsonPacked<int32_t>  {enum {code = 3};};
+template <> struct BsonPacked<uint32_t> {enum {code = 4};};
+template <> struct BsonPacked<int64_t>  {enum {code = 5};};
+template <> struct BsonPacked<uint64_t> {enum {code = 6};};
+template <> struct BsonPacked<float>    {enum {code = 7};};
+template <> struct BsonPacked<double>   {enum {code = 8};};
+
+class BsonPack {
+public:
+    // shared by BsonWriter/BsonReader(libbson) and BsonNativeWriter/BsonNativeReader, no libbson here
+    static bool packed(int subtype) {
+        return subtype>X2STRUCT_BSON_PACKED && subtype<=X2STRUCT_BSON_PACKED+8;
+    }
+
+    // bytes of data in packed form, host order is swapped on big endian
+    template <typename T>
+    static const uint8_t* bytes(const std::vector<T>& data, std::vector<uint8_t>& swap) {
+        if (data.empty()) {
+            return (const uint8_t*)"";
+        } else if (little()) {
+            return (const uint8_t*)&data[0];
+        }
+        swap.resize(data.size()*sizeof(T));
+        for (size_t i=0; i<data.size(); ++i) {
+            reverse((const uint8_t*)&data[i], &swap[i*sizeof(T)], sizeof(T));
+        }
+        return &swap[0];
+    }
+    static bool little() {
+        const uint16_t one = 1;
+        return 1 == *(const uint8_t*)&one;
+    }
+
+    // false if T is not packable, array reader takes it
+    template <typename T>
+    static bool unpack(int subtype, const uint8_t* data, uint32_t len, std::vector<T>& val) {
+        (void)subtype;(void)data;(void)len;(void)val;
+        return false;
+    }
+    static bool unpack(int subtype, const uint8_t* data, uint32_t len, std::vector<int16_t>& val) {
+        return unpack_as(subtype, data, len, val);
+    }
+    static bool unpack(int subtype, const uint8_t* data, uint32_t len, std::vector<uint16_t>& val) {
+        return unpack_as(subtype, data, len, val);
+    }
+    static bool unpack(int subtype, const uint8_t* data, uint32_t len, std::vector<int32_t>& val) {
+        return unpack_as(subtype, data, len, val);
+    }
+    static bool unpack(int subtype, const uint8_t* data, uint32_t len, std::vector<uint32_t>& val) {
+        return unpack_as(subtype, data, len, val);
+    }
+    static bool unpack(int subtype, const uint8_t* data, uint32_t len, std::vector<int64_t>& val) {
+        return unpack_as(subtype, data, len, val);
+    }
+    static bool unpack(int subtype, const uint8_t* data, uint32_t len, std::vector<uint64_t>& val) {
+        return unpack_as(subtype, data, len, val);
+    }
+    static bool unpack(int subtype, const uint8_t* data, uint32_t len, std::vector<float>& val) {
+        return unpack_as(subtype, data, len, val);
+    }
+    static bool unpack(int subtype, const uint8_t* data, uint32_t len, std::vector<double>& val) {
+        return unpack_as(subtype, data, len, val);
+    }
+private:
+    template <typename T>
+    static bool unpack_as(int subtype, const uint8_t* data, uint32_t len, std::vector<T>& val) {
+        switch (subtype-X2STRUCT_BSON_PACKED) {
+          case 1: cast<int16_t>(data, len, val); break;
+          case 2: cast<uint16_t>(data, len, val); break;
+          case 3: cast<int32_t>(data, len, val); break;
+          case 4: cast<uint32_t>(data, len, val); break;
+          case 5: cast<int64_t>(data, len, val); break;
+          case 6: cast<uint64_t>(data, len, val); break;
+          case 7: cast<float>(data, len, val); break;
+          case 8: cast<double>(data, len, val); break;
+          default: throw std::runtime_error("Unknown packed vector subtype");
+        }
+        return true;
+    }
+    static void reverse(const uint8_t* from, uint8_t* to, size_t size) {
+        for (size_t i=0; i<size; ++i) {
+            to[i] = from[size-1-i];
+        }
+    }
+    static void load(const uint8_t* from, void* to, size_t size) {
+        if (little()) {
+            memcpy(to, from, size);
+        } else {
+            reverse(from, (uint8_t*)to, size);
+        }
+    }
+
+    // stored as S, read as T
+    template <typename S, typename T>
+    static void cast(const uint8_t* data, uint32_t len, std::vector<T>& val) {
+        if (0 != len%sizeof(S)) {
+            throw std::runtime_error("Bad packed vector length");
+        }
+        size_t n = len/sizeof(S);
+        val.resize(n);
+        if (n == 0) {
+            return;
+        }
+        if ((int)BsonPacked<S>::code==(int)BsonPacked<T>::code && little()) {
+            memcpy(&val[0], data, len);
+            return;
+        }
+        for (size_t i=0; i<n; ++i) {
+            S s;
+            load(data+i*sizeof(S), &s, sizeof(S));
+            val[i] = narrow<S, T>(s);
+        }
+    }
+
+    template <typename S, typename T>
+    static T narrow(S s) {
+        if (!std::numeric_limits<T>::is_integer) {
+            // rounded like the unpacked path, only values out of range are rejected
+            if (s!=s || convertible<T>(s)) {
+                return (T)s;
+            }
+        } else if (s==s && convertible<T>(s)) {    // integers must round trip
+            T t = (T)s;
+            if (convertible<S>(t) && (S)t==s && negative(s)==negative(t)) {
+                return t;
+            }
+        }
+        throw std::runtime_error("Packed vector value does not fit the element type");
+    }
+    // (T)s is defined: integers always are, floating point must be in range of T
+    template <typename T, typename S>
+    static bool convertible(S s) {
+        if (std::numeric_limits<S>::is_integer) {
+            return true;
+        }
+        if (std::numeric_limits<T>::is_integer) {
+            // long double so the bounds can't overflow in S, max+1 is an exact power of 2
+            long double lo = (long double)std::numeric_limits<T>::min();
+            long double hi = (long double)(std::numeric_limits<T>::max()/2+1)*2;
+            return (long double)s>=lo && (long double)s<hi;
+        }
+        S inf = std::numeric_limits<S>::infinity();
+        return s==inf || s==-inf || (s>=-(S)std::numeric_limits<T>::max() && s<=(S)std::numeric_limits<T>::max());
+    }
+    template <typename V>
+    static bool negative(V v) {
+        return v < (V)0;
+    }
+};
+
+}
+
+#endif
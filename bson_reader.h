@@ -20,59 +20,50 @@
 #include <map>
 #include <vector>
 #include <stdexcept>
-#include <list>
+#include <algorithm>
 #include <string.h>
 
 #include "thirdparty/libbson/include/libbson-1.0/bson.h"
 
 #include "util.h"
 #include "xreader.h"
+#include "bson_packed.h"
 
 namespace x2struct {
 
-typedef std::map<const char*, bson_iter_t, cmp_str> bson_objs_type;
-
-struct BsonDoc;
-
-struct BsonValue {
-    bson_iter_t root;
-    bson_objs_type objs;
-    std::vector<bson_iter_t> vecs;
-    bson_objs_type::iterator iter;
-    BsonDoc* doc;
-};
+#define X2STRUCT_BSON_WRAPS 4    // out of order lookups before a sub-document gets a sorted index
 
+/*
+  shared by all readers of one document, owned by the root reader.
+  entries are sorted child indexes of the sub-documents that needed one, readers keep offsets.
+*/
 struct BsonDoc {
-    std::string data;
-    std::list<BsonValue> vals;
-    BsonValue *Get(const bson_iter_t*iter, bool top=false) {
-        BsonValue _tmp_val;
-        vals.push_back(_tmp_val);
-        BsonValue *val = &vals.back();
-        memcpy(&val->root, iter, sizeof(val->root));
-
-        bson_iter_t sub;
-        if (top) {
-            memcpy(&sub, &val->root, sizeof(sub));
-            while (bson_iter_next(&sub)) {
-                val->objs[bson_iter_key(&sub)] = sub;
-            }
-        } else if (bson_iter_recurse(&val->root, &sub)) {
-            if (BSON_TYPE_ARRAY != bson_iter_type(&val->root)) {
-                while (bson_iter_next(&sub)) {
-                    val->objs[bson_iter_key(&sub)] = sub;
-                }
-            } else {
-                while (bson_iter_next(&sub)) {
-                    val->vecs.push_back(sub);
-                }
-            }
+    struct Entry {
+        const char* key;
+        char iter[sizeof(bson_iter_t)];     // bytes of bson_iter_t, which is 128 aligned and unfit for std containers
+    };
+    struct EntryLess {
+        bool operator()(const Entry& a, const Entry& b) const {
+            return strcmp(a.key, b.key) < 0;
         }
-        val->doc = this;
-        return val;
-    }
+    };
+    struct EntryOrder {     // keys point into the document, equal keys keep document order
+        bool operator()(const Entry& a, const Entry& b) const {
+            int c = strcmp(a.key, b.key);
+            return c<0 || (c==0 && a.key<b.key);
+        }
+    };
+    std::string data;
+    std::vector<Entry> entries;
 };
 
+/*
+  reader walks bson_iter_t lazily, nothing is built when a reader is constructed.
+  members are looked up by a cursor moving forward from the last match, so fields read in
+  XTOSTRUCT order(the order BsonWriter writes) cost one pass over the document.
+  a sorted index is built only after a key is missing or lookups keep wrapping around.
+  array elements are visited by a sequential cursor.
+*/
 class BsonReader:public XReader<BsonReader> {
 public:
     using xdoc_type::convert;
@@ -109,37 +100,62 @@ public:
 public:
     void convert(std::string &val) {
         uint32_t length;
-        const char* data = bson_iter_utf8(&_val->root, &length);
+        const char* data = bson_iter_utf8(&_it, &length);
         if (0 != data) {
             val = std::string(data, length);
         }
     }
+    // view into the input, see XStrView
+    void convert(XStrView &val) {
+        if (0==_pool || !_pool->data.empty()) {
+            throw std::runtime_error("XStrView needs a zero-copy BsonReader(copy=false)");
+        }
+        uint32_t length;
+        const char* data = bson_iter_utf8(&_it, &length);
+        if (0 != data) {
+            val = XStrView(data, length);
+        }
+    }
+    // packed arithmetic vector(option pk, see BsonPacked) is detected by binary subtype
+    template <typename TYPE>
+    void convert(std::vector<TYPE> &val) {
+        if (_valid && !_top && BSON_TYPE_BINARY==bson_iter_type(&_it)) {
+            bson_subtype_t subtype;
+            uint32_t len;
+            const uint8_t* data;
+            bson_iter_binary(&_it, &subtype, &len, &data);
+            if (BsonPack::packed(subtype) && BsonPack::unpack(subtype, data, len, val)) {
+                return;
+            }
+        }
+        xdoc_type::convert(val);
+    }
     void convert(bool &val) {
-        val = (bool)bson_iter_as_int64(&_val->root);
+        val = (bool)bson_iter_as_int64(&_it);
     }
     void convert(int16_t &val) {
-        val = (int16_t)bson_iter_as_int64(&_val->root);
+        val = (int16_t)bson_iter_as_int64(&_it);
     }
     void convert(uint16_t &val) {
-        val = (uint16_t)bson_iter_as_int64(&_val->root);
+        val = (uint16_t)bson_iter_as_int64(&_it);
     }
     void convert(int32_t &val) {
-        val = (int32_t)bson_iter_as_int64(&_val->root);
+        val = (int32_t)bson_iter_as_int64(&_it);
     }
     void convert(uint32_t &val) {
-        val = (uint32_t)bson_iter_as_int64(&_val->root);
+        val = (uint32_t)bson_iter_as_int64(&_it);
     }
     void convert(int64_t &val) {
-        val = bson_iter_as_int64(&_val->root);
+        val = bson_iter_as_int64(&_it);
     }
     void convert(uint64_t &val) {
-        val = (uint64_t)bson_iter_as_int64(&_val->root);
+        val = (uint64_t)bson_iter_as_int64(&_it);
     }
     void convert(double &val) {
-        val = bson_iter_double(&_val->root);
+        val = bson_iter_double(&_it);
     }
     void convert(float &val) {
-        val = (float)bson_iter_double(&_val->root);
+        val = (float)bson_iter_double(&_it);
     }
 
     const std::string& type() {
@@ -147,28 +163,47 @@ public:
         return t;
     }
     bool has(const char*key) {
-        bool ret = _val->objs.find(key)!=_val->objs.end();
-        return ret;
+        bson_iter_t it;
+        return find(key, it);
+    }
+    bool null() const {
+        return !_top && BSON_TYPE_NULL==bson_iter_type(&_it);
     }
     size_t size(bool to_vec=true) {
-        if (BSON_TYPE_ARRAY==bson_iter_type(&_val->root)) {
-            return _val->vecs.size();
-        } else {
+        (void)to_vec;
+        if (!_valid || _top || BSON_TYPE_ARRAY!=bson_iter_type(&_it)) {
             return 0;
         }
+        if (_count == npos) {
+            bson_iter_t it;
+            _count = 0;
+            if (bson_iter_recurse(&_it, &it)) {
+                while (bson_iter_next(&it)) {
+                    ++_count;
+                }
+            }
+        }
+        return _count;
     }
     BsonReader operator[](const char *key) {
-        bson_objs_type::iterator iter = _val->objs.find(key);
-        if (iter != _val->objs.end()) {
-            return BsonReader(_val->doc->Get(&iter->second), this, key);
+        bson_iter_t it;
+        if (find(key, it)) {
+            return BsonReader(&it, this, key);
         } else {
             throw std::runtime_error(std::string("Did not have ")+key);
         }
         return BsonReader(0, 0, "");
     }
     BsonReader operator[](size_t index) {
-        if (index<_val->vecs.size()) {
-            return BsonReader(_val->doc->Get(&_val->vecs[index]), this, index);
+        if (index < size()) {
+            if (!_cursor_init || _cursor_pos>index+1) { // sequential access is the common case, restart only when going back
+                reset();
+            }
+            while (_cursor_pos <= index) {
+                bson_iter_next(&_cursor);
+                ++_cursor_pos;
+            }
+            return BsonReader(&_cursor, this, index);
         } else {
             throw std::runtime_error("Out of index");
         }
@@ -176,33 +211,38 @@ public:
         return BsonReader(0, 0, "");
     }
     BsonReader begin() {
-        _val->iter = _val->objs.begin();
-        if (_val->iter != _val->objs.end()) {
-            return BsonReader(_val->doc->Get(&_val->iter->second), this, _val->iter->first);
+        if (reset() && bson_iter_next(&_cursor)) {
+            ++_cursor_pos;
+            return BsonReader(&_cursor, this, bson_iter_key(&_cursor));
         } else {
             return BsonReader(0, this, "");
         }
     }
     BsonReader next() {
-        if (0==_parent || 0==_parent->_val) {
+        if (0==_parent || !_parent->_valid) {
             throw std::runtime_error("parent null");
-        } else {
-            ++(_parent->_val->iter);
         }
-        if (_parent->_val->iter != _parent->_val->objs.end()) {
-            return BsonReader(_val->doc->Get(&_parent->_val->iter->second), _parent, _parent->_val->iter->first);
+        if (bson_iter_next(&_parent->_cursor)) {
+            ++_parent->_cursor_pos;
+            return BsonReader(&_parent->_cursor, _parent, bson_iter_key(&_parent->_cursor));
         } else {
             return BsonReader(0, _parent, "");
         }
     }
     operator bool() const {
-        return 0!=_val;
+        return _valid;
     }
 
 private:
+    static const size_t npos = (size_t)-1;
+
     void init(const uint8_t*data, size_t length, bool copy){
         bson_t b; // local is ok
-        length = (length>0)?length:BSON_UINT32_TO_LE(*(int32_t*)data);
+        if (0 == length) {  // data may be unaligned, e.g. inside a stream
+            uint32_t len;
+            memcpy(&len, data, sizeof(len));
+            length = BSON_UINT32_FROM_LE(len);
+        }
         if (copy) {
             std::string tmp(std::string((const char*)data, length));
             _doc->data.swap(tmp);
@@ -213,22 +253,142 @@ private:
             _data = data;
         }
 
-        bson_iter_t root;
-        bson_iter_init(&root, &b);
-        _val = _doc->Get(&root, true);
+        bson_iter_init(&_it, &b);
+        _top = true;
+        _valid = true;
+        _pool = _doc;
+        init_state();
     }
-    BsonReader(BsonValue* val, const BsonReader*parent, const char*key):xdoc_type(parent, key),_val(val) {
-        _doc = 0;
-        _data = 0;
+    BsonReader(const bson_iter_t* it, const BsonReader*parent, const char*key):xdoc_type(parent, key) {
+        init_child(it, parent);
     }
-    BsonReader(BsonValue* val, const BsonReader*parent, size_t index):xdoc_type(parent, index),_val(val) {
+    BsonReader(const bson_iter_t* it, const BsonReader*parent, size_t index):xdoc_type(parent, index) {
+        init_child(it, parent);
+    }
+    void init_child(const bson_iter_t* it, const BsonReader*parent) {
         _doc = 0;
         _data = 0;
+        _pool = (0!=parent)?parent->_pool:0;
+        _top = false;
+        _valid = (0 != it);
+        if (_valid) {
+            memcpy(&_it, it, sizeof(_it));
+        }
+        init_state();
+    }
+    void init_state() {
+        _cursor_init = false;
+        _cursor_pos = 0;
+        _count = npos;
+        _wraps = 0;
+        _indexed = false;
+        _idx_begin = 0;
+        _idx_end = 0;
+    }
+
+    // iterator before the first child, false if this is not a document/array
+    bool children(bson_iter_t& it) const {
+        if (!_valid) {
+            return false;
+        } else if (_top) {
+            memcpy(&it, &_it, sizeof(it));
+            return true;
+        } else {
+            return bson_iter_recurse(&_it, &it);
+        }
+    }
+    bool reset() {
+        _cursor_init = children(_cursor);
+        _cursor_pos = 0;
+        return _cursor_init;
+    }
+    bool find(const char* key, bson_iter_t& it) {
+        if (_indexed) {
+            return index_find(key, it);
+        }
+        if (!_cursor_init && !reset()) {
+            return false;
+        }
+        // has() is followed by operator[] with the same key
+        if (_cursor_pos>0 && 0==strcmp(bson_iter_key(&_cursor), key)) {
+            memcpy(&it, &_cursor, sizeof(it));
+            return true;
+        }
+        bson_iter_t c;
+        memcpy(&c, &_cursor, sizeof(c));
+        size_t pos = _cursor_pos;
+        while (bson_iter_next(&c)) {
+            ++pos;
+            if (0 == strcmp(bson_iter_key(&c), key)) {
+                return found(c, pos, it);
+            }
+        }
+        // wrap around, up to the cursor
+        size_t limit = _cursor_pos;
+        children(c);
+        for (pos=0; pos<limit && bson_iter_next(&c);) {
+            ++pos;
+            if (0 == strcmp(bson_iter_key(&c), key)) {
+                if (++_wraps >= X2STRUCT_BSON_WRAPS) {
+                    build_index();
+                }
+                return found(c, pos, it);
+            }
+        }
+        build_index(); // missing key costs a full scan, later lookups use the index
+        return false;
+    }
+    bool found(const bson_iter_t& c, size_t pos, bson_iter_t& it) {
+        memcpy(&_cursor, &c, sizeof(_cursor));
+        _cursor_pos = pos;
+        memcpy(&it, &c, sizeof(it));
+        return true;
+    }
+    void build_index() {
+        std::vector<BsonDoc::Entry>& entries = _pool->entries;
+        _indexed = true;
+        _idx_begin = entries.size();
+        bson_iter_t c;
+        if (children(c)) {
+            while (bson_iter_next(&c)) {
+                BsonDoc::Entry e;
+                e.key = bson_iter_key(&c);
+                memcpy(&e.iter, &c, sizeof(e.iter));
+                entries.push_back(e);
+            }
+        }
+        _idx_end = entries.size();
+        std::sort(entries.begin()+_idx_begin, entries.end(), BsonDoc::EntryOrder());
+    }
+    bool index_find(const char* key, bson_iter_t& it) const {
+        const std::vector<BsonDoc::Entry>& entries = _pool->entries;
+        BsonDoc::Entry e;
+        e.key = key;
+        std::vector<BsonDoc::Entry>::const_iterator r;
+        r = std::lower_bound(entries.begin()+_idx_begin, entries.begin()+_idx_end, e, BsonDoc::EntryLess());
+        if (r!=entries.begin()+_idx_end && 0==strcmp(r->key, key)) {
+            memcpy(&it, &r->iter, sizeof(it));
+            return true;
+        }
+        return false;
     }
 
     const uint8_t* _data;
-    BsonDoc *_doc;
-    mutable BsonValue *_val;
+    BsonDoc *_doc;          // root only
+    BsonDoc *_pool;         // root's _doc
+
+    bson_iter_t _it;        // this value, or the document itself for root
+    bool _top;
+    bool _valid;
+
+    mutable bson_iter_t _cursor;    // child at _cursor_pos-1, member lookup/array index/begin()&next()
+    bool _cursor_init;
+    mutable size_t _cursor_pos;
+    size_t _count;          // array size, npos if not counted yet
+    int _wraps;
+    bool _indexed;          // child index, pool->entries[_idx_begin, _idx_end)
+    size_t _idx_begin;
+    size_t _idx_end;
 };
 
 }
@@ -0,0 +1,229 @@
+﻿/*
+* Copyright (C) 2017 YY Inc. All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License"); 
+* you may not use this file except in compliance with the License. 
+* You may obtain a copy of the License at
+*
+*	http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, 
+* software distributed under the License is distributed on an "AS IS" BASIS, 
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. 
+* See the License for the specific language governing permissions and 
+* limitations under the License.
+*/
+
+#ifndef __X_BSON_STREAM_H
+#define __X_BSON_STREAM_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "util.h"
+#include "xfilemap.h"
+#include "xparallel.h"
+#include "bson_reader.h"
+#include "bson_writer.h"
+
+#define X2STRUCT_BSON_STREAM_FLUSH 65536   // BsonStreamWriter write out buffered documents beyond this
+
+namespace x2struct {
+
+/*
+  decode a stream of concatenated bson documents(mongodump .bson) one by one, from a mapped file
+  or a memory span. documents are decoded in place, XStrView members point into the stream and
+  are valid as long as the BsonStream.
+
+  BsonStream<item> in("items.bson");
+  item t;
+  while (in.next(t)) {...}
+*/
+template <typename TYPE>
+class BsonStream {
+public:
+    BsonStream(const std::string& file):_map(new XFileMap(file)) {
+        init((const uint8_t*)_map->data(), _map->size());
+    }
+    BsonStream(const uint8_t* data, size_t length):_map(0) {
+        init(data, length);
+    }
+    ~BsonStream() {
+        delete _map;
+    }
+
+    // next document without decoding, false at end of stream
+    bool next(const uint8_t*& doc, size_t& length) {
+        if (_pos >= _size) {
+            return false;
+        }
+        length = frame(_pos);
+        doc = _data+_pos;
+        _pos += length;
+        ++_count;
+        return true;
+    }
+    // decode next document into t, false at end of stream
+    bool next(TYPE& t) {
+        const uint8_t* doc;
+        size_t length;
+        if (!next(doc, length)) {
+            return false;
+        }
+        BsonReader reader(doc, length, false);
+        reader.convert(t);
+        return true;
+    }
+    /*
+      decode the rest of the stream and append to out in stream order. the documents are
+      framed first, then decoded in threads, each thread a range of whole documents.
+    */
+    size_t load(std::vector<TYPE>& out, unsigned threads=1) {
+        std::vector<size_t> offsets;
+        const uint8_t* doc;
+        size_t length;
+        while (next(doc, length)) {
+            offsets.push_back((size_t)(doc-_data));
+        }
+        size_t base = out.size();
+        out.resize(base+offsets.size());
+        if (threads<1 || offsets.size()<threads) {
+            threads = 1;
+        }
+        LoadJob job(_data, offsets, out, base);
+        parallel_run(job, offsets.size(), threads);
+        return offsets.size();
+    }
+
+    void rewind() {
+        _pos = 0;
+        _count = 0;
+    }
+    // documents consumed so far
+    size_t count() const {
+        return _count;
+    }
+    // byte offset of the next document
+    size_t offset() const {
+        return _pos;
+    }
+private:
+    BsonStream(const BsonStream&);
+    BsonStream& operator=(const BsonStream&);
+
+    void init(const uint8_t* data, size_t length) {
+        _data = data;
+        _size = length;
+        _pos = 0;
+        _count = 0;
+    }
+    // length of document at pos, checked against the end of stream
+    size_t frame(size_t pos) const {
+        uint32_t len = 0;
+        if (_size-pos >= 4) {
+            memcpy(&len, _data+pos, 4);
+            len = BSON_UINT32_FROM_LE(len);
+        }
+        if (len<5 || (size_t)len>_size-pos) {
+            throw std::runtime_error("Bad bson document length at offset "+Util::tostr(pos));
+        }
+        return (size_t)len;
+    }
+
+    class LoadJob {
+    public:
+        LoadJob(const uint8_t* data, const std::vector<size_t>& offsets, std::vector<TYPE>& out, size_t base):_data(data),_offsets(offsets),_out(out),_base(base) {
+        }
+        void operator()(size_t part, size_t begin, size_t end) {
+            (void)part;
+            for (size_t i=begin; i<end; ++i) {
+                BsonReader reader(_data+_offsets[i], 0, false);
+                reader.convert(_out[_base+i]);
+            }
+        }
+    private:
+        const uint8_t* _data;
+        const std::vector<size_t>& _offsets;
+        std::vector<TYPE>& _out;
+        size_t _base;
+    };
+
+    XFileMap* _map;
+    const uint8_t* _data;
+    size_t _size;
+    size_t _pos;
+    size_t _count;
+};
+
+/*
+  append documents to a bson stream file. documents are encoded into a reused BsonBuffer
+  and written out in batches of X2STRUCT_BSON_STREAM_FLUSH bytes, call flush() to make them visible.
+*/
+class BsonStreamWriter {
+public:
+    BsonStreamWriter(const std::string& file, bool append=true):_flush(X2STRUCT_BSON_STREAM_FLUSH),_count(0) {
+        _fp = fopen(file.c_str(), append?"ab":"wb");
+        if (0 == _fp) {
+            throw std::runtime_error("Open file["+file+"] fail.");
+        }
+    }
+    ~BsonStreamWriter() {
+        try {
+            flush();
+        } catch (...) {  // destructor can not report error, call flush() to get it
+        }
+        fclose(_fp);
+    }
+
+    template <typename TYPE>
+    BsonStreamWriter& write(const TYPE& t, bool omitDefault=false) {
+        {
+            BsonWriter writer(_buf);
+            writer.omit_default(omitDefault);
+            writer.convert("", t);
+            writer.done();
+        }
+        ++_count;
+        if (_buf.size() >= _flush) {
+            output();
+        }
+        return *this;
+    }
+    void flush() {
+        output();
+        if (0 != fflush(_fp)) {
+            throw std::runtime_error("BsonStreamWriter fflush fail");
+        }
+    }
+    // documents written so far
+    size_t count() const {
+        return _count;
+    }
+private:
+    BsonStreamWriter(const BsonStreamWriter&);
+    BsonStreamWriter& operator=(const BsonStreamWriter&);
+
+    void output() {
+        size_t len = _buf.size();
+        if (len > 0) {
+            if (fwrite(_buf.data(), 1, len, _fp) != len) {
+                throw std::runtime_error("BsonStreamWriter write fail");
+            }
+            _buf.clear();
+        }
+    }
+
+    FILE* _fp;
+    BsonBuffer _buf;
+    size_t _flush;
+    size_t _count;
+};
+
+}
+
+#endif
@@ -20,6 +20,7 @@
 
 
 #include <stdint.h>
+#include <string.h>
 #include <string>
 #include <map>
 #include <vector>
@@ -29,48 +30,130 @@
 
 #include "util.h"
 #include "xtypes.h"
+#include "xparallel.h"
+#include "bson_packed.h"
+
+#define X2STRUCT_BSON_BUFFER 1024   // initial capacity of BsonBuffer
 
 struct _bson_t;
 
 namespace x2struct {
 
+/*
+  growable output owned by the caller, BsonWriter(BsonBuffer&) appends a document to it.
+  documents are written back to back(a bson stream) until clear(), the memory is kept
+  and reused, so encoding into a warm buffer doesn't allocate.
+*/
+class BsonBuffer {
+    friend class BsonWriter;
+public:
+    BsonBuffer(size_t capacity=X2STRUCT_BSON_BUFFER):_cap(capacity>0?capacity:1),_busy(false) {
+        _buf = (uint8_t*)bson_malloc(_cap);
+        _writer = bson_writer_new(&_buf, &_cap, 0, bson_realloc_ctx, 0);
+    }
+    ~BsonBuffer() {
+        bson_writer_destroy(_writer);
+        bson_free(_buf);
+    }
+    const uint8_t* data() const {
+        return _buf;
+    }
+    size_t size() const {
+        return bson_writer_get_length(_writer);
+    }
+    size_t capacity() const {
+        return _cap;
+    }
+    std::string str() const {
+        return std::string((const char*)_buf, size());
+    }
+    // drop the documents, keep the memory
+    void clear() {
+        if (_busy) {
+            throw std::runtime_error("BsonBuffer is in use by another BsonWriter");
+        }
+        bson_writer_destroy(_writer);
+        _writer = bson_writer_new(&_buf, &_cap, 0, bson_realloc_ctx, 0);
+    }
+private:
+    BsonBuffer(const BsonBuffer&);
+    BsonBuffer& operator=(const BsonBuffer&);
+
+    uint8_t* _buf;
+    size_t _cap;
+    bson_writer_t* _writer;
+    bool _busy;   // a writer is appending, bson_writer_begin asserts instead of failing
+};
+
+/*
+  child documents and arrays are built in a bson_t embedded in the child writer, which
+  lives on the stack of convert, so only the top document may allocate.
+*/
 class BsonWriter {
     enum {
         top,
         doc,
         array
     };
+    enum {  // where the top document is
+        in_place,   // _doc
+        heap,       // bson_new/bson_copy, destroyed with the writer
+        buffer,     // BsonBuffer
+        borrowed    // someone else's, left alone
+    };
 public:
-    BsonWriter(const char*key="", _bson_t*parent=0, int type=top) {
-        _parent = parent;
-        _bson = new bson_t;
-        _type = type;
-        if (0 != parent) {
-            if (type == doc) {
-                bson_append_document_begin(parent, key, strlen(key), _bson);
-            } else {
-                bson_append_array_begin(parent, key, strlen(key), _bson);
-            }
-        } else {
-            bson_init(_bson);
+    BsonWriter(const XKey& key="", _bson_t*parent=0, int type=top) {
+        init(key, parent, type);
+        _omit_default = false;
+        _threads = 1;
+        _parallel_min = X2STRUCT_PARALLEL_MIN;
+    }
+    /* append a document to out. call done() when it is complete, a writer destroyed
+       before that(e.g. convert threw) rolls the document back and leaves out unchanged */
+    explicit BsonWriter(BsonBuffer& out) {
+        if (out._busy) {
+            throw std::runtime_error("BsonBuffer is in use by another BsonWriter");
         }
+        bson_writer_begin(out._writer, &_bson);
+        out._busy = true;
+        _parent = 0;
+        _out = &out;
+        _type = top;
+        _store = buffer;
+        _done = false;
+        _omit_default = false;
+        _threads = 1;
+        _parallel_min = X2STRUCT_PARALLEL_MIN;
     }
+    // deep copy, only a top document can be copied
     BsonWriter(const BsonWriter&bs) {
-        *this = bs;
-        bs._parent = 0;
-        bs._bson = 0;
+        if (bs._type != top) {
+            throw std::runtime_error("only top BsonWriter can be copied");
+        }
+        _parent = 0;
+        _out = 0;
+        _type = top;
+        _store = heap;
+        _done = false;
+        _bson = bson_copy(bs._bson);
+        settings(bs);
     }
-    ~BsonWriter() {
-        if (0 != _bson) {
-            if (_type == doc) {
-                bson_append_document_end(_parent, _bson);
-            } else if (_type == array) {
-                bson_append_array_end(_parent, _bson);
-            } else {
-                bson_destroy(_bson);
+    BsonWriter& operator=(const BsonWriter&bs) {
+        if (this != &bs) {
+            if (_type!=top || bs._type!=top) {
+                throw std::runtime_error("only top BsonWriter can be copied");
             }
-            delete _bson;
+            _bson_t* copy = bson_copy(bs._bson);
+            release();
+            _bson = copy;
+            _store = heap;
+            _out = 0;
+            settings(bs);
         }
+        return *this;
+    }
+    ~BsonWriter() {
+        release();
     }
 
 public:
@@ -86,110 +169,161 @@ public:
         return ret;
     }
 
+    // the document appended to BsonBuffer is complete, see BsonWriter(BsonBuffer&)
+    void done() {
+        _done = true;
+    }
+
     const std::string&type() {
         static std::string t("bson");
         return t;
     }
 
-    BsonWriter& convert(const char*key, const BsonWriter& data){
-        bson_append_document(_bson, key, strlen(key), data._bson);
+    // skip member with default value(0, false, empty string/container), see Util::is_default
+    void omit_default(bool omit) {
+        _omit_default = omit;
+    }
+    bool omit_default() const {
+        return _omit_default;
+    }
+
+    /*
+      encode vector with at least min_size elements in threads, each thread write a range
+      into a document of its own, and the elements are concatenated in order, output is the same.
+    */
+    void parallel(unsigned threads, size_t min_size=X2STRUCT_PARALLEL_MIN) {
+        _threads = (threads>0)?threads:1;
+        _parallel_min = (min_size>_threads)?min_size:_threads;
+    }
+
+    // allocate size bytes once for the top document, size is usually X::bsonsize
+    void reserve(size_t size) {
+        if (_type==top && _bson->len==5 && (_store==in_place || _store==heap)) {
+            release();
+            _bson = bson_sized_new(size);
+            _store = heap;
+        }
+    }
+
+    BsonWriter& convert(const XKey& key, const BsonWriter& data){
+        bson_append_document(_bson, key.name, (int)key.len, data._bson);
         return *this;
     }
-    BsonWriter& convert(const char*key, const char* data) {
-        std::string d(data);
-        return convert(key, d);
+    BsonWriter& convert(const XKey& key, const char* data) {
+        bson_append_utf8(_bson, key.name, (int)key.len, data, (int)strlen(data));
+        return *this;
+    }
+    BsonWriter& convert(const XKey& key, const std::string& data) {
+        bson_append_utf8(_bson, key.name, (int)key.len, (const char*)data.data(), data.length());
+        return *this;
     }
-    BsonWriter& convert(const char*key, const std::string& data) {
-        bson_append_utf8(_bson, key, strlen(key), (const char*)data.data(), data.length());
+    BsonWriter& convert(const XKey& key, const XStrView& data) {
+        bson_append_utf8(_bson, key.name, (int)key.len, data.data(), (int)data.size());
         return *this;
     }
-    BsonWriter& convert(const char*key, int16_t data) {
-        bson_append_int32(_bson, key, strlen(key), (int32_t)data);
+    BsonWriter& convert(const XKey& key, int16_t data) {
+        bson_append_int32(_bson, key.name, (int)key.len, (int32_t)data);
         return *this;
     }
-    BsonWriter& convert(const char*key, uint16_t data) {
-        bson_append_int32(_bson, key, strlen(key), (int32_t)data);
+    BsonWriter& convert(const XKey& key, uint16_t data) {
+        bson_append_int32(_bson, key.name, (int)key.len, (int32_t)data);
         return *this;
     }
-    BsonWriter& convert(const char*key, int32_t data) {
-        bson_append_int32(_bson, key, strlen(key), (int32_t)data);
+    BsonWriter& convert(const XKey& key, int32_t data) {
+        bson_append_int32(_bson, key.name, (int)key.len, (int32_t)data);
         return *this;
     }
-    BsonWriter& convert(const char*key, uint32_t data) {
-        bson_append_int32(_bson, key, strlen(key), (int32_t)data);
+    BsonWriter& convert(const XKey& key, uint32_t data) {
+        bson_append_int32(_bson, key.name, (int)key.len, (int32_t)data);
         return *this;
     }
-    BsonWriter& convert(const char*key, int64_t data) {
-        bson_append_int64(_bson, key, strlen(key), (int64_t)data);
+    BsonWriter& convert(const XKey& key, int64_t data) {
+        bson_append_int64(_bson, key.name, (int)key.len, (int64_t)data);
         return *this;
     }
-    BsonWriter& convert(const char*key, uint64_t data) {
-        bson_append_int64(_bson, key, strlen(key), (int64_t)data);
+    BsonWriter& convert(const XKey& key, uint64_t data) {
+        bson_append_int64(_bson, key.name, (int)key.len, (int64_t)data);
         return *this;
     }
-    BsonWriter& convert(const char*key, float data) {
-        bson_append_double(_bson, key, strlen(key), (double)data);
+    BsonWriter& convert(const XKey& key, float data) {
+        bson_append_double(_bson, key.name, (int)key.len, (double)data);
         return *this;
     }
-    BsonWriter& convert(const char*key, double data) {
-        bson_append_double(_bson, key, strlen(key), (double)data);
+    BsonWriter& convert(const XKey& key, double data) {
+        bson_append_double(_bson, key.name, (int)key.len, (double)data);
         return *this;
     }
-    BsonWriter& convert(const char*key, bool data) {
-        bson_append_bool(_bson, key, strlen(key), data);
+    BsonWriter& convert(const XKey& key, bool data) {
+        bson_append_bool(_bson, key.name, (int)key.len, data);
         return *this;
     }
 
     template<typename T>
-    BsonWriter& convert(const char*key, const std::vector<T>&data) {
-        BsonWriter child(key, _bson, array);
-        for (size_t i=0; i<data.size(); ++i) {
-            child.convert(Util::tostr(i).c_str(), data[i]);
+    BsonWriter& convert(const XKey& key, const std::vector<T>&data) {
+        BsonWriter child(key, *this, array);
+        if (_threads>1 && data.size()>=_parallel_min) {
+            child.parallel_vector(data);
+        } else {
+            BsonIndexKey k;
+            for (size_t i=0; i<data.size(); ++i, k.next()) {
+                child.convert(k.key(), data[i]);
+            }
         }
         return *this;
     }
+    // arithmetic vector as one binary, see BsonPacked and option pk. other vectors are written as array
     template<typename T>
-    BsonWriter& convert(const char*key, const std::set<T>&data) {
-        BsonWriter child(key, _bson, array);
-        size_t i = 0;
-        for (typename std::set<T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter,++i) {
-            child.convert(Util::tostr(i).c_str(), *iter);
+    BsonWriter& convert_packed(const XKey& key, const std::vector<T>&data) {
+        if (0 == BsonPacked<T>::code) {
+            return convert(key, data);
         }
+        std::vector<uint8_t> swap;
+        bson_append_binary(_bson, key.name, (int)key.len, (bson_subtype_t)(X2STRUCT_BSON_PACKED+BsonPacked<T>::code),
+                           BsonPack::bytes(data, swap), (uint32_t)(data.size()*sizeof(T)));
         return *this;
     }
     template<typename T>
-    BsonWriter& convert(const char*key, const std::map<std::string, T>&data) {
-        if (_type!=top || key[0]!='\0') {
-            BsonWriter child(key, _bson, doc);
+    BsonWriter& convert(const XKey& key, const std::set<T>&data) {
+        BsonWriter child(key, *this, array);
+        BsonIndexKey k;
+        for (typename std::set<T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter,k.next()) {
+            child.convert(k.key(), *iter);
+        }
+        return *this;
+    }
+    template<typename T>
+    BsonWriter& convert(const XKey& key, const std::map<std::string, T>&data) {
+        if (_type!=top || !key.empty()) {
+            BsonWriter child(key, *this, doc);
             for (typename std::map<std::string, T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
-                child.convert(iter->first.c_str(), iter->second);
+                child.convert(XKey(iter->first), iter->second);
             }
         } else {
             for (typename std::map<std::string, T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
-                this->convert(iter->first.c_str(), iter->second);
+                this->convert(XKey(iter->first), iter->second);
             }
         }
         return *this;
     }
     template <typename K, typename T>
-    BsonWriter& convert(const char*key, const std::map<K, T> &data) {
-        if (_type!=top || key[0]!='\0') {
-            BsonWriter child(key, _bson, doc);
+    BsonWriter& convert(const XKey& key, const std::map<K, T> &data) {
+        if (_type!=top || !key.empty()) {
+            BsonWriter child(key, *this, doc);
             for (typename std::map<K, T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
-                child.convert(Util::tostr(iter->first).c_str(), iter->second);
+                child.convert(Util::tostr(iter->first), iter->second);
             }
         } else {
             for (typename std::map<K, T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
-                this->convert(Util::tostr(iter->first).c_str(), iter->second);
+                this->convert(Util::tostr(iter->first), iter->second);
             }
         }
         return *this;
     }
 
     template <typename T>
-    BsonWriter& convert(const char*key, const T& data) {
-        if (_type!=top || key[0]!='\0') {
-            BsonWriter child(key, _bson, doc);
+    BsonWriter& convert(const XKey& key, const T& data) {
+        if (_type!=top || !key.empty()) {
+            BsonWriter child(key, *this, doc);
             data.__struct_to_str(child, "");
         } else {
             data.__struct_to_str(*this, "");
@@ -198,15 +332,411 @@ public:
     }
 
     template <typename T>
-    void convert(const char*key, const XType<T>& data) {
+    void convert(const XKey& key, const XType<T>& data) {
         data.__struct_to_str(*this, key);
     }
+
+    // splice cached document
+    template <typename T>
+    BsonWriter& convert(const XKey& key, const XCached<T>& data) {
+        if (_omit_default || (_type==top && key.empty())) {
+            return this->convert(key, data.get());
+        }
+        const std::string* bytes = data.cache_get(X2STRUCT_CACHE_BSON);
+        if (0 == bytes) {
+            BsonWriter writer;
+            writer.convert("", data.get());
+            std::string str = writer.toStr();
+            bytes = &data.cache_set(X2STRUCT_CACHE_BSON, str);
+        }
+        bson_t doc;
+        bson_init_static(&doc, (const uint8_t*)bytes->data(), bytes->length());
+        bson_append_document(_bson, key.name, (int)key.len, &doc);
+        return *this;
+    }
+
+    // delta encoding, see X::tobson_delta and JsonWriterT::convert_delta
+    BsonWriter& convert_delta(const XKey& key, const std::string& cur, const std::string& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonWriter& convert_delta(const XKey& key, const XStrView& cur, const XStrView& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonWriter& convert_delta(const XKey& key, bool cur, bool base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonWriter& convert_delta(const XKey& key, int16_t cur, int16_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonWriter& convert_delta(const XKey& key, uint16_t cur, uint16_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonWriter& convert_delta(const XKey& key, int32_t cur, int32_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonWriter& convert_delta(const XKey& key, uint32_t cur, uint32_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonWriter& convert_delta(const XKey& key, int64_t cur, int64_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonWriter& convert_delta(const XKey& key, uint64_t cur, uint64_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonWriter& convert_delta(const XKey& key, double cur, double base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    BsonWriter& convert_delta(const XKey& key, float cur, float base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    template <typename T>
+    BsonWriter& convert_delta(const XKey& key, const std::vector<T>& cur, const std::vector<T>& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    template <typename T>
+    BsonWriter& convert_delta(const XKey& key, const std::set<T>& cur, const std::set<T>& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    template <typename T>
+    void convert_delta(const XKey& key, const XType<T>& cur, const XType<T>& base) {
+        (void)base;
+        convert(key, cur);
+    }
+    template <typename K, typename T>
+    BsonWriter& convert_delta(const XKey& key, const std::map<K, T>& cur, const std::map<K, T>& base) {
+        if (_type!=top || !key.empty()) {
+            BsonWriter child(key, *this, doc);
+            child.map_delta(cur, base);
+        } else {
+            map_delta(cur, base);
+        }
+        return *this;
+    }
+    template <typename T>
+    BsonWriter& convert_delta(const XKey& key, const T& cur, const T& base) {
+        if (_type!=top || !key.empty()) {
+            BsonWriter child(key, *this, doc);
+            cur.__struct_to_delta(child, base);
+        } else {
+            cur.__struct_to_delta(*this, base);
+        }
+        return *this;
+    }
 private:
-    mutable _bson_t* _parent;
-    mutable _bson_t* _bson;
+    // removed key is written as null
+    template <typename K, typename T>
+    void map_delta(const std::map<K, T>& cur, const std::map<K, T>& base) {
+        typename std::map<K, T>::const_iterator ib = base.begin();
+        for (typename std::map<K, T>::const_iterator ic=cur.begin(); ic!=cur.end(); ++ic) {
+            for (; ib!=base.end() && ib->first<ic->first; ++ib) {
+                std::string k = Util::tostr(ib->first);
+                bson_append_null(_bson, k.c_str(), (int)k.length());
+            }
+            if (ib!=base.end() && !(ic->first<ib->first)) {
+                if (!Util::equal(ic->second, ib->second)) {
+                    this->convert_delta(Util::tostr(ic->first), ic->second, ib->second);
+                }
+                ++ib;
+            } else {
+                this->convert(Util::tostr(ic->first), ic->second);
+            }
+        }
+        for (; ib!=base.end(); ++ib) {
+            std::string k = Util::tostr(ib->first);
+            bson_append_null(_bson, k.c_str(), (int)k.length());
+        }
+    }
+
+    // child document, inherit settings of parent
+    BsonWriter(const XKey& key, const BsonWriter& parent, int type) {
+        init(key, parent._bson, type);
+        settings(parent);
+    }
+    // write into doc, which is owned by the caller
+    BsonWriter(_bson_t* doc, const BsonWriter& parent) {
+        _parent = 0;
+        _out = 0;
+        _bson = doc;
+        _type = top;
+        _store = borrowed;
+        _done = false;
+        settings(parent);
+    }
+    void init(const XKey& key, _bson_t*parent, int type) {
+        _parent = parent;
+        _out = 0;
+        _type = type;
+        _store = in_place;
+        _done = false;
+        _bson = &_doc;
+        if (0 == parent) {
+            _type = top;
+            bson_init(&_doc);
+        } else if (type == doc) {
+            bson_append_document_begin(parent, key.name, (int)key.len, &_doc);
+        } else {
+            bson_append_array_begin(parent, key.name, (int)key.len, &_doc);
+        }
+    }
+    void settings(const BsonWriter& from) {
+        _omit_default = from._omit_default;
+        _threads = from._threads;
+        _parallel_min = from._parallel_min;
+    }
+    void release() {
+        if (_type == doc) {
+            bson_append_document_end(_parent, &_doc);
+        } else if (_type == array) {
+            bson_append_array_end(_parent, &_doc);
+        } else if (_store == in_place) {
+            bson_destroy(&_doc);
+        } else if (_store == heap) {
+            bson_destroy(_bson);
+        } else if (_store == buffer) {
+            if (_done) {
+                bson_writer_end(_out->_writer);
+            } else {
+                bson_writer_rollback(_out->_writer);
+            }
+            _out->_busy = false;
+        }
+    }
+
+    // encode data[begin,end) with index key into a document of its own
+    template <typename T>
+    class VectorJob {
+    public:
+        VectorJob(const std::vector<T>& data, std::vector<_bson_t*>& parts, const BsonWriter& parent):_data(data),_parts(parts),_parent(parent) {
+        }
+        void operator()(size_t part, size_t begin, size_t end) {
+            BsonWriter writer(_parts[part], _parent);
+            writer._threads = 1;
+            BsonIndexKey k(begin);
+            for (size_t i=begin; i<end; ++i, k.next()) {
+                writer.convert(k.key(), _data[i]);
+            }
+        }
+    private:
+        const std::vector<T>& _data;
+        std::vector<_bson_t*>& _parts;
+        const BsonWriter& _parent;
+    };
+
+    template <typename T>
+    void parallel_vector(const std::vector<T>& data) {
+        std::vector<_bson_t*> parts(_threads, (_bson_t*)0);
+        try {
+            for (size_t i=0; i<parts.size(); ++i) {
+                parts[i] = bson_new();
+            }
+            VectorJob<T> job(data, parts, *this);
+            parallel_run(job, data.size(), parts.size());
+            for (size_t i=0; i<parts.size(); ++i) {
+                bson_concat(_bson, parts[i]);
+            }
+        } catch (...) {
+            for (size_t i=0; i<parts.size(); ++i) {
+                bson_destroy(parts[i]);
+            }
+            throw;
+        }
+        for (size_t i=0; i<parts.size(); ++i) {
+            bson_destroy(parts[i]);
+        }
+    }
+
+    friend class BsonSizer;
+    bson_t _doc;            // child being built, or top document in place
+    _bson_t* _parent;
+    _bson_t* _bson;         // &_doc, or the top document elsewhere, see _store
+    BsonBuffer* _out;
     int _type;
+    int _store;
+    bool _done;             // BsonBuffer document complete, else rolled back
+    bool _omit_default;
+    unsigned _threads;
+    size_t _parallel_min;
+};
+
+/*
+  compute the exact length of the document BsonWriter will build, without building it.
+  follow BsonWriter::convert rule by rule, keep them in sync.
+*/
+class BsonSizer {
+public:
+    BsonSizer(bool top=true, bool omit=false):_size(5),_top(top),_omit_default(omit) { // int32 length + document terminator
+    }
+public:
+    size_t size() const {
+        return _size;
+    }
+    void omit_default(bool omit) {
+        _omit_default = omit;
+    }
+    bool omit_default() const {
+        return _omit_default;
+    }
+    const std::string&type() {
+        static std::string t("bson");
+        return t;
+    }
+
+    BsonSizer& convert(const XKey& key, const BsonWriter& data){
+        return element(key, data._bson->len);
+    }
+    BsonSizer& convert(const XKey& key, const char* data) {
+        return element(key, 4+strlen(data)+1);
+    }
+    BsonSizer& convert(const XKey& key, const std::string& data) {
+        return element(key, 4+data.length()+1);
+    }
+    BsonSizer& convert(const XKey& key, const XStrView& data) {
+        return element(key, 4+data.size()+1);
+    }
+    BsonSizer& convert(const XKey& key, int16_t data) {
+        (void)data;
+        return element(key, 4);
+    }
+    BsonSizer& convert(const XKey& key, uint16_t data) {
+        (void)data;
+        return element(key, 4);
+    }
+    BsonSizer& convert(const XKey& key, int32_t data) {
+        (void)data;
+        return element(key, 4);
+    }
+    BsonSizer& convert(const XKey& key, uint32_t data) {
+        (void)data;
+        return element(key, 4);
+    }
+    BsonSizer& convert(const XKey& key, int64_t data) {
+        (void)data;
+        return element(key, 8);
+    }
+    BsonSizer& convert(const XKey& key, uint64_t data) {
+        (void)data;
+        return element(key, 8);
+    }
+    BsonSizer& convert(const XKey& key, float data) {
+        (void)data;
+        return element(key, 8);
+    }
+    BsonSizer& convert(const XKey& key, double data) {
+        (void)data;
+        return element(key, 8);
+    }
+    BsonSizer& convert(const XKey& key, bool data) {
+        (void)data;
+        return element(key, 1);
+    }
+
+    template<typename T>
+    BsonSizer& convert(const XKey& key, const std::vector<T>&data) {
+        BsonSizer child(false, _omit_default);
+        for (size_t i=0; i<data.size(); ++i) {
+            child.convert(index_key(i), data[i]);
+        }
+        return element(key, child._size);
+    }
+    template<typename T>
+    BsonSizer& convert_packed(const XKey& key, const std::vector<T>&data) {
+        if (0 == BsonPacked<T>::code) {
+            return convert(key, data);
+        }
+        return element(key, 4+1+data.size()*sizeof(T)); // length + subtype + bytes
+    }
+    template<typename T>
+    BsonSizer& convert(const XKey& key, const std::set<T>&data) {
+        BsonSizer child(false, _omit_default);
+        size_t i = 0;
+        for (typename std::set<T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter,++i) {
+            child.convert(index_key(i), *iter);
+        }
+        return element(key, child._size);
+    }
+    template<typename T>
+    BsonSizer& convert(const XKey& key, const std::map<std::string, T>&data) {
+        BsonSizer child(false, _omit_default);
+        BsonSizer& doc = (_top && key.empty())?*this:child;
+        for (typename std::map<std::string, T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
+            doc.convert(iter->first, iter->second);
+        }
+        return (&doc==this)?*this:element(key, child._size);
+    }
+    template <typename K, typename T>
+    BsonSizer& convert(const XKey& key, const std::map<K, T> &data) {
+        BsonSizer child(false, _omit_default);
+        BsonSizer& doc = (_top && key.empty())?*this:child;
+        for (typename std::map<K, T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
+            doc.convert(Util::tostr(iter->first), iter->second);
+        }
+        return (&doc==this)?*this:element(key, child._size);
+    }
+
+    template <typename T>
+    BsonSizer& convert(const XKey& key, const T& data) {
+        if (!_top || !key.empty()) {
+            BsonSizer child(false, _omit_default);
+            data.__struct_to_str(child, "");
+            return element(key, child._size);
+        } else {
+            data.__struct_to_str(*this, "");
+        }
+        return *this;
+    }
+
+    template <typename T>
+    void convert(const XKey& key, const XType<T>& data) {
+        data.__struct_to_str(*this, key);
+    }
+private:
+    // type + key + '\0' + value
+    BsonSizer& element(const XKey& key, size_t size) {
+        _size += 1+key.len+1+size;
+        return *this;
+    }
+    // only length of array index key matters
+    static XKey index_key(size_t index) {
+        static const char digits[] = "00000000000000000000";
+        size_t len = 1;
+        for (; index>=10; index/=10) {
+            ++len;
+        }
+        return XKey(digits, len);
+    }
+
+    size_t _size;
+    bool _top;
+    bool _omit_default;
 };
 
+template <typename T>
+inline void packed_convert(BsonWriter& obj, const XKey& key, const std::vector<T>& data) {
+    obj.convert_packed(key, data);
+}
+template <typename T>
+inline void packed_convert(BsonSizer& obj, const XKey& key, const std::vector<T>& data) {
+    obj.convert_packed(key, data);
+}
+template <typename T>
+inline void packed_delta(BsonWriter& obj, const XKey& key, const std::vector<T>& cur, const std::vector<T>& base) {
+    (void)base;
+    obj.convert_packed(key, cur);
+}
+
 }
 
 #endif
@@ -114,6 +114,9 @@ public: // convert
     bool has(const char*key) {
         return _val->exists(key);
     }
+    bool null() const { // libconfig has no null
+        return false;
+    }
     size_t size(bool to_vec=true) {
         if (_val->isList()) {
             return (size_t)_val->getLength();
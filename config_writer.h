@@ -22,12 +22,15 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <stdexcept>
 #include <string.h>
 
 #include "thirdparty/libconfig/include/libconfig.h++"
 
 #include "util.h"
 #include "xtypes.h"
+#include "xescape.h"
+#include "xstream.h"
 
 #define LIBCONFIG_BUFFER_SIZE 1024
 #define LIBCONFIG_TYPE_OBJECT 0
@@ -47,6 +50,8 @@ public:
         _buffer.reserve(LIBCONFIG_BUFFER_SIZE);
         _cur = &_buffer[0];
         _need_sep = false;
+        _precision = -1;
+        _omit_default = false;
     }
     ~ConfigWriter() {
     }
@@ -64,9 +69,31 @@ public:
         return buf;
     }
 
-    void x2struct_set_key(const char*key){ // openssl defined set_key macro ...
-        if (0!=key && key[0]!='\0') {
-            append(key, -1);
+    // output chunks in order, for callers building their own iovec
+    const std::vector<std::string>& chunks() const {
+        return _buffer;
+    }
+    // write output chunks to fd with writev, no copy into one string. return bytes written
+    size_t write_to(int fd) const {
+        return XOStream::writev(fd, _buffer.empty()?0:&_buffer[0], _buffer.size());
+    }
+
+    // skip member with default value(0, false, empty string/container), see Util::is_default
+    void omit_default(bool omit) {
+        _omit_default = omit;
+    }
+    bool omit_default() const {
+        return _omit_default;
+    }
+
+    // <0(default) write shortest string that round-trip, >=0 write fixed decimals for float/double
+    void float_precision(int precision) {
+        _precision = precision;
+    }
+
+    void x2struct_set_key(const XKey& key){ // openssl defined set_key macro ...
+        if (!key.empty()) {
+            append(key.name, (int)key.len);
             if (_indentCount <= 0) {
                 append("=", 1);
             } else {
@@ -101,52 +128,27 @@ public:
         return t;
     }
 
-    ConfigWriter& convert(const char*key, const std::string &val) {
+    ConfigWriter& convert(const XKey& key, const std::string &val) {
         indent();
         x2struct_set_key(key);
 
         append("\"", 1);
-        for (size_t i=0; i<val.length(); ++i) {
-            int c = (int)(val[i]) & 0xFF;
-            switch (c) {
-              case '\"':
-              case '\\':
-                append("\\", 1);
-                append(val[i]);
-                break;
-
-              case '\n':
-                append("\\n", 2);
-                break;
-
-              case '\r':
-                append("\\r", 2);
-                break;
-
-              case '\f':
-                append("\\f", 2);
-                break;
-
-              case '\t':
-                append("\\t", 2);
-                break;
+        escape(val.data(), val.length());
+        append("\"", 1);
 
-              default:
-                if(c >= ' ') {
-                    append(val[i]);
-                } else {
-                    char tmp[16];
-                    int l = sprintf(tmp, "\\x%02X", c);
-                    append(tmp, l);
-                }
-            }
-        }
+        return *this;
+    }
+    ConfigWriter& convert(const XKey& key, const XStrView &val) {
+        indent();
+        x2struct_set_key(key);
 
+        append("\"", 1);
+        escape(val.data(), val.size());
         append("\"", 1);
 
         return *this;
     }
-    ConfigWriter& convert(const char*key, bool val) {
+    ConfigWriter& convert(const XKey& key, bool val) {
         indent();
         x2struct_set_key(key);
         if (val) {
@@ -156,57 +158,59 @@ public:
         }
         return *this;
     }
-    ConfigWriter& convert(const char*key, int16_t val) {
+    ConfigWriter& convert(const XKey& key, int16_t val) {
         indent();
         x2struct_set_key(key);
         append(Util::tostr(val));
         return *this;
     }
-    ConfigWriter& convert(const char*key, uint16_t val) {
+    ConfigWriter& convert(const XKey& key, uint16_t val) {
         indent();
         x2struct_set_key(key);
         append(Util::tostr(val));
         return *this;
     }
-    ConfigWriter& convert(const char*key, int32_t val) {
+    ConfigWriter& convert(const XKey& key, int32_t val) {
         indent();
         x2struct_set_key(key);
         append(Util::tostr(val));
         return *this;
     }
-    ConfigWriter& convert(const char*key, uint32_t val) {
+    ConfigWriter& convert(const XKey& key, uint32_t val) {
         indent();
         x2struct_set_key(key);
         append(Util::tostr(val));
         return *this;
     }
-    ConfigWriter& convert(const char*key, int64_t val) {
+    ConfigWriter& convert(const XKey& key, int64_t val) {
         indent();
         x2struct_set_key(key);
         append(Util::tostr(val).append("L"));
         return *this;
     }
-    ConfigWriter& convert(const char*key, uint64_t val) {
+    ConfigWriter& convert(const XKey& key, uint64_t val) {
         indent();
         x2struct_set_key(key);
         append(Util::tostr(val).append("L"));
         return *this;
     }
-    ConfigWriter& convert(const char*key, double val) {
+    ConfigWriter& convert(const XKey& key, double val) {
         indent();
         x2struct_set_key(key);
-        append(Util::tostr(val));
+        char buf[X2STRUCT_FLOAT_BUFFER];
+        append_float(buf, Util::dtoa(val, buf, _precision));
         return *this;
     }
-    ConfigWriter& convert(const char*key, float val) {
+    ConfigWriter& convert(const XKey& key, float val) {
         indent();
         x2struct_set_key(key);
-        append(Util::tostr(val));
+        char buf[X2STRUCT_FLOAT_BUFFER];
+        append_float(buf, Util::ftoa(val, buf, _precision));
         return *this;
     }
 
     template<typename T>
-    ConfigWriter& convert(const char*key, const std::vector<T>&data) {
+    ConfigWriter& convert(const XKey& key, const std::vector<T>&data) {
         indent();
         x2struct_set_key(key);
         this->array_begin();
@@ -218,7 +222,7 @@ public:
     }
 
     template<typename T>
-    ConfigWriter& convert(const char*key, const std::set<T>&data) {
+    ConfigWriter& convert(const XKey& key, const std::set<T>&data) {
         indent();
         x2struct_set_key(key);
         this->array_begin();
@@ -230,7 +234,7 @@ public:
     }
 
     template <typename T>
-    void convert(const char*key, const std::map<std::string, T> &data) {
+    void convert(const XKey& key, const std::map<std::string, T> &data) {
         indent();
         x2struct_set_key(key);
         this->object_begin();
@@ -241,7 +245,7 @@ public:
     }
 
     template <typename KEY, typename T>
-    void convert(const char*key, const std::map<KEY, T> &data) {
+    void convert(const XKey& key, const std::map<KEY, T> &data) {
         indent();
         x2struct_set_key(key);
         this->object_begin();
@@ -254,16 +258,16 @@ public:
     }
 
     template <typename T>
-    void convert(const char*key, const T& data) {
+    void convert(const XKey& key, const T& data) {
         indent();
         x2struct_set_key(key);
         this->object_begin();
-        data.__struct_to_str(*this, key);
+        data.__struct_to_str(*this, key.name);
         this->object_end();
     }
 
     template <typename T>
-    void convert(const char*key, const XType<T>& data) {
+    void convert(const XKey& key, const XType<T>& data) {
         data.__struct_to_str(*this, key);
     }
 
@@ -284,6 +288,34 @@ private:
     void append(const std::string&str) {
         append(str.c_str(), str.length());
     }
+    void escape(const char* str, size_t len) {
+        size_t i = 0;
+        while (i < len) {
+            size_t n = XEscape::clean(str+i, len-i, X2STRUCT_ESCAPE_CONFIG);
+            if (n > 0) {
+                append(str+i, (int)n);
+                i += n;
+            }
+            if (i < len) {
+                char tmp[16];
+                append(tmp, XEscape::escape((unsigned char)str[i], X2STRUCT_ESCAPE_CONFIG, tmp));
+                ++i;
+            }
+        }
+    }
+    void append_float(const char* str, int len) { // libconfig read 3 as int, so write 3.0
+        if (str[len-1] == 'f') {        // inf/-inf from Util::dtoa, libconfig(strtod) reads 1e999 as inf
+            append(str, len-3);
+            append("1e999", 5);
+            return;
+        } else if (str[len-1] == 'n') { // nan
+            throw std::runtime_error("libconfig has no nan");
+        }
+        append(str, len);
+        if (0==memchr(str, '.', len) && 0==memchr(str, 'e', len)) {
+            append(".0", 2);
+        }
+    }
     void append(char ch) {
         char buf[1] = {ch};
         append(buf, 1);
@@ -308,6 +340,8 @@ private:
     int  _indentCount;
     char _indentChar;
     bool _need_sep;             // 是否需要分隔符
+    int  _precision;
+    bool _omit_default;
     std::vector<std::string> _buffer;
     std::string *_cur;
     std::vector<int> _state;
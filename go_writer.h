@@ -129,6 +129,9 @@ private:
     std::string type_name(const std::string& v) {
         return std::string("string");
     }
+    std::string type_name(const XStrView& v) {
+        return std::string("string");
+    }
     std::string type_name(bool v) {
         return std::string("bool");
     }
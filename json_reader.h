@@ -118,6 +118,9 @@ public: // convert
     bool has(const char*key) {
         return _val->HasMember(key);
     }
+    bool null() const {
+        return _val->IsNull();
+    }
     size_t size(bool to_vec=true) {
         if (_val->IsArray()) {
             return (size_t)_val->Size();
@@ -21,192 +21,261 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <stdexcept>
 
 #include "thirdparty/rapidjson/prettywriter.h"
 #include "thirdparty/rapidjson/stringbuffer.h"
 
 #include "xtypes.h"
+#include "xstream.h"
+#include "xparallel.h"
 
 namespace x2struct {
 
-class JsonWriter {
-    typedef rapidjson::StringBuffer JSON_WRITER_BUFFER;
-    typedef rapidjson::Writer<rapidjson::StringBuffer> JSON_WRITER_WRITER;
-    typedef rapidjson::PrettyWriter<rapidjson::StringBuffer> JSON_WRITER_PRETTY;
+/*
+  compact(indentCount<0) or pretty chosen at runtime, one branch per call.
+  this is what JsonWriter has always done, JsonCompactWriter/JsonPrettyWriter fix it at compile time.
+*/
+template <class OS>
+class JsonIndentWriter {
 public:
-    JsonWriter(int indentCount=0, char indentChar=' ') {
-        _buf = new JSON_WRITER_BUFFER;
-        if (indentCount < 0) {
-            _writer = new JSON_WRITER_WRITER(*_buf);
-            _pretty = 0;
-        } else {
-            _pretty = new JSON_WRITER_PRETTY(*_buf);
-            _pretty->SetIndent(indentChar, indentCount);
-            _writer = 0;
-        }
+    JsonIndentWriter(OS& os):_compact(os),_pretty(os),_is_compact(false) {
     }
-    ~JsonWriter() {
-        if (0 != _buf) {
-            delete _buf;
+    void SetIndent(int indentCount, char indentChar) {
+        _is_compact = indentCount < 0;
+        if (!_is_compact) {
+            _pretty.SetIndent(indentChar, (unsigned)indentCount);
         }
-        if (0 != _writer) {
-            delete _writer;
+    }
+    bool IsCompact() const {
+        return _is_compact;
+    }
+
+    bool Key(const char* str, rapidjson::SizeType len) {
+        return _is_compact?_compact.Key(str, len):_pretty.Key(str, len);
+    }
+    bool RawValue(const char* json, size_t len, rapidjson::Type type) {
+        return _is_compact?_compact.RawValue(json, len, type):_pretty.RawValue(json, len, type);
+    }
+    bool StartArray() {
+        return _is_compact?_compact.StartArray():_pretty.StartArray();
+    }
+    bool EndArray() {
+        return _is_compact?_compact.EndArray():_pretty.EndArray();
+    }
+    bool StartObject() {
+        return _is_compact?_compact.StartObject():_pretty.StartObject();
+    }
+    bool EndObject() {
+        return _is_compact?_compact.EndObject():_pretty.EndObject();
+    }
+    bool String(const char* str, rapidjson::SizeType len) {
+        return _is_compact?_compact.String(str, len):_pretty.String(str, len);
+    }
+    bool String(const std::string& str) {
+        return String(str.data(), (rapidjson::SizeType)str.length());
+    }
+    bool Bool(bool b) {
+        return _is_compact?_compact.Bool(b):_pretty.Bool(b);
+    }
+    bool Int(int i) {
+        return _is_compact?_compact.Int(i):_pretty.Int(i);
+    }
+    bool Uint(unsigned u) {
+        return _is_compact?_compact.Uint(u):_pretty.Uint(u);
+    }
+    bool Int64(int64_t i) {
+        return _is_compact?_compact.Int64(i):_pretty.Int64(i);
+    }
+    bool Uint64(uint64_t u) {
+        return _is_compact?_compact.Uint64(u):_pretty.Uint64(u);
+    }
+    bool Double(double d) {
+        return _is_compact?_compact.Double(d):_pretty.Double(d);
+    }
+    bool Null() {
+        return _is_compact?_compact.Null():_pretty.Null();
+    }
+private:
+    rapidjson::Writer<OS> _compact;
+    rapidjson::PrettyWriter<OS> _pretty;
+    bool _is_compact;
+};
+
+/*
+  OUTSTREAM is a rapidjson output stream.
+  rapidjson::StringBuffer keep all output in memory, use toStr() to get it.
+  XOStream flush output to fd/file/ostream in chunks, pass it in constructor.
+  WRITER is rapidjson::Writer(compact) or rapidjson::PrettyWriter, fixed at compile time
+  so every convert is a direct call into rapidjson, or JsonIndentWriter to choose by indentCount.
+*/
+template <class OUTSTREAM, class WRITER=rapidjson::Writer<OUTSTREAM> >
+class JsonWriterT {
+    typedef OUTSTREAM JSON_WRITER_BUFFER;
+    typedef WRITER JSON_WRITER_WRITER;
+public:
+    /* indentCount <0 compact, >=0 newline and indent. a fixed WRITER throws runtime_error
+       if indentCount asks for the other kind, default is the kind of WRITER */
+    JsonWriterT(int indentCount=default_indent((WRITER*)0), char indentChar=' ', OUTSTREAM* os=0)
+        :_buf(0!=os?os:new JSON_WRITER_BUFFER),_own_buf(0==os),_writer(*_buf),_precision(-1),_omit_default(false),_threads(1),_parallel_min(X2STRUCT_PARALLEL_MIN) {
+        try {
+            set_indent(_writer, indentCount, indentChar);
+        } catch (...) {
+            if (_own_buf) {
+                delete _buf;
+            }
+            throw;
         }
-        if (0 != _pretty) {
-            delete _pretty;
+    }
+    ~JsonWriterT() {
+        if (_own_buf) {
+            delete _buf;
         }
     }
 public:
     std::string toStr() {
-        return _buf->GetString();
+        return std::string(_buf->GetString(), _buf->GetSize());
     }
 
-    void x2struct_set_key(const char*key) { // openssl defined set_key macro, so we named it x2struct_set_key ...
-        if (0!=key && key[0]!='\0') {
-            if (0 != _writer) {
-                _writer->Key(key);
-            } else {
-                _pretty->Key(key);
-            }
-        }
+    // allocate size bytes once, size is usually X::jsonsize. only for the default StringBuffer
+    void reserve(size_t size) {
+        _buf->Reserve(size+1);  // GetString append '\0'
     }
-    void array_begin() {
-        if (0 != _writer) {
-            _writer->StartArray();
+
+    // <0(default) write shortest string that round-trip, >=0 write fixed decimals for float/double
+    void float_precision(int precision) {
+        _precision = precision;
+    }
+
+    // skip member with default value(0, false, empty string/container), see Util::is_default
+    void omit_default(bool omit) {
+        _omit_default = omit;
+    }
+    bool omit_default() const {
+        return _omit_default;
+    }
+
+    /*
+      encode vector with at least min_size elements in threads, each thread write a range
+      into its own buffer, and the fragments are spliced in order, output is the same.
+      only for compact writer, PrettyWriter ignore it.
+    */
+    void parallel(unsigned threads, size_t min_size=X2STRUCT_PARALLEL_MIN) {
+        _threads = (threads>0)?threads:1;
+        _parallel_min = (min_size>_threads)?min_size:_threads;
+    }
+
+    void x2struct_set_key(const XKey& key) { // openssl defined set_key macro, so we named it x2struct_set_key ...
+        if (key.empty()) {
+            return;
+        } else if (0 != key.enc) { // pre-encoded, skip escape
+            _writer.RawValue(key.enc->json, key.enc->json_len, rapidjson::kStringType);
         } else {
-            _pretty->StartArray();
+            _writer.Key(key.name, (rapidjson::SizeType)key.len);
         }
     }
+    void array_begin() {
+        _writer.StartArray();
+    }
     void array_end() {
-        if (0 != _writer) {
-            _writer->EndArray();
-        } else {
-            _pretty->EndArray();
-        }
+        _writer.EndArray();
     }
     void object_begin() {
-        if (0 != _writer) {
-            _writer->StartObject();
-        } else {
-            _pretty->StartObject();
-        }
+        _writer.StartObject();
     }
     void object_end() {
-        if (0 != _writer) {
-            _writer->EndObject();
-        } else {
-            _pretty->EndObject();
-        }
+        _writer.EndObject();
     }
     const std::string&type() {
         static std::string t("json");
         return t;
     }
 
-    JsonWriter& convert(const char*key, const std::string &val) {
+    JsonWriterT& convert(const XKey& key, const std::string &val) {
         x2struct_set_key(key);
-        if (0 != _writer) {
-            _writer->String(val);
-        } else {
-            _pretty->String(val);
-        }
+        _writer.String(val);
         return *this;
     }
-    JsonWriter& convert(const char*key, bool val) {
+    JsonWriterT& convert(const XKey& key, const XStrView &val) {
         x2struct_set_key(key);
-        if (0 != _writer) {
-            _writer->Bool(val);
-        } else {
-            _pretty->Bool(val);
-        }
+        _writer.String(val.data(), (rapidjson::SizeType)val.size());
         return *this;
     }
-    JsonWriter& convert(const char*key, int16_t val) {
+    JsonWriterT& convert(const XKey& key, bool val) {
         x2struct_set_key(key);
-        if (0 != _writer) {
-            _writer->Int(val);
-        } else {
-            _pretty->Int(val);
-        }
+        _writer.Bool(val);
         return *this;
     }
-    JsonWriter& convert(const char*key, uint16_t val) {
+    JsonWriterT& convert(const XKey& key, int16_t val) {
         x2struct_set_key(key);
-        if (0 != _writer) {
-            _writer->Uint(val);
-        } else {
-            _pretty->Uint(val);
-        }
+        _writer.Int(val);
         return *this;
     }
-    JsonWriter& convert(const char*key, int32_t val) {
+    JsonWriterT& convert(const XKey& key, uint16_t val) {
         x2struct_set_key(key);
-        if (0 != _writer) {
-            _writer->Int(val);
-        } else {
-            _pretty->Int(val);
-        }
+        _writer.Uint(val);
         return *this;
     }
-    JsonWriter& convert(const char*key, uint32_t val) {
+    JsonWriterT& convert(const XKey& key, int32_t val) {
         x2struct_set_key(key);
-        if (0 != _writer) {
-            _writer->Uint(val);
-        } else {
-            _pretty->Uint(val);
-        }
+        _writer.Int(val);
         return *this;
     }
-    JsonWriter& convert(const char*key, int64_t val) {
+    JsonWriterT& convert(const XKey& key, uint32_t val) {
         x2struct_set_key(key);
-        if (0 != _writer) {
-            _writer->Int64(val);
-        } else {
-            _pretty->Int64(val);
-        }
+        _writer.Uint(val);
         return *this;
     }
-    JsonWriter& convert(const char*key, uint64_t val) {
+    JsonWriterT& convert(const XKey& key, int64_t val) {
         x2struct_set_key(key);
-        if (0 != _writer) {
-            _writer->Uint64(val);
-        } else {
-            _pretty->Uint64(val);
-        }
+        _writer.Int64(val);
         return *this;
     }
-    JsonWriter& convert(const char*key, double val) {
+    JsonWriterT& convert(const XKey& key, uint64_t val) {
         x2struct_set_key(key);
-        if (0 != _writer) {
-            _writer->Double(val);
+        _writer.Uint64(val);
+        return *this;
+    }
+    JsonWriterT& convert(const XKey& key, double val) {
+        x2struct_set_key(key);
+        if (_precision<0 || !Util::finite(val)) {
+            _writer.Double(val);
         } else {
-            _pretty->Double(val);
+            char buf[X2STRUCT_FLOAT_BUFFER];
+            int len = Util::dtoa(val, buf, _precision);
+            _writer.RawValue(buf, (size_t)len, rapidjson::kNumberType);
         }
         return *this;
     }
-    JsonWriter& convert(const char*key, float val) {
+    JsonWriterT& convert(const XKey& key, float val) {
         x2struct_set_key(key);
-        if (0 != _writer) {
-            _writer->Double(val);
+        if (!Util::finite(val)) {
+            _writer.Double(val);
         } else {
-            _pretty->Double(val);
+            char buf[X2STRUCT_FLOAT_BUFFER];
+            int len = Util::ftoa(val, buf, _precision);
+            _writer.RawValue(buf, (size_t)len, rapidjson::kNumberType);
         }
         return *this;
     }
 
     template<typename T>
-    JsonWriter& convert(const char*key, const std::vector<T>&data) {
+    JsonWriterT& convert(const XKey& key, const std::vector<T>&data) {
         x2struct_set_key(key);
         this->array_begin();
-        for (size_t i=0; i<data.size(); ++i) {
-            this->convert("", data[i]);
+        if (_threads>1 && data.size()>=_parallel_min && is_compact(_writer)) {
+            parallel_vector(data);
+        } else {
+            for (size_t i=0; i<data.size(); ++i) {
+                this->convert("", data[i]);
+            }
         }
         this->array_end();
         return *this;
     }
 
     template<typename T>
-    JsonWriter& convert(const char*key, const std::set<T>&data) {
+    JsonWriterT& convert(const XKey& key, const std::set<T>&data) {
         x2struct_set_key(key);
         this->array_begin();
         for (typename std::set<T>::const_iterator it=data.begin(); it!=data.end(); ++it) {
@@ -217,7 +286,7 @@ public:
     }
 
     template <typename T>
-    void convert(const char*key, const std::map<std::string, T> &data) {
+    void convert(const XKey& key, const std::map<std::string, T> &data) {
         x2struct_set_key(key);
         this->object_begin();
         for (typename std::map<std::string,T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
@@ -227,7 +296,7 @@ public:
     }
 
     template <typename KEY, typename T>
-    void convert(const char*key, const std::map<KEY, T> &data) {
+    void convert(const XKey& key, const std::map<KEY, T> &data) {
         x2struct_set_key(key);
         this->object_begin();
         for (typename std::map<KEY,T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
@@ -238,24 +307,245 @@ public:
     }
 
     template <typename T>
-    void convert(const char*key, const T& data) {
+    void convert(const XKey& key, const T& data) {
         x2struct_set_key(key);
         this->object_begin();
-        data.__struct_to_str(*this, key);
+        data.__struct_to_str(*this, key.name);
         this->object_end();
     }
 
     template <typename T>
-    void convert(const char*key, const XType<T>& data) {
+    void convert(const XKey& key, const XType<T>& data) {
         data.__struct_to_str(*this, key);
     }
 
+    // splice cached compact json, only when output options are default
+    template <typename T>
+    void convert(const XKey& key, const XCached<T>& data) {
+        if (_precision>=0 || _omit_default || !is_compact(_writer)) {
+            this->convert(key, data.get());
+            return;
+        }
+        const std::string* bytes = data.cache_get(X2STRUCT_CACHE_JSON);
+        if (0 == bytes) {
+            JsonWriterT<rapidjson::StringBuffer> writer;
+            writer.convert("", data.get());
+            std::string str = writer.toStr();
+            bytes = &data.cache_set(X2STRUCT_CACHE_JSON, str);
+        }
+        x2struct_set_key(key);
+        _writer.RawValue(bytes->data(), bytes->length(), rapidjson::kObjectType);
+    }
+
+    /*
+      delta encoding, see X::tojson_delta. struct and map only write what changed,
+      removed map key is written as null, other value is written whole.
+    */
+    JsonWriterT& convert_delta(const XKey& key, const std::string& cur, const std::string& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    JsonWriterT& convert_delta(const XKey& key, const XStrView& cur, const XStrView& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    JsonWriterT& convert_delta(const XKey& key, bool cur, bool base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    JsonWriterT& convert_delta(const XKey& key, int16_t cur, int16_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    JsonWriterT& convert_delta(const XKey& key, uint16_t cur, uint16_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    JsonWriterT& convert_delta(const XKey& key, int32_t cur, int32_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    JsonWriterT& convert_delta(const XKey& key, uint32_t cur, uint32_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    JsonWriterT& convert_delta(const XKey& key, int64_t cur, int64_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    JsonWriterT& convert_delta(const XKey& key, uint64_t cur, uint64_t base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    JsonWriterT& convert_delta(const XKey& key, double cur, double base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    JsonWriterT& convert_delta(const XKey& key, float cur, float base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    template <typename T>
+    JsonWriterT& convert_delta(const XKey& key, const std::vector<T>& cur, const std::vector<T>& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    template <typename T>
+    JsonWriterT& convert_delta(const XKey& key, const std::set<T>& cur, const std::set<T>& base) {
+        (void)base;
+        return convert(key, cur);
+    }
+    template <typename T>
+    void convert_delta(const XKey& key, const XType<T>& cur, const XType<T>& base) {
+        (void)base;
+        convert(key, cur);
+    }
+    template <typename K, typename T>
+    void convert_delta(const XKey& key, const std::map<K, T>& cur, const std::map<K, T>& base) {
+        x2struct_set_key(key);
+        this->object_begin();
+        typename std::map<K, T>::const_iterator ib = base.begin();
+        for (typename std::map<K, T>::const_iterator ic=cur.begin(); ic!=cur.end(); ++ic) {
+            for (; ib!=base.end() && ib->first<ic->first; ++ib) {
+                x2struct_set_key(Util::tostr(ib->first));
+                _writer.Null();
+            }
+            if (ib!=base.end() && !(ic->first<ib->first)) {
+                if (!Util::equal(ic->second, ib->second)) {
+                    this->convert_delta(Util::tostr(ic->first), ic->second, ib->second);
+                }
+                ++ib;
+            } else {
+                this->convert(Util::tostr(ic->first), ic->second);
+            }
+        }
+        for (; ib!=base.end(); ++ib) {
+            x2struct_set_key(Util::tostr(ib->first));
+            _writer.Null();
+        }
+        this->object_end();
+    }
+    template <typename T>
+    void convert_delta(const XKey& key, const T& cur, const T& base) {
+        x2struct_set_key(key);
+        this->object_begin();
+        cur.__struct_to_delta(*this, base);
+        this->object_end();
+    }
+
 private:
+    JsonWriterT(const JsonWriterT&);
+    JsonWriterT& operator=(const JsonWriterT&);
+
+    // encode data[begin,end) as "[e1,e2...]" into a writer of its own
+    template <typename T>
+    class VectorJob {
+    public:
+        VectorJob(const std::vector<T>& data, std::vector<JsonWriterT<rapidjson::StringBuffer>*>& parts, const JsonWriterT& from)
+            :_data(data),_parts(parts),_from(from) {
+        }
+        void operator()(size_t part, size_t begin, size_t end) {
+            JsonWriterT<rapidjson::StringBuffer>* writer = _parts[part];
+            writer->float_precision(_from._precision);
+            writer->omit_default(_from._omit_default);
+            writer->array_begin();
+            for (size_t i=begin; i<end; ++i) {
+                writer->convert("", _data[i]);
+            }
+            writer->array_end();
+        }
+    private:
+        const std::vector<T>& _data;
+        std::vector<JsonWriterT<rapidjson::StringBuffer>*>& _parts;
+        const JsonWriterT& _from;
+    };
+
+    template <typename T>
+    void parallel_vector(const std::vector<T>& data) {
+        std::vector<JsonWriterT<rapidjson::StringBuffer>*> parts(_threads, (JsonWriterT<rapidjson::StringBuffer>*)0);
+        try {
+            for (size_t i=0; i<parts.size(); ++i) {
+                parts[i] = new JsonWriterT<rapidjson::StringBuffer>;
+            }
+            VectorJob<T> job(data, parts, *this);
+            parallel_run(job, data.size(), parts.size());
+            for (size_t i=0; i<parts.size(); ++i) { // strip [], RawValue add ',' between parts
+                rapidjson::StringBuffer& buf = *parts[i]->_buf;
+                _writer.RawValue(buf.GetString()+1, buf.GetSize()-2, rapidjson::kArrayType);
+            }
+        } catch (...) {
+            for (size_t i=0; i<parts.size(); ++i) {
+                delete parts[i];
+            }
+            throw;
+        }
+        for (size_t i=0; i<parts.size(); ++i) {
+            delete parts[i];
+        }
+    }
+
+    template <class OS>
+    static bool is_compact(rapidjson::PrettyWriter<OS>& writer) {
+        (void)writer;
+        return false;
+    }
+    template <class OS>
+    static bool is_compact(JsonIndentWriter<OS>& writer) {
+        return writer.IsCompact();
+    }
+    template <class W>
+    static bool is_compact(W& writer) {
+        (void)writer;
+        return true;
+    }
+
+    template <class OS>
+    static void set_indent(rapidjson::PrettyWriter<OS>& writer, int indentCount, char indentChar) {
+        if (indentCount < 0) {
+            throw std::runtime_error("pretty json writer can not be compact, use JsonWriter or JsonCompactWriter");
+        }
+        writer.SetIndent(indentChar, (unsigned)indentCount);
+    }
+    template <class OS>
+    static void set_indent(JsonIndentWriter<OS>& writer, int indentCount, char indentChar) {
+        writer.SetIndent(indentCount, indentChar);
+    }
+    template <class W>
+    static void set_indent(W& writer, int indentCount, char indentChar) {
+        (void)writer;(void)indentChar;
+        if (indentCount >= 0) {
+            throw std::runtime_error("compact json writer can not indent, use JsonWriter or JsonPrettyWriter");
+        }
+    }
+
+    template <class OS>
+    static int default_indent(rapidjson::PrettyWriter<OS>*) {
+        return 0;
+    }
+    template <class OS>
+    static int default_indent(JsonIndentWriter<OS>*) {
+        return 0;
+    }
+    template <class W>
+    static int default_indent(W*) {
+        return -1;
+    }
+
     JSON_WRITER_BUFFER* _buf;
-    JSON_WRITER_WRITER* _writer;
-    JSON_WRITER_PRETTY* _pretty;
+    bool _own_buf;
+    JSON_WRITER_WRITER _writer;
+    int _precision;
+    bool _omit_default;
+    unsigned _threads;
+    size_t _parallel_min;
+
+    template <class OS, class W> friend class JsonWriterT;
 };
 
+typedef JsonWriterT<rapidjson::StringBuffer, JsonIndentWriter<rapidjson::StringBuffer> > JsonWriter;
+typedef JsonWriterT<rapidjson::StringBuffer> JsonCompactWriter;
+typedef JsonWriterT<rapidjson::StringBuffer, rapidjson::PrettyWriter<rapidjson::StringBuffer> > JsonPrettyWriter;
+
 }
 
 #endif
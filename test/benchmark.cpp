@@ -0,0 +1,135 @@
+/*
+* Copyright (C) 2017 YY Inc. All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License"); 
+* you may not use this file except in compliance with the License. 
+* You may obtain a copy of the License at
+*
+*	http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, 
+* software distributed under the License is distributed on an "AS IS" BASIS, 
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. 
+* See the License for the specific language governing permissions and 
+* limitations under the License.
+*/
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef WINDOWS
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+
+#include "x2struct.hpp"
+
+using namespace std;
+using namespace x2struct;
+
+struct record {
+    int64_t id;
+    int32_t type;
+    uint32_t flags;
+    bool    enable;
+    double  score;
+    string  name;
+    string  desc;
+    vector<int> tags;
+    XTOSTRUCT(O(id, type, flags, enable, score, name, desc, tags));
+};
+
+struct records {
+    vector<record> rs;
+    XTOSTRUCT(O(rs));
+};
+
+static double now_ms()
+{
+    #ifndef WINDOWS
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec*1000.0+tv.tv_usec/1000.0;
+    #else
+    return clock()*1000.0/CLOCKS_PER_SEC;
+    #endif
+}
+
+static void make_records(vector<record>&rs, size_t n)
+{
+    rs.resize(n);
+    for (size_t i=0; i<n; ++i) {
+        record&r = rs[i];
+        r.id = 1000000000LL+(int64_t)i;
+        r.type = (int32_t)(i%7);
+        r.flags = (uint32_t)(i*2654435761U);
+        r.enable = (i%2)==0;
+        r.score = (double)i/3;
+        r.name = "record-"+Util::tostr(i);
+        r.desc = "some description text of the record";
+        r.tags.push_back((int)i);
+        r.tags.push_back((int)i*2);
+    }
+}
+
+#if (defined XTOSTRUCT_BSON || defined XTOSTRUCT_BSON_NATIVE)
+#ifdef XTOSTRUCT_BSON_NATIVE
+#define BSON_CODEC "native"
+#else
+#define BSON_CODEC "libbson"
+#endif
+
+static size_t load_bson(const string& data)
+{
+    records rs;
+    X::loadbson(data, rs);
+    return (rs.rs.empty())?0:data.length();
+}
+#endif
+
+// run f rounds times, print best ms per round
+#define BENCH(name, rounds, expr)                                   \
+    do {                                                            \
+        double best = 0;                                            \
+        size_t bytes = 0;                                           \
+        for (int __r=0; __r<rounds; ++__r) {                        \
+            double start = now_ms();                                \
+            bytes = (expr);                                         \
+            double cost = now_ms()-start;                           \
+            if (__r==0 || cost<best) {                              \
+                best = cost;                                        \
+            }                                                       \
+        }                                                           \
+        printf("%-32s %10.2f ms %12lu bytes\n", name, best, (unsigned long)bytes); \
+    } while (false)
+
+int main(int argc, char *argv[])
+{
+    vector<record> rs;
+    make_records(rs, 200000);
+
+    vector<int> ints(5000000);
+    for (size_t i=0; i<ints.size(); ++i) {
+        ints[i] = (int)(i%1000);
+    }
+
+    BENCH("json compact ints", 10, X::tojson(ints).length());
+    BENCH("json compact", 5, X::tojson(rs).length());
+    BENCH("json pretty", 5, X::tojson(rs, "", 2, ' ').length());
+    BENCH("xml", 5, X::toxml(rs, "root").length());
+
+    #if (defined XTOSTRUCT_BSON || defined XTOSTRUCT_BSON_NATIVE)
+    records doc;
+    doc.rs = rs;
+    string bson = X::tobson(doc);
+    BENCH("tobson " BSON_CODEC, 5, X::tobson(doc).length());
+    BENCH("loadbson " BSON_CODEC, 5, load_bson(bson));
+    #endif
+
+    return 0;
+}
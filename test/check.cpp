@@ -21,6 +21,8 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <sstream>
+#include <limits>
 
 
 #include "gtest_stub.h"
@@ -115,6 +117,336 @@ TEST(json, marshal)
     base_check(y);
 }
 
+TEST(json, key)
+{
+    map<string, int> m;
+    m["a\"b"] = 1;     // map key is not pre-encoded, must be escaped
+    sub s;
+    s.a = 2;
+    s.b = "x";
+    EXPECT_EQ(X::tojson(m), "{\"a\\\"b\":1}");
+    EXPECT_EQ(X::tojson(s), "{\"a\":2,\"b\":\"x\"}");
+    EXPECT_EQ(X::toxml(s, "s"), "<s><a>2</a><b>x</b></s>");
+}
+
+TEST(json, stream)
+{
+    xstruct x;
+    X::loadjson("test.json", x, true);
+
+    std::ostringstream out;
+    XOStream os(out, 16);   // small buffer, force many flush
+    X::tojson(x, os);
+    EXPECT_EQ(out.str(), X::tojson(x));
+    EXPECT_EQ(os.size(), out.str().length());
+
+    FILE *fp = tmpfile();
+    XOStream fos(fp);
+    X::tojson(x, fos, "", 4, ' ');
+    std::string data((size_t)ftell(fp), '\0');
+    rewind(fp);
+    EXPECT_EQ(fread(&data[0], 1, data.length(), fp), data.length());
+    fclose(fp);
+    EXPECT_EQ(data, X::tojson(x, "", 4, ' '));
+}
+
+TEST(json, size)
+{
+    xstruct x;
+    X::loadjson("test.json", x, true);
+
+    size_t n = X::jsonsize(x);
+    EXPECT_EQ(n, X::tojson(x).length());
+    XOStream counter(XOStream::count_only, 8);
+    X::tojson(x, counter);
+    EXPECT_EQ(counter.size(), n);
+    EXPECT_EQ(X::jsonsize(x, "", 4, ' '), X::tojson(x, "", 4, ' ').length());
+    EXPECT_EQ(X::xmlsize(x, "root", 2, '\t'), X::toxml(x, "root", 2, '\t').length());
+
+    xstruct o = x;      // sizes follow omitDefault
+    o.tint = 0;
+    o.vint.clear();
+    o.tstring.clear();
+    EXPECT_EQ(X::jsonsize(o, "", -1, ' ', true), X::tojson(o, "", -1, ' ', true).length());
+    EXPECT_EQ(X::jsonsize(o, "", 4, ' ', true), X::tojson(o, "", 4, ' ', true).length());
+    EXPECT_EQ(X::xmlsize(o, "root", 2, ' ', true), X::toxml(o, "root", 2, ' ', true).length());
+    EXPECT_TRUE(X::jsonsize(o, "", -1, ' ', true) < X::jsonsize(o));
+    #ifdef XTOSTRUCT_BSON
+    EXPECT_EQ(X::bsonsize(o, true), X::tobson(o, true).length());
+    EXPECT_TRUE(X::bsonsize(o, true) < X::bsonsize(o));
+    #endif
+
+    std::string frame(n, '\0');    // encode in place
+    XOStream os(&frame[0], n);
+    X::tojson(x, os);
+    EXPECT_EQ(frame, X::tojson(x));
+
+    bool excpt = false;
+    try {
+        XOStream small(&frame[0], n-1);
+        X::tojson(x, small);
+    } catch (...) {
+        excpt = true;
+    }
+    EXPECT_TRUE(excpt);
+}
+
+TEST(json, writer_indent)
+{
+    sub s;
+    s.a = 1;
+    s.b = "b";
+    JsonWriter pretty0;     // JsonWriter chooses at runtime, default newline without indent
+    pretty0.convert("", s);
+    EXPECT_EQ(pretty0.toStr(), X::tojson(s, "", 0));
+    JsonWriter pretty4(4, ' ');
+    pretty4.convert("", s);
+    EXPECT_EQ(pretty4.toStr(), X::tojson(s, "", 4, ' '));
+    JsonWriter compact(-1);
+    compact.convert("", s);
+    EXPECT_EQ(compact.toStr(), "{\"a\":1,\"b\":\"b\"}");
+    JsonCompactWriter fixed;
+    fixed.convert("", s);
+    EXPECT_EQ(fixed.toStr(), compact.toStr());
+
+    int thrown = 0;
+    try {
+        JsonCompactWriter bad(4, ' ');
+    } catch (std::exception&) {
+        ++thrown;
+    }
+    try {
+        JsonPrettyWriter bad(-1);
+    } catch (std::exception&) {
+        ++thrown;
+    }
+    EXPECT_EQ(thrown, 2);
+}
+
+TEST(json, parallel)
+{
+    xstruct x;
+    X::loadjson("test.json", x, true);
+    vector<xstruct> v(37, x);
+
+    JsonCompactWriter writer;
+    writer.parallel(4, 1);
+    writer.convert("", v);
+    EXPECT_EQ(writer.toStr(), X::tojson(v));
+    EXPECT_EQ(X::tojson_parallel(v, 3), X::tojson(v));
+}
+
+struct omit_t {
+    int a;
+    int b;
+    string c;
+    vector<int> d;
+    omit_t():a(0),b(0) {}
+    XTOSTRUCT(A(a,"x,oe"), O(b,c,d));
+};
+
+TEST(json, omit)
+{
+    sub s;
+    s.a = 0;
+    EXPECT_EQ(X::tojson(s, "", -1, ' ', true), "{\"a\":0}");      // M is never omitted
+    s.b = "b";
+    EXPECT_EQ(X::tojson(s, "", -1, ' ', true), "{\"a\":0,\"b\":\"b\"}");
+
+    omit_t o;
+    EXPECT_EQ(X::tojson(o), "{\"b\":0,\"c\":\"\",\"d\":[]}");   // oe is omitted without omitDefault
+    EXPECT_EQ(X::tojson(o, "", -1, ' ', true), "{}");
+    EXPECT_EQ(X::toxml(o, "o", -1, ' ', true), "<o></o>");
+    o.a = 1;
+    o.d.push_back(2);
+    EXPECT_EQ(X::tojson(o, "", -1, ' ', true), "{\"x\":1,\"d\":[2]}");
+
+    xstruct x;
+    X::loadjson("test.json", x, true);
+    x.tint = 0;
+    x.vint.clear();
+    xstruct y;
+    X::loadjson(X::tojson(x, "", -1, ' ', true), y, false);
+    EXPECT_TRUE(!y.xhas("tint"));
+    EXPECT_TRUE(!y.xhas("vint"));
+    EXPECT_TRUE(y.xhas("vstring"));
+    #ifdef XTOSTRUCT_BSON
+    EXPECT_EQ(X::tobson(x).length()-X::tobson(x, true).length(), 21U);  // tint int32 10 bytes, vint [] 11 bytes
+    #endif
+}
+
+TEST(json, delta)
+{
+    xstruct base;
+    X::loadjson("test.json", base, true);
+    xstruct cur = base;
+    EXPECT_EQ(X::tojson_delta(cur, base), "{}");
+
+    cur.tint = 1;
+    cur.tmap[108].b = "h";
+    cur.tmap.erase(109);
+    cur.tmap[110].a = 3;
+    cur.vint.push_back(2);
+    EXPECT_EQ(X::tojson_delta(cur, base), "{\"tint\":1,\"vint\":[102,2],\"tmap\":{\"108\":{\"b\":\"h\"},\"109\":null,\"110\":{\"a\":3,\"b\":\"\"}}}");
+
+    xstruct y = base;
+    X::loadjson_delta(X::tojson_delta(cur, base), y, false);
+    EXPECT_EQ(X::tojson(y), X::tojson(cur));
+    #ifdef XTOSTRUCT_BSON
+    xstruct z = base;
+    X::loadbson_delta(X::tobson_delta(cur, base), z);
+    EXPECT_EQ(X::tojson(z), X::tojson(cur));
+    #endif
+}
+
+struct chars_t {
+    char c;
+    int8_t i8;
+    uint8_t u8;
+    long long ll;
+    chars_t():c(0),i8(0),u8(0),ll(0) {}
+    XTOSTRUCT(O(c, i8, u8, ll));
+};
+
+TEST(json, arithmetic)
+{
+    // every builtin arithmetic type compares by value, whatever the int*_t typedefs are
+    chars_t a;
+    chars_t b;
+    EXPECT_TRUE(Util::equal(a, b));
+    b.i8 = -1;
+    EXPECT_TRUE(!Util::equal(a, b));
+    b = a;
+    b.c = 'c';
+    EXPECT_TRUE(!Util::equal(a, b));
+    EXPECT_TRUE(Util::is_default(a.c) && Util::is_default(a.i8) && Util::is_default(a.u8) && Util::is_default(a.ll));
+    EXPECT_TRUE(!Util::is_default(b.c));
+    EXPECT_TRUE(!Util::is_default((signed char)-1) && !Util::is_default((unsigned long)1));
+    EXPECT_TRUE(Util::is_default(0.0L));
+}
+
+struct cached_t {
+    int id;
+    XCached<sub> s;
+    XTOSTRUCT(O(id, s));
+};
+
+TEST(json, cached)
+{
+    sub s;
+    s.a = 1;
+    s.b = "b";
+    XCached<sub> cs(s);
+    vector<cached_t> v(3);
+    for (size_t i=0; i<v.size(); ++i) {
+        v[i].id = (int)i;
+        v[i].s = cs;
+    }
+    string j = X::tojson(v);
+    EXPECT_EQ(j, "[{\"id\":0,\"s\":{\"a\":1,\"b\":\"b\"}},{\"id\":1,\"s\":{\"a\":1,\"b\":\"b\"}},{\"id\":2,\"s\":{\"a\":1,\"b\":\"b\"}}]");
+    EXPECT_TRUE(cs.cache_get(X2STRUCT_CACHE_JSON) != 0);
+    EXPECT_EQ(X::toxml(v[0], "r"), "<r><id>0</id><s><a>1</a><b>b</b></s></r>");
+
+    v[1].s.mut()->a = 2;     // copy on write, others keep cached bytes
+    EXPECT_EQ(v[1].s->a, 2);
+    EXPECT_EQ(v[2].s->a, 1);
+    EXPECT_EQ(X::tojson(v[1]), "{\"id\":1,\"s\":{\"a\":2,\"b\":\"b\"}}");
+    v[1].s.mut()->a = 3;     // sole owner, mutated in place after the encode above
+    v[1].s.mut()->b = "c";
+    EXPECT_EQ(X::tojson(v[1]), "{\"id\":1,\"s\":{\"a\":3,\"b\":\"c\"}}");
+    EXPECT_EQ(X::toxml(v[1], "r"), "<r><id>1</id><s><a>3</a><b>c</b></s></r>");
+
+    // a guard kept across encodes, bytes are bypassed while it is alive
+    {
+        XCached<sub>::Mut m = v[1].s.mut();
+        m->a = 4;
+        EXPECT_EQ(X::tojson(v[1]), "{\"id\":1,\"s\":{\"a\":4,\"b\":\"c\"}}");
+        m->a = 5;
+        EXPECT_EQ(X::tojson(v[1]), "{\"id\":1,\"s\":{\"a\":5,\"b\":\"c\"}}");
+        cached_t copy = v[1];   // value being changed is copied, not shared
+        m->a = 6;
+        EXPECT_EQ(copy.s->a, 5);
+    }
+    EXPECT_EQ(X::tojson(v[1]), "{\"id\":1,\"s\":{\"a\":6,\"b\":\"c\"}}");
+    EXPECT_TRUE(v[1].s.cache_get(X2STRUCT_CACHE_JSON) != 0);
+    s.a = 7;
+    v[1].s.set(s);
+    EXPECT_EQ(X::tojson(v[1]), "{\"id\":1,\"s\":{\"a\":7,\"b\":\"b\"}}");
+    EXPECT_EQ(v[0].s->a, 1);
+
+    vector<cached_t> r;
+    X::loadjson(j, r, false);
+    EXPECT_EQ(X::tojson(r), j);
+}
+
+TEST(json, float)
+{
+    vector<float> vf;
+    vf.push_back(0.1f);
+    vf.push_back(1.5f);
+    vf.push_back(3.0f);
+    vector<double> vd;
+    vd.push_back(0.1);
+    vd.push_back(1.0/3);
+    EXPECT_EQ(X::tojson(vf), "[0.1,1.5,3.0]");
+    EXPECT_EQ(X::tojson(vd), "[0.1,0.3333333333333333]");
+
+    char buf[X2STRUCT_FLOAT_BUFFER];
+    EXPECT_EQ(string(buf, Util::ftoa(3.14159f, buf, 2)), "3.14");
+    EXPECT_EQ(string(buf, Util::dtoa(-2.5, buf, 0)), "-2");
+
+    map<string, float> m;
+    m["f"] = 16777215.0f;
+    m["g"] = 1e-7f;
+    map<string, float> n;
+    X::loadjson(X::tojson(m), n, false);
+    EXPECT_EQ(n["f"], m["f"]);
+    EXPECT_EQ(n["g"], m["g"]);
+    n.clear();
+    X::loadxml(X::toxml(m, "m"), n, false);
+    EXPECT_EQ(n["g"], m["g"]);
+}
+
+struct kvcon {
+    string url;
+    XTOSTRUCT(M(url));
+    XTOSTRUCT_CONDITION_KV("cfgip", "200");
+};
+
+struct kvnone {
+    string url;
+    XTOSTRUCT(M(url));
+    XTOSTRUCT_CONDITION_KV("cfgip", "300");
+};
+
+struct kvholder {
+    kvcon con;
+    XTOSTRUCT(O(con));
+};
+
+struct kvholder_none {
+    kvnone con;
+    XTOSTRUCT(O(con));
+};
+
+TEST(json, condition)
+{
+    xstruct x;
+    X::loadjson("test.json", x, true);
+
+    kvholder j;
+    X::loadjson("test.json", j, true);
+    EXPECT_EQ(j.con.url, x.con.url);
+
+    kvholder m;
+    X::loadxml("test.xml", m, true);
+    EXPECT_EQ(m.con.url, x.con.url);
+
+    kvholder_none n;
+    X::loadxml("test.xml", n, true);
+    EXPECT_TRUE(n.con.url.empty());
+}
+
 TEST(json, invalid)
 {
     string data("hello");
@@ -147,6 +479,65 @@ TEST(config, marshal)
     X::loadconfig(n, y, false);
     base_check(y);
 }
+
+TEST(config, file)
+{
+    xstruct x;
+    X::loadconfig("test.cfg", x, true);
+    X::toconfigfile(x, "file.cfg", "root", 1, '\t');
+    std::ifstream fs("file.cfg", std::ifstream::binary);
+    std::string data((std::istreambuf_iterator<char>(fs)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(data, X::toconfig(x, "root", 1, '\t'));
+    remove("file.cfg");
+}
+
+struct reals_t {
+    double d;
+    float f;
+    XTOSTRUCT(O(d, f));
+};
+
+TEST(config, float)
+{
+    reals_t r;
+    r.d = 3;
+    r.f = -std::numeric_limits<float>::infinity();
+    EXPECT_EQ(X::toconfig(r, ""), "{d=3.0;f=-1e999}");
+    r.d = std::numeric_limits<double>::infinity();
+    reals_t l;
+    X::loadconfig(X::toconfig(r, "root"), l, false);
+    EXPECT_TRUE(l.d>DBL_MAX && l.f<-FLT_MAX);   // inf read back
+    r.d = std::numeric_limits<double>::quiet_NaN();
+    bool thrown = false;
+    try {
+        X::toconfig(r, "root");
+    } catch (std::exception&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+#endif
+
+#ifndef WINDOWS
+TEST(xdate, dst)
+{
+    const char* old = getenv("TZ");
+    std::string saved = (0!=old)?old:"";
+    setenv("TZ", "America/New_York", 1);
+    tzset();
+    XDate summer, winter;
+    summer->parse("2017-07-01 12:00:00");   // EDT, UTC-4
+    winter->parse("2017-01-01 12:00:00");   // EST, UTC-5
+    EXPECT_EQ(summer->unix_time, 1498924800);
+    EXPECT_EQ(winter->unix_time, 1483290000);
+    EXPECT_EQ(summer->format(), "2017-07-01 12:00:00");
+    if (0 != old) {
+        setenv("TZ", saved.c_str(), 1);
+    } else {
+        unsetenv("TZ");
+    }
+    tzset();
+}
 #endif
 
 TEST(xml, unmarshal)
@@ -168,6 +559,334 @@ TEST(xml, marshal)
     base_check(y);
 }
 
+TEST(xml, inplace)
+{
+    xstruct x;
+    X::loadxml("test.xml", x, true);
+    string n = X::toxml(x, "xmlroot");
+
+    std::vector<char> buf(n.begin(), n.end());
+    buf.push_back('\0');
+    xstruct y;
+    X::loadxml_inplace(&buf[0], n.length(), y);
+    base_check(y);
+
+    bool thrown = false;
+    try {
+        X::loadxml("not_exist.xml", y, true);
+    } catch (const std::exception&e) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
+#ifndef WINDOWS
+TEST(xml, pipe)
+{
+    std::ifstream fs("test.xml");
+    std::string data((std::istreambuf_iterator<char>(fs)), std::istreambuf_iterator<char>());
+    data.append(10000, '\n');  // bigger than the first read buffer
+
+    int fds[2];
+    EXPECT_EQ(pipe(fds), 0);
+    EXPECT_EQ(write(fds[1], data.data(), data.length()), (ssize_t)data.length());
+    close(fds[1]);
+    xstruct x;
+    X::loadxml("/dev/fd/"+Util::tostr(fds[0]), x, true);   // fifo has no size, read until EOF
+    close(fds[0]);
+    base_check(x);
+
+    // page size multiple is read, not mapped
+    data.resize((size_t)sysconf(_SC_PAGESIZE));
+    {
+        std::ofstream out("page.xml");
+        out<<data;
+    }
+    XFileMap page("page.xml");
+    EXPECT_TRUE(!page.mapped());
+    EXPECT_EQ(page.size(), data.length());
+    EXPECT_EQ(string(page.data()), data);
+    remove("page.xml");
+
+    bool thrown = false;
+    try {
+        XFileMap dir(".");  // read() fails with EISDIR
+    } catch (std::exception&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+#endif
+
+struct nest_t {
+    vector<vector<int> > m;
+    vector<string> s;
+    XTOSTRUCT(O(m, s));
+};
+
+TEST(xml, index)
+{
+    // groups come in name order, same name siblings keep document order.
+    // the index is built once per node, walking again reuses it
+    const char* keys[] = {"a", "b", "c"};
+    for (int profile=X2STRUCT_XML_PARSE_DEFAULT; profile<=X2STRUCT_XML_PARSE_FASTEST; ++profile) {
+        XmlReader p("<r><b>2</b><a>1</a><b>3</b><c>x</c><a>4</a></r>", false, profile);
+        for (int round=0; round<3; ++round) {
+            size_t n = 0;
+            for (XmlReader g=p.begin(); g; g=g.next(), ++n) {
+                EXPECT_EQ(string(g.key_char()), keys[n]);
+                EXPECT_EQ(p[keys[n]].size(), (size_t)(n<2?2:1));
+            }
+            EXPECT_EQ(n, (size_t)3);
+        }
+    }
+    XmlReader r("<r><b>2</b><a>1</a><b>3</b><c>x</c><a>4</a></r>");
+    XmlReader a = r.begin();
+    EXPECT_EQ(a.size(), (size_t)2);
+    int v = 0;
+    a[(size_t)0].convert(v);
+    EXPECT_EQ(v, 1);
+    a[1].convert(v);
+    EXPECT_EQ(v, 4);
+    XmlReader b = a.next();
+    b[1].convert(v);
+    EXPECT_EQ(v, 3);
+
+    // has() then operator[] on the same reader share the index
+    XmlReader h("<r><b>2</b><a>1</a><b>3</b></r>");
+    EXPECT_TRUE(h.has("b"));
+    EXPECT_TRUE(!h.has("c"));
+    EXPECT_EQ(h["b"].size(), (size_t)2);
+    h["b"][1].convert(v);
+    EXPECT_EQ(v, 3);
+    EXPECT_TRUE(h.has("a"));
+    h["a"].convert(v);
+    EXPECT_EQ(v, 1);
+    EXPECT_EQ(string(h.begin().key_char()), "a");
+
+    nest_t t;
+    X::loadxml("<r><m><x>1</x><x>2</x></m><s>y</s><m><x>3</x></m><s>z</s></r>", t, false);
+    EXPECT_EQ(X::tojson(t), "{\"m\":[[1,2],[3]],\"s\":[\"y\",\"z\"]}");
+    EXPECT_EQ(X::toxml(t, "r"), "<r><m><x>1</x><x>2</x></m><m><x>3</x></m><s>y</s><s>z</s></r>");
+    X::loadxml("<r><m><x>5</x></m></r>", t, false);
+    EXPECT_EQ(X::tojson(t.m), "[[5]]");
+
+    // element of an array with several child groups is indexed by group
+    XmlReader m("<r><m><y>2</y><x>1</x><y>3</y></m></r>");
+    XmlReader m0 = m["m"][(size_t)0];
+    EXPECT_EQ(m0.size(false), (size_t)0);
+    m0[(size_t)1][(size_t)1].convert(v);
+    EXPECT_EQ(v, 3);
+    m0[(size_t)0].convert(v);
+    EXPECT_EQ(v, 1);
+}
+
+TEST(xml, profile)
+{
+    xstruct x;
+    X::loadxml("test.xml", x, true);
+    string n = X::toxml(x, "xmlroot");
+
+    int profiles[] = {X2STRUCT_XML_PARSE_NO_ENTITY, X2STRUCT_XML_PARSE_NON_DESTRUCTIVE, X2STRUCT_XML_PARSE_FASTEST};
+    for (size_t i=0; i<sizeof(profiles)/sizeof(profiles[0]); ++i) {
+        xstruct y;
+        X::loadxml("test.xml", y, true, profiles[i]);
+        base_check(y);
+        EXPECT_EQ(n, X::toxml(y, "xmlroot"));
+    }
+
+    std::string d("<a v=\"&lt;&#x41;&#66;\">x&amp;y&unknown;</a>");
+    std::vector<char> buf(d.begin(), d.end());
+    buf.push_back('\0');
+    XmlReader r(XmlBuffer(&buf[0], d.length()), X2STRUCT_XML_PARSE_NON_DESTRUCTIVE);
+    std::string v;
+    r.convert(v);
+    EXPECT_EQ(v, "x&y&unknown;");
+    EXPECT_EQ(r.attribute("v"), "<AB");
+    EXPECT_EQ(d, std::string(&buf[0]));
+}
+
+struct record_t {
+    int id;
+    string name;
+    record_t():id(0) {}
+    XTOSTRUCT(O(id, name));
+};
+
+static size_t record_sum = 0;
+static void on_record(const xstruct& x)
+{
+    record_sum += x.id;
+}
+
+TEST(xml, each)
+{
+    std::string d = "<?xml version=\"1.0\"?>\n<!DOCTYPE feed [<!ENTITY e \"x\">]>\n<feed a=\"1>0\">"
+        "<!-- <item> --><head><id>100</id></head>"
+        "<item><id>1</id><note><![CDATA[</item>]]></note><name>x</name></item>"
+        "<item k='>'><id>2</id><name>a&lt;b</name></item>"
+        "<group><item><id>3</id></item></group>"
+        "<item/>"
+        "</feed>";
+    std::istringstream is(d);
+    XmlStreamReader reader(is, "item", 16);
+    std::vector<record_t> v;
+    record_t r;
+    while (reader.next(r)) {
+        v.push_back(r);
+        r = record_t();
+    }
+    EXPECT_EQ(v.size(), (size_t)4);
+    EXPECT_EQ(v[0].name, "x");
+    EXPECT_EQ(v[1].name, "a<b");
+    EXPECT_EQ(v[2].id, 3);
+    EXPECT_EQ(v[3].id, 0);
+
+    std::istringstream is2(d);
+    XmlStreamReader children(is2, "", 7);
+    std::string xml;
+    size_t n = 0;
+    while (children.next(xml)) {
+        ++n;
+    }
+    EXPECT_EQ(n, (size_t)5);
+    EXPECT_EQ(xml, "<item/>");
+
+    xstruct x;
+    X::loadxml("test.xml", x, true);
+    std::string rec = X::toxml(x, "xstruct");
+    {
+        std::ofstream fs("each.xml");
+        fs<<"<feed>";
+        for (int i=0; i<100; ++i) {
+            fs<<rec;
+        }
+        fs<<"</feed>";
+    }
+    EXPECT_EQ(X::loadxml_each<xstruct>("each.xml", "xstruct", on_record), (size_t)100);
+    EXPECT_EQ(record_sum, (size_t)x.id*100);
+    remove("each.xml");
+}
+
+// per byte escaping of the old writers, reference of XEscape
+static std::string escape_ref(const std::string& val, bool xml)
+{
+    std::string out;
+    for (size_t i=0; i<val.length(); ++i) {
+        int c = (int)(val[i]) & 0xFF;
+        char tmp[16];
+        if (xml && c=='<') {
+            out += "&lt;";
+        } else if (xml && c=='>') {
+            out += "&gt;";
+        } else if (xml && c=='&') {
+            out += "&amp;";
+        } else if (xml && c=='\'') {
+            out += "&apos;";
+        } else if (xml && c=='"') {
+            out += "&quot;";
+        } else if (!xml && (c=='"' || c=='\\')) {
+            out += '\\';
+            out += val[i];
+        } else if (!xml && c=='\n') {
+            out += "\\n";
+        } else if (!xml && c=='\r') {
+            out += "\\r";
+        } else if (!xml && c=='\f') {
+            out += "\\f";
+        } else if (!xml && c=='\t') {
+            out += "\\t";
+        } else if (c >= ' ') {
+            out += val[i];
+        } else {
+            sprintf(tmp, "\\x%02X", c);
+            out += tmp;
+        }
+    }
+    return out;
+}
+
+struct escape_t {
+    string s;
+    XTOSTRUCT(O(s));
+};
+
+TEST(xml, escape)
+{
+    std::string d;
+    srand(1);
+    for (int i=0; i<2048; ++i) {
+        int r = rand()%64;
+        d.push_back(r<4 ? "<&\"\\"[r] : (r<8 ? (char)(rand()%256) : (char)('a'+r%26)));
+    }
+    size_t diff = 0;
+    for (int mode=X2STRUCT_ESCAPE_XML; mode<=X2STRUCT_ESCAPE_CONFIG; ++mode) {
+        for (size_t off=0; off<64; ++off) {
+            for (size_t len=0; off+len<=d.length(); len+=(len<80?1:37)) {
+                if (XEscape::clean(d.data()+off, len, mode) != XEscape::clean_scalar(d.data()+off, len, mode)) {
+                    ++diff;
+                }
+            }
+        }
+    }
+    EXPECT_EQ(diff, (size_t)0);
+
+    escape_t e;
+    e.s = "MARK";
+    std::string xml = X::toxml(e, "r");
+    e.s = d;
+    for (int c=0; c<256; ++c) {
+        e.s.push_back((char)c);
+    }
+    EXPECT_EQ(X::toxml(e, "r"), xml.replace(xml.find("MARK"), 4, escape_ref(e.s, true)));
+#ifdef XTOSTRUCT_LIBCONFIG
+    escape_t m;
+    m.s = "MARK";
+    std::string cfg = X::toconfig(m, "");
+    EXPECT_EQ(X::toconfig(e, ""), cfg.replace(cfg.find("MARK"), 4, escape_ref(e.s, false)));
+#endif
+}
+
+TEST(xml, file)
+{
+    xstruct x;
+    X::loadxml("test.xml", x, true);
+    X::toxmlfile(x, "file.xml", "xmlroot", 2);
+    std::ifstream fs("file.xml", std::ifstream::binary);
+    std::string data((std::istreambuf_iterator<char>(fs)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(data, X::toxml(x, "xmlroot", 2));
+
+    XmlWriter writer(2);
+    writer.convert("xmlroot", x);
+    FILE* out = fopen("file.xml", "wb");
+    EXPECT_EQ(writer.write_to(fileno(out)), data.length());
+    fclose(out);
+    std::ifstream fs2("file.xml", std::ifstream::binary);
+    EXPECT_EQ(std::string((std::istreambuf_iterator<char>(fs2)), std::istreambuf_iterator<char>()), writer.toStr());
+
+    std::vector<std::string> chunks(3000, "0123456789");
+    chunks[1] = "";
+    FILE* fp = fopen("file.xml", "wb");
+    EXPECT_EQ(XOStream::writev(fileno(fp), &chunks[0], chunks.size()), (size_t)29990);
+    fclose(fp);
+    remove("file.xml");
+}
+
+TEST(xml, stream)
+{
+    xstruct x;
+    X::loadxml("test.xml", x, true);
+
+    std::ostringstream out;
+    XOStream os(out, 16);
+    X::toxml(x, os, "xmlroot", 4, ' ');
+    EXPECT_EQ(out.str(), X::toxml(x, "xmlroot", 4, ' '));
+
+    xstruct y;
+    X::loadxml(out.str(), y, false);
+    base_check(y);
+}
+
 #ifdef XTOSTRUCT_BSON
 TEST(bson, unmarshal)
 {
@@ -195,11 +914,580 @@ TEST(bson, marshal)
     bson_destroy(bson);
 
     std::string n = X::tobson(x);
+    EXPECT_EQ(X::bsonsize(x), n.length());
+    map<int, vector<sub> > m;
+    m[12].resize(11);
+    EXPECT_EQ(X::bsonsize(m), X::tobson(m).length());
     xstruct y;
     X::loadbson(n, y, false);
     base_check(y);
 }
 
+struct throw_format_t {
+    std::string format() const {
+        throw std::runtime_error("format");
+    }
+    void parse(const std::string&) {
+    }
+};
+
+struct throw_t {
+    int a;
+    std::string b;
+    XType<throw_format_t> c;
+    throw_t():a(1),b("bb") {}
+    XTOSTRUCT(O(a, b, c));
+};
+
+TEST(bson, buffer)
+{
+    xstruct x;
+    X::loadjson("test.json", x, true);
+    std::string one = X::tobson(x);
+
+    BsonBuffer out(16);
+    EXPECT_EQ(X::tobson(x, out), one.length());
+    EXPECT_EQ(X::tobson(x, out), one.length());
+    EXPECT_EQ(out.size(), one.length()*2);
+    EXPECT_TRUE(out.str() == one+one);
+
+    // warm buffer is reused
+    const uint8_t* data = out.data();
+    size_t cap = out.capacity();
+    out.clear();
+    EXPECT_EQ(out.size(), (size_t)0);
+    X::tobson(x, out);
+    EXPECT_TRUE(out.data()==data && out.capacity()==cap);
+    xstruct y;
+    X::loadbson(out.data(), out.size(), y);
+    base_check(y);
+
+    size_t size = out.size();   // half-written document is rolled back
+    bool thrown = false;
+    try {
+        X::tobson(throw_t(), out);
+    } catch (std::exception&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+    EXPECT_EQ(out.size(), size);
+    EXPECT_EQ(X::tobson(x, out), one.length());
+    EXPECT_TRUE(out.str() == one+one);
+
+    BsonWriter busy(out);
+    thrown = false;
+    try {
+        BsonWriter other(out);
+    } catch (std::exception&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
+TEST(bson, stream)
+{
+    {
+        BsonStreamWriter out("stream.bson", false);
+        for (int i=0; i<50; ++i) {
+            record_t r;
+            r.id = i;
+            r.name = Util::tostr(i);
+            out.write(r);
+        }
+        EXPECT_EQ(out.count(), (size_t)50);
+    }
+    {
+        BsonStreamWriter out("stream.bson");  // append
+        record_t r;
+        r.id = 50;
+        out.write(r);
+    }
+
+    BsonStream<record_t> in("stream.bson");
+    record_t r;
+    int sum = 0;
+    while (in.next(r)) {
+        sum += r.id;
+    }
+    EXPECT_EQ(in.count(), (size_t)51);
+    EXPECT_EQ(sum, 50*51/2);
+
+    in.rewind();
+    std::vector<record_t> v;
+    EXPECT_EQ(in.load(v, 4), (size_t)51);
+    EXPECT_EQ(v[49].name, "49");
+    EXPECT_EQ(v[50].id, 50);
+
+    record_sum = 0;
+    EXPECT_EQ(X::loadbson_each<xstruct>("stream.bson", on_record), (size_t)51);
+    EXPECT_EQ(record_sum, (size_t)50*51/2);
+    remove("stream.bson");
+
+    // memory span, truncated tail
+    std::string two = X::tobson(v[1])+X::tobson(v[2]);
+    BsonStream<record_t> mem((const uint8_t*)two.data(), two.length()-1);
+    EXPECT_TRUE(mem.next(r) && r.id==1);
+    bool thrown = false;
+    try {
+        mem.next(r);
+    } catch (std::exception&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
+TEST(bson, parallel)
+{
+    xstruct x;
+    X::loadjson("test.json", x, true);
+    map<string, vector<xstruct> > m;
+    m["v"].resize(37, x);
+
+    BsonWriter writer;
+    writer.parallel(4, 1);
+    writer.convert("", m);
+    EXPECT_EQ(writer.toStr(), X::tobson(m));
+}
+
+struct order_t {
+    int a;
+    string b;
+    vector<int> c;
+    map<string, int> d;
+    int e;
+    int f;
+    int missing;
+    order_t():a(0),e(0),f(0),missing(-1) {}
+    XTOSTRUCT(O(a, b, c, d, e, f, missing));
+};
+
+TEST(bson, lazy)
+{
+    // reverse order and unrelated keys, lookups wrap around until the sorted index is built
+    std::string json = "{\"x1\":1,\"f\":6,\"e\":5,\"x2\":{\"a\":100},\"d\":{\"k2\":2,\"k1\":1},"
+                       "\"c\":[1,2,3],\"b\":\"s\",\"a\":1,\"x3\":[4]}";
+    bson_error_t err;
+    bson_t * bson = bson_new_from_json((const uint8_t *)json.data(), json.length(), &err);
+    order_t o;
+    X::loadbson(bson_get_data(bson), 0, o);
+
+    EXPECT_EQ(o.a, 1);
+    EXPECT_EQ(o.b, "s");
+    EXPECT_EQ(o.c.size(), (size_t)3);
+    EXPECT_EQ(o.c[2], 3);
+    EXPECT_EQ(o.d.size(), (size_t)2);
+    EXPECT_EQ(o.d["k1"], 1);
+    EXPECT_EQ(o.e, 5);
+    EXPECT_EQ(o.f, 6);
+    EXPECT_EQ(o.missing, -1);
+
+    BsonReader r(bson_get_data(bson), 0);
+    EXPECT_TRUE(r.has("x3"));
+    EXPECT_TRUE(r.has("x1"));
+    EXPECT_TRUE(!r.has("x4"));
+    int v = 0;
+    r["c"][1].convert(v);
+    EXPECT_EQ(v, 2);
+    r["x2"]["a"].convert(v);
+    EXPECT_EQ(v, 100);
+    bson_destroy(bson);
+}
+
+struct view_t {
+    XStrView name;
+    int id;
+    vector<XStrView> tags;
+    view_t():id(0) {}
+    XTOSTRUCT(O(name, id, tags));
+};
+
+struct view_str_t {
+    string name;
+    int id;
+    vector<string> tags;
+    view_str_t():id(0) {}
+    XTOSTRUCT(O(name, id, tags));
+};
+
+TEST(bson, view)
+{
+    view_str_t s;
+    s.name = "hello<>";
+    s.id = 3;
+    s.tags.push_back("a");
+    s.tags.push_back("bc");
+    std::string data = X::tobson(s);
+
+    view_t v;
+    X::loadbson(data, v);
+    EXPECT_EQ(v.name.str(), s.name);
+    EXPECT_EQ(v.tags.size(), (size_t)2);
+    EXPECT_TRUE(v.tags[1] == s.tags[1]);
+    EXPECT_TRUE(v.name.data()>data.data() && v.name.data()<data.data()+data.length());
+    EXPECT_EQ(X::tobson(v), data);
+    EXPECT_EQ(X::tojson(v), X::tojson(s));
+    EXPECT_EQ(X::toxml(v, "r"), X::toxml(s, "r"));
+    EXPECT_EQ(X::bsonsize(v), data.length());
+
+    bool copy = false;
+    try {
+        view_t c;
+        X::loadbson(data, c, true);
+    } catch (const std::exception&e) {
+        copy = true;
+    }
+    EXPECT_TRUE(copy);
+
+    bool json = false;
+    try {
+        view_t j;
+        X::loadjson(X::tojson(s), j, false);
+    } catch (const std::exception&e) {
+        json = true;
+    }
+    EXPECT_TRUE(json);
+
+    // same layout with or without the check
+    EXPECT_EQ(sizeof(XStrView), sizeof(const char*)+sizeof(size_t)+sizeof(std::string*));
+#ifdef X2STRUCT_VIEW_CHECK
+    view_t kept = v;
+    data[v.name.data()-data.data()] = 'H';
+    bool changed = false;
+    try {
+        v.name.str();
+    } catch (const std::exception&e) {
+        changed = true;
+    }
+    EXPECT_TRUE(changed);
+    changed = false;
+    try {
+        kept.name.str();
+    } catch (const std::exception&e) {
+        changed = true;
+    }
+    EXPECT_TRUE(changed);
+#endif
+}
+
+struct packed_t {
+    vector<int32_t> a;
+    vector<double> d;
+    vector<uint16_t> s;
+    vector<string> str;   // not arithmetic, written as array
+    vector<float> none;
+    XTOSTRUCT(A(a, "a,pk"), A(d, "bson:d,pk"), A(s, "s,pk"), A(str, "str,pk"), A(none, "none,pk"));
+};
+
+struct unpacked_t {
+    vector<int64_t> a;
+    vector<float> d;
+    vector<int> s;
+    vector<string> str;
+    vector<float> none;
+    XTOSTRUCT(O(a, d, s, str, none));
+};
+
+struct narrow_t {   // packed_t read with smaller element types
+    vector<uint32_t> a;
+    vector<int16_t> d;
+    XTOSTRUCT(O(a, d));
+};
+
+struct packed64_t {
+    vector<uint64_t> a;
+    XTOSTRUCT(A(a, "a,pk"));
+};
+
+TEST(bson, packed)
+{
+    packed_t p;
+    for (int i=0; i<100; ++i) {
+        p.a.push_back(i*1000-7);
+        p.d.push_back(i+0.5);
+        p.s.push_back((uint16_t)(60000+i));
+    }
+    p.str.push_back("x");
+    std::string b = X::tobson(p);
+    EXPECT_EQ(X::bsonsize(p), b.length());
+    EXPECT_TRUE(b.length() < X::tobson(unpacked_t()).length()+100*(4+8+4)+5*3+30);
+
+    bson_t doc;
+    bson_iter_t it;
+    bson_init_static(&doc, (const uint8_t*)b.data(), b.length());
+    EXPECT_TRUE(bson_iter_init_find(&it, &doc, "a") && BSON_ITER_HOLDS_BINARY(&it));
+    EXPECT_TRUE(bson_iter_init_find(&it, &doc, "str") && BSON_ITER_HOLDS_ARRAY(&it));
+
+    packed_t q;
+    X::loadbson(b, q);
+    EXPECT_TRUE(q.a==p.a && q.d==p.d && q.s==p.s && q.str==p.str && q.none.empty());
+
+    // other element types are converted, plain arrays are still read
+    unpacked_t u;
+    X::loadbson(b, u);
+    EXPECT_EQ(u.a[99], (int64_t)98993);
+    EXPECT_EQ(u.d[1], 1.5f);
+    EXPECT_EQ(u.s[2], 60002);
+    u.a[0] = 5;
+    X::loadbson(X::tobson(u), q);
+    EXPECT_EQ(q.a[0], 5);
+    EXPECT_EQ(q.a.size(), (size_t)100);
+
+    // values the element type can't hold are rejected
+    bool thrown = false;
+    packed_t big;
+    big.d.push_back(1e10);
+    big.d.push_back(0.1);   // rounded to float, same as a plain array
+    unpacked_t ok;
+    X::loadbson(X::tobson(big), ok);
+    EXPECT_EQ(ok.d[0], 1e10f);
+    EXPECT_EQ(ok.d[1], 0.1f);
+    big.d.push_back(1e300);
+    thrown = false;
+    try {
+        X::loadbson(X::tobson(big), ok);
+    } catch (std::exception&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+    struct {
+        const char* json;
+        bool thrown;
+    } cases[] = {{"{\"d\":[40000.0]}", false}, {"{\"d\":[1.5]}", false}, {"{\"a\":[-1]}", false}};
+    for (size_t i=0; i<sizeof(cases)/sizeof(cases[0]); ++i) {
+        packed_t from;
+        X::loadjson(cases[i].json, from, false);
+        narrow_t to;
+        try {
+            X::loadbson(X::tobson(from), to);
+        } catch (std::exception&) {
+            cases[i].thrown = true;
+        }
+        EXPECT_TRUE(cases[i].thrown);
+    }
+    packed_t fits;
+    X::loadjson("{\"d\":[32767.0,-32768.0,1000.0]}", fits, false);
+    narrow_t to;
+    X::loadbson(X::tobson(fits), to);
+    EXPECT_EQ(to.d.size(), (size_t)3);
+    EXPECT_EQ(to.d[0], 32767);
+    EXPECT_EQ(to.d[1], -32768);
+    EXPECT_EQ(to.d[2], 1000);
+    packed64_t w;
+    w.a.push_back((uint64_t)1<<40);
+    narrow_t n;
+    thrown = false;
+    try {
+        X::loadbson(X::tobson(w), n);
+    } catch (std::exception&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+    w.a[0] = 7;
+    X::loadbson(X::tobson(w), n);
+    EXPECT_EQ(n.a[0], (uint32_t)7);
+
+    // json is unchanged, delta keeps the packed form
+    EXPECT_EQ(X::tojson(p).find("\"a\":[-7,993"), (size_t)1);
+    packed_t base = p;
+    p.d[3] = -1;
+    packed_t applied = base;
+    BsonReader dr(X::tobson_delta(p, base));
+    dr.delta_mode(true);
+    dr.convert(applied);
+    EXPECT_TRUE(applied.d == p.d);
+}
+
+// BsonNativeWriter output against libbson's
+template <typename T>
+static bool native_same(const T& t, bool omit=false)
+{
+    BsonWriter w;
+    w.omit_default(omit);
+    w.convert("", t);
+    BsonNativeWriter n;
+    n.omit_default(omit);
+    n.convert("", t);
+    return w.toStr() == n.toStr();
+}
+
+TEST(bson, native)
+{
+    xstruct x;
+    X::loadjson("test.json", x, true);
+    EXPECT_TRUE(native_same(x));
+    EXPECT_TRUE(native_same(x, true));
+    omit_t o;
+    EXPECT_TRUE(native_same(o));
+    map<int, vector<sub> > m;
+    m[12].resize(3);
+    m[-1].resize(1);
+    EXPECT_TRUE(native_same(m));
+    packed_t p;
+    p.a.resize(10, -3);
+    p.d.resize(3, 0.1);
+    p.str.resize(2, "s");
+    EXPECT_TRUE(native_same(p));
+    vector<cached_t> vc(2);
+    vc[0].s.mut()->b = "cached";
+    EXPECT_TRUE(native_same(vc));
+    EXPECT_TRUE(native_same(vc));  // spliced from cache
+
+    xstruct cur = x;
+    cur.tint = 7;
+    cur.tmap.erase(109);
+    cur.vint.push_back(1);
+    BsonWriter wd;
+    wd.convert_delta("", cur, x);
+    std::string out("prefix");
+    {
+        BsonNativeWriter nd(out);   // append to a caller's string
+        nd.convert_delta("", cur, x);
+        nd.done();
+    }
+    EXPECT_EQ(out, "prefix"+wd.toStr());
+    bool rolled = false;
+    try {
+        BsonNativeWriter nt(out);
+        nt.convert("", throw_t());
+        nt.done();
+    } catch (std::exception&) {
+        rolled = true;
+    }
+    EXPECT_TRUE(rolled);
+    EXPECT_EQ(out, "prefix"+wd.toStr());  // half-written document is truncated
+
+    // same conversions as BsonReader, other bson types included
+    std::string json = "{\"o\":{\"$oid\":\"5a1b2c3d4e5f60718293a4b5\"},\"r\":{\"$regex\":\"^a\",\"$options\":\"i\"},"
+        "\"d\":{\"$date\":1500000000000},\"n\":null,\"i\":-3,\"l\":{\"$numberLong\":\"-9000000000\"},"
+        "\"f\":2.75,\"s\":\"str\",\"t\":true,\"a\":[1,\"x\",{\"k\":1}],\"b\":{\"$binary\":\"AQI=\",\"$type\":\"00\"},"
+        "\"ts\":{\"$timestamp\":{\"t\":1,\"i\":2}},\"min\":{\"$minKey\":1},\"max\":{\"$maxKey\":1},\"z\":0}";
+    bson_error_t err;
+    bson_t* doc = bson_new_from_json((const uint8_t *)json.data(), json.length(), &err);
+    uint32_t len;
+    memcpy(&len, bson_get_data(doc), sizeof(len));
+    std::string raw((const char*)bson_get_data(doc), len);
+    bson_destroy(doc);
+    map<string, int64_t> li, ni;
+    map<string, double> ld, nd;
+    map<string, string> ls, ns;
+    BsonReader(raw).convert(li);
+    BsonNativeReader(raw).convert(ni);
+    BsonReader(raw).convert(ld);
+    BsonNativeReader(raw).convert(nd);
+    BsonReader(raw).convert(ls);
+    BsonNativeReader(raw).convert(ns);
+    EXPECT_TRUE(li==ni && ld==nd && ls==ns);
+    EXPECT_EQ(ni.size(), (size_t)15);
+    EXPECT_EQ(ni["l"], -9000000000LL);
+
+    xstruct y;
+    X::loadbson(X::tobson(x), y);
+    BsonNativeReader(X::tobson(x)).convert(y);
+    base_check(y);
+    xstruct z = x;
+    BsonNativeReader dr(X::tobson_delta(cur, x));
+    dr.delta_mode(true);
+    dr.convert(z);
+    EXPECT_EQ(X::tojson(z), X::tojson(cur));
+
+    bool thrown = false;
+    try {
+        std::string bad = raw;
+        bad[50] = (char)0x42;  // unknown type inside the document
+        map<string, int64_t> tmp;
+        BsonNativeReader(bad).convert(tmp);
+    } catch (std::exception&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+
+    std::vector<uint8_t> tiny(3, 0);    // shorter than the length prefix
+    thrown = false;
+    try {
+        BsonNativeReader(&tiny[0], tiny.size(), false);
+    } catch (std::exception&) {
+        thrown = true;
+    }
+    EXPECT_TRUE(thrown);
+}
+
+TEST(bson, index_key)
+{
+    size_t diff = 0;
+    BsonIndexKey k;
+    for (size_t i=0; i<123456; ++i, k.next()) {
+        XKey key = k.key();
+        if (std::string(key.name, key.len)!=Util::tostr(i) || key.name[key.len]!='\0') {
+            ++diff;
+        }
+    }
+    EXPECT_EQ(diff, (size_t)0);
+    BsonIndexKey s(999);
+    s.next();
+    EXPECT_EQ(std::string(s.key().name), "1000");
+}
+
+TEST(bson, json)
+{
+    std::string json = "{\"o\":{\"$oid\":\"5a1b2c3d4e5f60718293a4b5\"},\"d\":{\"$date\":1500000000000},"
+        "\"l\":{\"$numberLong\":\"-9000000000\"},\"i\":-3,\"f\":2.75,\"s\":\"s\\\"t\",\"n\":null,\"t\":true,"
+        "\"a\":[1,{\"k\":[]},[\"x\"]],\"e\":{}}";
+    bson_error_t err;
+    bson_t* doc = bson_new_from_json((const uint8_t *)json.data(), json.length(), &err);
+    uint32_t len;
+    memcpy(&len, bson_get_data(doc), sizeof(len));
+    std::string raw((const char*)bson_get_data(doc), len);
+    char *lj = bson_as_json(doc, 0);
+    std::string ljson(lj);
+    bson_free(lj);
+    bson_destroy(doc);
+
+    int ext = X2STRUCT_BSON_JSON_DEFAULT|X2STRUCT_BSON_JSON_LONG;
+    EXPECT_EQ(X::bson2json(raw, ext), json);
+    EXPECT_TRUE(X::json2bson(json, ext) == raw);
+    EXPECT_TRUE(X::json2bson(ljson) == raw);     // libbson legacy json, int64 as number
+    std::string plain("{\"o\":\"5a1b2c3d4e5f60718293a4b5\",\"d\":1500000000000,\"l\":-9000000000,");
+    EXPECT_EQ(X::bson2json(raw, 0).substr(0, plain.length()), plain);
+    EXPECT_EQ(X::bson2json(X::json2bson("{\"o\":{\"$oid\":\"x\"}}", 0), 0), "{\"o\":{\"$oid\":\"x\"}}");
+    std::string canonical = X::json2bson("{\"d\":{\"$date\":{\"$numberLong\":\"1500000000000\"}}}");
+    EXPECT_TRUE(canonical == X::json2bson("{\"d\":{\"$date\":1500000000000}}"));
+    EXPECT_EQ(X::bson2json(canonical), "{\"d\":{\"$date\":1500000000000}}");
+
+    std::ostringstream out;
+    XOStream os(out, 16);
+    X::bson2json((const uint8_t*)raw.data(), raw.length(), os, ext);
+    EXPECT_EQ(out.str(), json);
+
+    xstruct x;
+    X::loadjson("test.json", x, true);
+    xstruct y;
+    X::loadbson(X::json2bson(X::tojson(x)), y);
+    base_check(y);
+    xstruct z;
+    X::loadjson(X::bson2json(X::tobson(x)), z, false);
+    base_check(z);
+
+    std::string many;
+    X::json2bson("{\"a\":1}", many);
+    X::json2bson("{\"a\":2}", many);
+    EXPECT_EQ(many.length(), 24U);
+
+    // malformed wrappers are rejected, not kept as documents
+    const char* bad[] = {"[1]", "{\"o\":{\"$oid\":\"zz\"}}", "{\"o\":{\"$oid\":\"5a1b2c3d4e5f60718293a4b5\",\"x\":1}}", "{\"a\":1} x", "{\"a\":",
+        "{\"a\\u0000b\":1,\"c\":2}", "{\"d\":{\"$date\":{\"$numberLong\":\"1\",\"x\":1}}}", "{\"d\":{\"$date\":{\"x\":\"1\"}}}",
+        "{\"d\":{\"$date\":{\"$numberLong\":\"1\"},\"x\":1}}"};
+    int thrown = 0;
+    for (size_t i=0; i<sizeof(bad)/sizeof(bad[0]); ++i) {
+        std::string o("keep");
+        try {
+            X::json2bson(bad[i], o);
+        } catch (std::exception&) {
+            ++thrown;
+        }
+        EXPECT_EQ(o, "keep");
+    }
+    EXPECT_EQ(thrown, 9);
+}
 
 TEST(bson, builder)
 {
@@ -221,6 +1509,34 @@ TEST(bson, builder)
     #endif
 
     EXPECT_EQ(bb::json(m, false), "{\"$set\":{\"_id\":200,\"date\":1512828045000,\"vs\":[\"s1\",\"s2\"]}}");
+
+    EXPECT_TRUE(sizeof(bb::intf) <= 2*sizeof(int64_t));
+    bb::vp c = m;       // deep copy
+    c[0].second = bb::intf("x");
+    EXPECT_EQ(bb::json(c, false), "{\"$set\":\"x\"}");
+    EXPECT_EQ(bb::json(m, false), "{\"$set\":{\"_id\":200,\"date\":1512828045000,\"vs\":[\"s1\",\"s2\"]}}");
+
+    bb::vp big;
+    big.push_back(bb::pintf("u", std::vector<uint32_t>(1, 3000000000u)));
+    EXPECT_EQ(bb::json(big, false), "{\"u\":[3000000000]}");
+
+    std::vector<uint32_t> vu(11, 7);
+    bb::vp f;
+    f.push_back(bb::pintf("n", vu));
+    f.push_back(bb::pintf("d", 1.5));
+    bson_t doc;
+    bson_init(&doc);
+    bson_append_int32(&doc, "a", 1, 1);
+    bb::append(f, &doc);
+    char *js = bson_as_json(&doc, 0);
+    EXPECT_EQ(std::string(js), "{ \"a\" : 1, \"n\" : [ 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7 ], \"d\" : 1.5 }");
+    bson_free(js);
+    bson_destroy(&doc);
+
+    bson_t out;
+    bb::build(m, &out);
+    EXPECT_EQ(std::string((const char*)bson_get_data(&out), out.len), bb::build(m, 0));
+    bson_destroy(&out);
 }
 
 TEST(bson, writer)
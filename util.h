@@ -19,11 +19,24 @@
 
 #include <string>
 #include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
 #include <iostream>
+#include <stdexcept>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <float.h>
+
+#include "thirdparty/rapidjson/internal/dtoa.h"
+
+// buffer size needed by Util::dtoa/Util::ftoa
+#define X2STRUCT_FLOAT_BUFFER 64
 
 namespace x2struct {
 
@@ -34,6 +47,205 @@ struct cmp_str {
    }
 };
 
+/*
+  pre-encoded fragments of a member name, generated by XTOSTRUCT at compile time.
+  writers copy them directly instead of escape/append the name piece by piece.
+  there is no bson fragment: the element header starts with the type byte of the value, unknown
+  here. BsonWriter has to pass the name to libbson anyway, BsonNativeWriter::element already
+  writes type, name(one memcpy of XKey::len) and '\0' into one resize.
+*/
+struct XKeyEnc {
+    const char* json;           // "name"
+    size_t      json_len;
+    const char* xml_begin;      // <name>
+    size_t      xml_begin_len;
+    const char* xml_end;        // </name>
+    size_t      xml_end_len;
+};
+
+/*
+  key passed to writers, carry the length so writers never need strlen.
+  name is always '\0' terminated. enc is 0 if key is not a XTOSTRUCT member(map key, alias...)
+*/
+class XKey {
+public:
+    XKey(const char* n):name(n),len(strlen(n)),enc(0){}
+    XKey(const std::string& n):name(n.c_str()),len(n.length()),enc(0){}
+    XKey(const char* n, size_t l, const XKeyEnc* e=0):name(n),len(l),enc(e){}
+
+    bool empty() const {
+        return 0 == len;
+    }
+
+    const char*     name;
+    size_t          len;
+    const XKeyEnc*  enc;
+};
+
+/*
+  decimal key of array elements. incremented in place(carry like a counter),
+  so sequential keys cost no division, sprintf or allocation.
+*/
+class BsonIndexKey {
+public:
+    BsonIndexKey(size_t start=0) {
+        _end = _buf+sizeof(_buf)-1;
+        *_end = '\0';
+        _p = _end;
+        do {
+            *--_p = (char)('0'+start%10);
+            start /= 10;
+        } while (start > 0);
+    }
+    XKey key() const {
+        return XKey(_p, (size_t)(_end-_p));
+    }
+    void next() {
+        char* c = _end-1;
+        for (; c>=_p && *c=='9'; --c) {
+            *c = '0';
+        }
+        if (c >= _p) {
+            ++*c;
+        } else {
+            *--_p = '1';
+        }
+    }
+private:
+    char _buf[24];
+    char* _p;
+    char* _end;
+};
+
+#if (!defined NDEBUG && !defined X2STRUCT_NO_VIEW_CHECK)
+#define X2STRUCT_VIEW_CHECK
+#endif
+
+/*
+  non-owning string field. zero-copy BsonReader(X::loadbson) points it into the caller's buffer,
+  so the buffer must outlive the struct and must not be changed or reused meanwhile.
+  other readers throw, writers encode it as a string.
+  debug build(no NDEBUG) keeps a copy and throws runtime_error on access if the buffer changed.
+  the layout is the same in every build, only the copy is not made without X2STRUCT_VIEW_CHECK,
+  so debug and release objects can be linked together.
+*/
+class XStrView {
+public:
+    XStrView():_data(""),_size(0),_shadow(0) {}
+    XStrView(const char* data, size_t size):_data(data),_size(size),_shadow(0) {
+    #ifdef X2STRUCT_VIEW_CHECK
+        _shadow = new std::string(data, size);
+    #endif
+    }
+    XStrView(const XStrView& o):_data(o._data),_size(o._size),_shadow(0) {
+        if (0 != o._shadow) {
+            _shadow = new std::string(*o._shadow);
+        }
+    }
+    XStrView& operator=(const XStrView& o) {
+        XStrView tmp(o);
+        std::swap(_data, tmp._data);
+        std::swap(_size, tmp._size);
+        std::swap(_shadow, tmp._shadow);
+        return *this;
+    }
+    ~XStrView() {
+        delete _shadow;
+    }
+    const char* data() const {
+        check();
+        return _data;
+    }
+    size_t size() const {
+        return _size;
+    }
+    size_t length() const {
+        return _size;
+    }
+    bool empty() const {
+        return 0 == _size;
+    }
+    std::string str() const {
+        check();
+        return std::string(_data, _size);
+    }
+    bool operator==(const XStrView& o) const {
+        return _size==o._size && 0==memcmp(data(), o.data(), _size);
+    }
+    bool operator!=(const XStrView& o) const {
+        return !(*this == o);
+    }
+    bool operator==(const std::string& s) const {
+        return _size==s.length() && 0==memcmp(data(), s.data(), _size);
+    }
+#if __cplusplus >= 201703L
+    operator std::string_view() const {
+        check();
+        return std::string_view(_data, _size);
+    }
+#endif
+private:
+    // view made by a build without the check has no copy
+    void check() const {
+    #ifdef X2STRUCT_VIEW_CHECK
+        if (0!=_shadow && 0!=memcmp(_data, _shadow->data(), _size)) {
+            throw std::runtime_error("XStrView buffer changed or freed");
+        }
+    #endif
+    }
+
+    const char* _data;
+    size_t _size;
+    std::string* _shadow;   // copy of the data, X2STRUCT_VIEW_CHECK only
+};
+
+/*
+  fundamental arithmetic types for Util::equal/is_default. specialized per builtin type, not per
+  int*_t typedef, so char, signed char, long long... are covered whatever the typedefs are
+*/
+template <typename T>
+struct XArithmetic {
+    enum {value = 0};
+};
+#define X2STRUCT_ARITHMETIC(T) template <> struct XArithmetic<T> {enum {value = 1};};
+X2STRUCT_ARITHMETIC(char)
+X2STRUCT_ARITHMETIC(signed char)
+X2STRUCT_ARITHMETIC(unsigned char)
+X2STRUCT_ARITHMETIC(short)
+X2STRUCT_ARITHMETIC(unsigned short)
+X2STRUCT_ARITHMETIC(int)
+X2STRUCT_ARITHMETIC(unsigned int)
+X2STRUCT_ARITHMETIC(long)
+X2STRUCT_ARITHMETIC(unsigned long)
+X2STRUCT_ARITHMETIC(long long)
+X2STRUCT_ARITHMETIC(unsigned long long)
+X2STRUCT_ARITHMETIC(float)
+X2STRUCT_ARITHMETIC(double)
+X2STRUCT_ARITHMETIC(long double)
+X2STRUCT_ARITHMETIC(bool)
+#undef X2STRUCT_ARITHMETIC
+
+// struct and XType compare by __x_equal and are never default
+template <typename T, int ARITHMETIC>
+struct XCompare {
+    static bool equal(const T& a, const T& b) {
+        return a.__x_equal(b);
+    }
+    static bool is_default(const T& data) {
+        (void)data;
+        return false;
+    }
+};
+template <typename T>
+struct XCompare<T, 1> {
+    static bool equal(const T& a, const T& b) {
+        return a == b;
+    }
+    static bool is_default(const T& data) {
+        return (T)0 == data;
+    }
+};
+
 class Util {
 private:
     template <typename T>
@@ -56,16 +268,65 @@ public:
         return buf;
     }
 
+    static std::string tostr(const std::string& data) {
+        return data;
+    }
+
     static std::string tostr(double data) {
-        char buf[64];
-        sprintf(buf, "%lf", data);
-        return buf;
+        char buf[X2STRUCT_FLOAT_BUFFER];
+        int len = dtoa(data, buf);
+        return std::string(buf, len);
     }
 
     static std::string tostr(float data) {
-        char buf[64];
-        sprintf(buf, "%f", data);
-        return buf;
+        char buf[X2STRUCT_FLOAT_BUFFER];
+        int len = ftoa(data, buf);
+        return std::string(buf, len);
+    }
+
+    /*
+      shortest string that parse back to the same double(grisu2), like 0.1 1e30 -0.0
+      precision>=0 means fixed decimals like printf("%.*f"), used when |data|<1e17 and precision<=20.
+      buf must have X2STRUCT_FLOAT_BUFFER bytes, return length, buf is '\0' terminated
+    */
+    static int dtoa(double data, char* buf, int precision=-1) {
+        if (!finite(data)) {
+            return nonfinite(data, buf);
+        } else if (precision>=0 && precision<=20 && data<1e17 && data>-1e17) {
+            return sprintf(buf, "%.*f", precision, data);
+        }
+        char *end = rapidjson::internal::dtoa(data, buf);
+        *end = '\0';
+        return (int)(end-buf);
+    }
+
+    // same as dtoa, but the shortest string is for float, so 0.1f is "0.1" not "0.10000000149011612"
+    static int ftoa(float data, char* buf, int precision=-1) {
+        if (!finite(data)) {
+            return nonfinite(data, buf);
+        } else if (precision>=0 && precision<=20 && data<1e17f && data>-1e17f) {
+            return sprintf(buf, "%.*f", precision, (double)data);
+        }
+
+        uint32_t bits;
+        memcpy(&bits, &data, sizeof(bits));
+        char *p = buf;
+        if (bits & 0x80000000U) {
+            *p++ = '-';
+        }
+        char *end;
+        if (0 == (bits&0x7FFFFFFFU)) {
+            memcpy(p, "0.0", 3);
+            end = p+3;
+        } else {
+            end = grisu2f(bits&0x7FFFFFFFU, p);
+        }
+        *end = '\0';
+        return (int)(end-buf);
+    }
+
+    static bool finite(double data) {
+        return data==data && data<=DBL_MAX && data>=-DBL_MAX;
     }
 
     template <typename T>
@@ -102,7 +363,8 @@ public:
         return slice.size();
     }
 
-    static std::string alias_parse(const std::string&key, const std::string&alias, const std::string&type, bool *me) {
+    // option me: must exist when decode. oe: omit when it is default value on encode. pk: packed(bson)
+    static std::string alias_parse(const std::string&key, const std::string&alias, const std::string&type, bool *me, bool *oe=0, bool *pk=0) {
         std::vector<std::string> type_all(2);
 
         std::vector<std::string> types;
@@ -126,12 +388,13 @@ public:
 
             std::vector<std::string> name_opt;
             split(name_opt, type_all[i], ',');
-            if (0 != me) {
-                for (size_t i=1; i<name_opt.size(); ++i) {
-                    if (name_opt[i]=="me") {
-                        *me = true;
-                        break;
-                    }
+            for (size_t i=1; i<name_opt.size(); ++i) {
+                if (name_opt[i]=="me" && 0!=me) {
+                    *me = true;
+                } else if (name_opt[i]=="oe" && 0!=oe) {
+                    *oe = true;
+                } else if (name_opt[i]=="pk" && 0!=pk) {
+                    *pk = true;
                 }
             }
 
@@ -140,7 +403,156 @@ public:
 
         return key;
     }
+    // default value skipped by omit-default encoding. struct and XType are never default
+    template <typename T>
+    static bool is_default(const T& data) {
+        return XCompare<T, XArithmetic<T>::value>::is_default(data);
+    }
+    static bool is_default(int16_t data) {
+        return 0 == data;
+    }
+    static bool is_default(uint16_t data) {
+        return 0 == data;
+    }
+    static bool is_default(int32_t data) {
+        return 0 == data;
+    }
+    static bool is_default(uint32_t data) {
+        return 0 == data;
+    }
+    static bool is_default(int64_t data) {
+        return 0 == data;
+    }
+    static bool is_default(uint64_t data) {
+        return 0 == data;
+    }
+    static bool is_default(float data) {
+        return 0 == data;
+    }
+    static bool is_default(double data) {
+        return 0 == data;
+    }
+    static bool is_default(bool data) {
+        return !data;
+    }
+    static bool is_default(const XStrView& data) {
+        return data.empty();
+    }
+    static bool is_default(const std::string& data) {
+        return data.empty();
+    }
+    template <typename T>
+    static bool is_default(const std::vector<T>& data) {
+        return data.empty();
+    }
+    template <typename T>
+    static bool is_default(const std::set<T>& data) {
+        return data.empty();
+    }
+    template <typename K, typename T>
+    static bool is_default(const std::map<K, T>& data) {
+        return data.empty();
+    }
+
+    // used by delta encoding. struct compare member by member(__x_equal generated by XTOSTRUCT)
+    template <typename T>
+    static bool equal(const T& a, const T& b) {
+        return XCompare<T, XArithmetic<T>::value>::equal(a, b);
+    }
+    static bool equal(int16_t a, int16_t b) {
+        return a == b;
+    }
+    static bool equal(uint16_t a, uint16_t b) {
+        return a == b;
+    }
+    static bool equal(int32_t a, int32_t b) {
+        return a == b;
+    }
+    static bool equal(uint32_t a, uint32_t b) {
+        return a == b;
+    }
+    static bool equal(int64_t a, int64_t b) {
+        return a == b;
+    }
+    static bool equal(uint64_t a, uint64_t b) {
+        return a == b;
+    }
+    static bool equal(float a, float b) {
+        return a==b || (a!=a && b!=b);  // nan not changed
+    }
+    static bool equal(double a, double b) {
+        return a==b || (a!=a && b!=b);
+    }
+    static bool equal(bool a, bool b) {
+        return a == b;
+    }
+    static bool equal(const XStrView& a, const XStrView& b) {
+        return a == b;
+    }
+    static bool equal(const std::string& a, const std::string& b) {
+        return a == b;
+    }
+    template <typename T>
+    static bool equal(const std::vector<T>& a, const std::vector<T>& b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i=0; i<a.size(); ++i) {
+            if (!equal(a[i], b[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    template <typename T>
+    static bool equal(const std::set<T>& a, const std::set<T>& b) {
+        return a == b;
+    }
+    template <typename K, typename T>
+    static bool equal(const std::map<K, T>& a, const std::map<K, T>& b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        typename std::map<K, T>::const_iterator ia = a.begin();
+        typename std::map<K, T>::const_iterator ib = b.begin();
+        for (; ia!=a.end(); ++ia, ++ib) {
+            if (ia->first!=ib->first || !equal(ia->second, ib->second)) {
+                return false;
+            }
+        }
+        return true;
+    }
 private:
+    static int nonfinite(double data, char* buf) {
+        const char* s = (data!=data)?"nan":((data>0)?"inf":"-inf");
+        strcpy(buf, s);
+        return (int)strlen(s);
+    }
+
+    // rapidjson Grisu2 with the boundaries of float instead of double. bits is a positive float
+    static char* grisu2f(uint32_t bits, char* buf) {
+        using namespace rapidjson::internal;
+        uint32_t be = (bits&0x7F800000U)>>23;
+        uint64_t sig = bits&0x007FFFFFU;
+        DiyFp v = (be!=0)?DiyFp(sig|0x00800000U, (int)be-150):DiyFp(sig, 1-150);
+
+        DiyFp pl = DiyFp((v.f<<1)+1, v.e-1).Normalize();
+        DiyFp mi = (v.f==0x00800000U && be>1)?DiyFp((v.f<<2)-1, v.e-2):DiyFp((v.f<<1)-1, v.e-1);
+        mi.f <<= mi.e-pl.e;
+        mi.e = pl.e;
+
+        int K;
+        int length;
+        const DiyFp c_mk = GetCachedPower(pl.e, &K);
+        const DiyFp W = v.Normalize()*c_mk;
+        DiyFp Wp = pl*c_mk;
+        DiyFp Wm = mi*c_mk;
+        Wm.f++;
+        Wp.f--;
+        DigitGen(W, Wp, Wp.f-Wm.f, buf, &length, &K);
+        return Prettify(buf, length, K, 324);
+    }
+
     template <typename T>
     static T tonum_dummy(const std::string&str, Dummy<T> dmy) {
         T t;
@@ -173,6 +585,16 @@ private:
     
 };
 
+// member with option pk, writers without a packed form write it as usual. see BsonWriter::convert_packed
+template <class WRITER, typename T>
+inline void packed_convert(WRITER& obj, const XKey& key, const T& data) {
+    obj.convert(key, data);
+}
+template <class WRITER, typename T>
+inline void packed_delta(WRITER& obj, const XKey& key, const T& cur, const T& base) {
+    obj.convert_delta(key, cur, base);
+}
+
 }
 
 #endif
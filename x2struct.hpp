@@ -35,11 +35,18 @@
 #ifdef XTOSTRUCT_XML
 #include "xml_reader.h"
 #include "xml_writer.h"
+#include "xml_stream_reader.h"
 #endif
 
 #ifdef XTOSTRUCT_BSON
 #include "bson_reader.h"
 #include "bson_writer.h"
+#include "bson_stream.h"
+#endif
+
+#if (defined XTOSTRUCT_BSON || defined XTOSTRUCT_BSON_NATIVE)
+#include "bson_native.h"
+#include "bson_json.h"
 #endif
 
 #ifdef XTOSTRUCT_LIBCONFIG
@@ -57,6 +64,18 @@
 namespace x2struct {
 
 #define X2STRUCT_OPT_ME     "me"    // must exist
+#define X2STRUCT_OPT_OE     "oe"    // omit when encode if it is default value
+#define X2STRUCT_OPT_PK     "pk"    // arithmetic vector packed into one binary(bson), see BsonPacked
+#define X2STRUCT_SIZE_BUFFER 4096   // count only buffer of jsonsize/xmlsize
+
+// X::tobson/loadbson codec, XTOSTRUCT_BSON_NATIVE doesn't need libbson
+#ifdef XTOSTRUCT_BSON_NATIVE
+typedef BsonNativeReader XBsonReader;
+typedef BsonNativeWriter XBsonWriter;
+#elif defined XTOSTRUCT_BSON
+typedef BsonReader XBsonReader;
+typedef BsonWriter XBsonWriter;
+#endif
 
 class X {
 public:
@@ -73,50 +92,268 @@ public:
     /*
       indentCount 表示缩进的数目，<0表示不换行不缩进，0表示换行但是不缩进
       indentChar  表示缩进用的字符，要么是' '要么是'\t'
+      omitDefault 为true时不输出默认值(0/false/空字符串/空容器)的成员，M()和带me的成员除外
     */
     template <typename TYPE>
-    static std::string tojson(const TYPE&t, const std::string&root="", int indentCount=-1, char indentChar=' ') {
-        JsonWriter writer(indentCount, indentChar);
+    static std::string tojson(const TYPE&t, const std::string&root="", int indentCount=-1, char indentChar=' ', bool omitDefault=false) {
+        if (indentCount < 0) {
+            JsonCompactWriter writer;
+            writer.omit_default(omitDefault);
+            writer.convert(root.c_str(), t);
+            return writer.toStr();
+        } else {
+            JsonPrettyWriter writer(indentCount, indentChar);
+            writer.omit_default(omitDefault);
+            writer.convert(root.c_str(), t);
+            return writer.toStr();
+        }
+    }
+    /* struct to fd/file/ostream, memory used is bounded by the buffer size of os */
+    template <typename TYPE>
+    static void tojson(const TYPE&t, XOStream&os, const std::string&root="", int indentCount=-1, char indentChar=' ', bool omitDefault=false) {
+        if (indentCount < 0) {
+            JsonWriterT<XOStream> writer(indentCount, indentChar, &os);
+            writer.omit_default(omitDefault);
+            writer.convert(root.c_str(), t);
+        } else {
+            JsonWriterT<XOStream, rapidjson::PrettyWriter<XOStream> > writer(indentCount, indentChar, &os);
+            writer.omit_default(omitDefault);
+            writer.convert(root.c_str(), t);
+        }
+        os.Flush();
+    }
+    /* compact json, vector with many elements is encoded in threads, see JsonWriterT::parallel */
+    template <typename TYPE>
+    static std::string tojson_parallel(const TYPE&t, unsigned threads, const std::string&root="") {
+        JsonCompactWriter writer;
+        writer.parallel(threads);
         writer.convert(root.c_str(), t);
         return writer.toStr();
     }
+    /*
+      only members of cur differ from base, nested struct and map recursively,
+      apply it to an object equal to base by loadjson_delta
+    */
+    template <typename TYPE>
+    static std::string tojson_delta(const TYPE&cur, const TYPE&base, const std::string&root="") {
+        JsonCompactWriter writer;
+        writer.convert_delta(root.c_str(), cur, base);
+        return writer.toStr();
+    }
+    template <typename TYPE>
+    static bool loadjson_delta(const std::string&str, TYPE&t, bool isfile=true) {
+        JsonReader reader(str, isfile);
+        reader.delta_mode(true);
+        reader.convert(t);
+        return true;
+    }
+    /* exact length of tojson output, nothing is kept in memory */
+    template <typename TYPE>
+    static size_t jsonsize(const TYPE&t, const std::string&root="", int indentCount=-1, char indentChar=' ', bool omitDefault=false) {
+        XOStream os(XOStream::count_only, X2STRUCT_SIZE_BUFFER);
+        tojson(t, os, root, indentCount, indentChar, omitDefault);
+        return os.size();
+    }
     #endif
 
     #ifdef XTOSTRUCT_XML
     template <typename TYPE>
-    static bool loadxml(const std::string&str, TYPE&t, bool isfile=true) {
-        XmlReader reader(str, isfile);
+    static bool loadxml(const std::string&str, TYPE&t, bool isfile=true, int profile=X2STRUCT_XML_PARSE_DEFAULT) {
+        XmlReader reader(str, isfile, profile);
         reader.convert(t);
         return true;
     }
+    /* call f(t) for every record element named name(every child of root if empty), memory is bounded by the largest record
+       X::loadxml_each<item>("feed.xml", "item", on_item) */
+    template <typename TYPE, typename FUNC>
+    static size_t loadxml_each(const std::string&file, const std::string&name, FUNC f, int profile=X2STRUCT_XML_PARSE_DEFAULT) {
+        XmlStreamReader reader(file, name);
+        for (;;) {
+            TYPE t;
+            if (!reader.next(t, profile)) {
+                break;
+            }
+            f(t);
+        }
+        return reader.count();
+    }
+    /* parse data in place without copy, data[length] must be '\0'. data is modified unless profile is non-destructive */
     template <typename TYPE>
-    static std::string toxml(const TYPE&t, const std::string&root, int indentCount=-1, char indentChar=' ') {
+    static bool loadxml_inplace(char*data, size_t length, TYPE&t, int profile=X2STRUCT_XML_PARSE_DEFAULT) {
+        XmlReader reader(XmlBuffer(data, length), profile);
+        reader.convert(t);
+        return true;
+    }
+    template <typename TYPE>
+    static std::string toxml(const TYPE&t, const std::string&root, int indentCount=-1, char indentChar=' ', bool omitDefault=false) {
         XmlWriter writer(indentCount, indentChar);
+        writer.omit_default(omitDefault);
         writer.convert(root.c_str(), t);
         return writer.toStr();
     }
+    template <typename TYPE>
+    static void toxml(const TYPE&t, XOStream&os, const std::string&root, int indentCount=-1, char indentChar=' ', bool omitDefault=false) {
+        XmlWriter writer(indentCount, indentChar, &os);
+        writer.omit_default(omitDefault);
+        writer.convert(root.c_str(), t);
+        os.Flush();
+    }
+    /* encode straight into file, output is streamed and never held in memory as a whole */
+    template <typename TYPE>
+    static void toxmlfile(const TYPE&t, const std::string&file, const std::string&root, int indentCount=-1, char indentChar=' ', bool omitDefault=false) {
+        FILE* fp = fopen(file.c_str(), "wb");
+        if (0 == fp) {
+            throw std::runtime_error("Open file["+file+"] fail.");
+        }
+        try {
+            XOStream os(fp);
+            XmlWriter writer(indentCount, indentChar, &os);
+            writer.omit_default(omitDefault);
+            writer.convert(root.c_str(), t);
+            os.Flush();
+        } catch (...) {
+            fclose(fp);
+            throw;
+        }
+        if (0 != fclose(fp)) {
+            throw std::runtime_error("Close file["+file+"] fail.");
+        }
+    }
+    /* exact length of toxml output, nothing is kept in memory */
+    template <typename TYPE>
+    static size_t xmlsize(const TYPE&t, const std::string&root, int indentCount=-1, char indentChar=' ', bool omitDefault=false) {
+        XOStream os(XOStream::count_only, X2STRUCT_SIZE_BUFFER);
+        toxml(t, os, root, indentCount, indentChar, omitDefault);
+        return os.size();
+    }
     #endif
 
     // bson
-    #ifdef XTOSTRUCT_BSON
+    #if (defined XTOSTRUCT_BSON || defined XTOSTRUCT_BSON_NATIVE)
+    /* zero-copy by default: the reader is gone when loadbson returns, data is only read meanwhile.
+       XStrView members point into data and need copy=false */
     template <typename TYPE>
-    static bool loadbson(const uint8_t*data, size_t length, TYPE&t, bool copy=true) { // if length==0, get len from data
-        BsonReader reader(data, length, copy);
+    static bool loadbson(const uint8_t*data, size_t length, TYPE&t, bool copy=false) { // if length==0, get len from data
+        XBsonReader reader(data, length, copy);
         reader.convert(t);
         return true;
     }
     template <typename TYPE>
-    static bool loadbson(const std::string&data, TYPE&t, bool copy=true) { // if length==0, get len from data
-        BsonReader reader(data, copy);
+    static bool loadbson(const std::string&data, TYPE&t, bool copy=false) { // if length==0, get len from data
+        XBsonReader reader(data, copy);
+        reader.convert(t);
+        return true;
+    }
+    template <typename TYPE>
+    static std::string tobson(const TYPE& t, bool omitDefault=false) {
+        #ifdef XTOSTRUCT_BSON_NATIVE
+        std::string out;
+        {
+            BsonNativeWriter writer(out);
+            writer.omit_default(omitDefault);
+            writer.convert("", t);
+            writer.done();
+        }
+        return out;
+        #else
+        BsonWriter writer;
+        writer.omit_default(omitDefault);
+        writer.convert("", t);
+        return writer.toStr();
+        #endif
+    }
+    template <typename TYPE>
+    static std::string tobson_delta(const TYPE&cur, const TYPE&base) {
+        #ifdef XTOSTRUCT_BSON_NATIVE
+        std::string out;
+        {
+            BsonNativeWriter writer(out);
+            writer.convert_delta("", cur, base);
+            writer.done();
+        }
+        return out;
+        #else
+        BsonWriter writer;
+        writer.convert_delta("", cur, base);
+        return writer.toStr();
+        #endif
+    }
+    template <typename TYPE>
+    static bool loadbson_delta(const std::string&data, TYPE&t, bool copy=false) {
+        XBsonReader reader(data, copy);
+        reader.delta_mode(true);
         reader.convert(t);
         return true;
     }
+
+    /* bson document <-> json without a struct, ext is X2STRUCT_BSON_JSON_* for ObjectId/date/int64.
+       see BsonJson/JsonToBson to use other rapidjson writers or input streams */
+    static std::string bson2json(const std::string&bson, int ext=X2STRUCT_BSON_JSON_DEFAULT) {
+        rapidjson::StringBuffer buf;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(buf);
+        BsonJson::tojson((const uint8_t*)bson.data(), bson.length(), writer, ext);
+        return std::string(buf.GetString(), buf.GetSize());
+    }
+    static void bson2json(const uint8_t*data, size_t length, XOStream&os, int ext=X2STRUCT_BSON_JSON_DEFAULT) {
+        rapidjson::Writer<XOStream> writer(os);
+        BsonJson::tojson(data, length, writer, ext);
+        os.Flush();
+    }
+    static std::string json2bson(const std::string&json, int ext=X2STRUCT_BSON_JSON_DEFAULT) {
+        std::string out;
+        json2bson(json, out, ext);
+        return out;
+    }
+    // append to out, so one buffer can be reused for many documents
+    static void json2bson(const std::string&json, std::string&out, int ext=X2STRUCT_BSON_JSON_DEFAULT) {
+        rapidjson::StringStream is(json.c_str());
+        BsonJson::tobson(is, out, ext);
+    }
+    #endif
+
+    // libbson only
+    #ifdef XTOSTRUCT_BSON
+    /* call f(t) for every document of a concatenated bson stream file(mongodump style), the file is mapped
+       X::loadbson_each<item>("items.bson", on_item) */
+    template <typename TYPE, typename FUNC>
+    static size_t loadbson_each(const std::string&file, FUNC f) {
+        BsonStream<TYPE> stream(file);
+        for (;;) {
+            TYPE t;
+            if (!stream.next(t)) {
+                break;
+            }
+            f(t);
+        }
+        return stream.count();
+    }
+    /* append t to out, return the length of the document.
+       reuse out(clear between batches) to encode without allocation */
     template <typename TYPE>
-    static std::string tobson(const TYPE& t) {
+    static size_t tobson(const TYPE& t, BsonBuffer& out, bool omitDefault=false) {
+        size_t offset = out.size();
+        {
+            BsonWriter writer(out);
+            writer.omit_default(omitDefault);
+            writer.convert("", t);
+            writer.done();
+        }
+        return out.size()-offset;
+    }
+    template <typename TYPE>
+    static std::string tobson_parallel(const TYPE& t, unsigned threads) {
         BsonWriter writer;
+        writer.parallel(threads);
         writer.convert("", t);
         return writer.toStr();
     }
+    /* exact length of tobson output */
+    template <typename TYPE>
+    static size_t bsonsize(const TYPE& t, bool omitDefault=false) {
+        BsonSizer sizer(true, omitDefault);
+        sizer.convert("", t);
+        return sizer.size();
+    }
     #endif
 
     // libconfig
@@ -133,11 +370,36 @@ public:
         return false;
     }
     template <typename TYPE>
-    static std::string toconfig(const TYPE&t, const std::string&root, int indentCount=-1, char indentChar=' ') {
+    static std::string toconfig(const TYPE&t, const std::string&root, int indentCount=-1, char indentChar=' ', bool omitDefault=false) {
         ConfigWriter writer(indentCount, indentChar);
+        writer.omit_default(omitDefault);
         writer.convert(root.c_str(), t);
         return writer.toStr();
     }
+    /* encode into file, output chunks are written with writev instead of being joined into one string */
+    template <typename TYPE>
+    static void toconfigfile(const TYPE&t, const std::string&file, const std::string&root, int indentCount=-1, char indentChar=' ', bool omitDefault=false) {
+        ConfigWriter writer(indentCount, indentChar);
+        writer.omit_default(omitDefault);
+        writer.convert(root.c_str(), t);
+        FILE* fp = fopen(file.c_str(), "wb");
+        if (0 == fp) {
+            throw std::runtime_error("Open file["+file+"] fail.");
+        }
+        try {
+            #ifndef WINDOWS
+            writer.write_to(fileno(fp));
+            #else
+            writer.write_to(_fileno(fp));
+            #endif
+        } catch (...) {
+            fclose(fp);
+            throw;
+        }
+        if (0 != fclose(fp)) {
+            throw std::runtime_error("Close file["+file+"] fail.");
+        }
+    }
     #endif
 
     /* gen golang code*/
@@ -163,6 +425,10 @@ public:                                                                     \
         (void)obj;(void)name;                                               \
         return true;                                                        \
     }                                                                       \
+    bool __x_condition_kv(const char*&attr, const char*&value) const {      \
+        (void)attr;(void)value;                                             \
+        return false;                                                       \
+    }                                                                       \
     template<typename DOC>                                                  \
     void __x_to_struct(DOC& obj) {
 
@@ -205,16 +471,81 @@ public:                                                                     \
     template <class CLASS>                                                          \
     void __struct_to_str(CLASS& obj, const char *root) const {
 
+// key of member with pre-encoded fragments, see XKeyEnc
+#define X_STRUCT_KEY_ENC(M)                                                         \
+        {"\"" #M "\"", sizeof(#M)+1, "<" #M ">", sizeof(#M)+1, "</" #M ">", sizeof(#M)+2}
+
+#define X_STRUCT_ACT_TOS_M(M)                                                       \
+    {                                                                               \
+        static const x2struct::XKeyEnc __x_key_enc = X_STRUCT_KEY_ENC(M);           \
+        obj.convert(x2struct::XKey(#M, sizeof(#M)-1, &__x_key_enc), M);             \
+    }
+
 #define X_STRUCT_ACT_TOS_O(M)                                                       \
-        obj.convert(#M, M);
+    if (!obj.omit_default() || !x2struct::Util::is_default(M)) {                    \
+        X_STRUCT_ACT_TOS_M(M)                                                       \
+    }
 
+// must exist(me) is never omitted, omit empty(oe) is omitted even if writer not set omit_default
 #define X_STRUCT_ACT_TOS_A(M, A_NAME)                                               \
-        obj.convert(x2struct::Util::alias_parse(#M, A_NAME, obj.type(), 0).c_str(), M);
+    {                                                                               \
+        bool __me = false;                                                          \
+        bool __oe = false;                                                          \
+        bool __pk = false;                                                          \
+        std::string __alias__name__ = x2struct::Util::alias_parse(#M, A_NAME, obj.type(), &__me, &__oe, &__pk); \
+        if (__me || !(__oe||obj.omit_default()) || !x2struct::Util::is_default(M)) { \
+            if (__pk) {                                                             \
+                x2struct::packed_convert(obj, __alias__name__, M);                  \
+            } else {                                                                \
+                obj.convert(__alias__name__.c_str(), M);                            \
+            }                                                                       \
+        }                                                                           \
+    }
 
 #define X_STRUCT_FUNC_TOS_END                                                       \
     }
 
-    
+
+// struct to delta, only member differ from base
+#define X_STRUCT_FUNC_TOD_BEGIN                                                     \
+    template <class CLASS, class SELF>                                              \
+    void __struct_to_delta(CLASS& obj, const SELF& __x_base) const {
+
+#define X_STRUCT_ACT_TOD_O(M)                                                       \
+    if (!x2struct::Util::equal(M, __x_base.M)) {                                    \
+        static const x2struct::XKeyEnc __x_key_enc = X_STRUCT_KEY_ENC(M);           \
+        obj.convert_delta(x2struct::XKey(#M, sizeof(#M)-1, &__x_key_enc), M, __x_base.M); \
+    }
+
+#define X_STRUCT_ACT_TOD_A(M, A_NAME)                                               \
+    if (!x2struct::Util::equal(M, __x_base.M)) {                                    \
+        bool __pk = false;                                                          \
+        std::string __alias__name__ = x2struct::Util::alias_parse(#M, A_NAME, obj.type(), 0, 0, &__pk); \
+        if (__pk) {                                                                 \
+            x2struct::packed_delta(obj, __alias__name__, M, __x_base.M);            \
+        } else {                                                                    \
+            obj.convert_delta(__alias__name__.c_str(), M, __x_base.M);              \
+        }                                                                           \
+    }
+
+#define X_STRUCT_FUNC_TOD_END                                                       \
+    }
+
+// compare member by member, used by delta
+#define X_STRUCT_FUNC_TOE_BEGIN                                                     \
+    template <class SELF>                                                           \
+    bool __x_equal(const SELF& __x_o) const {                                       \
+        return true
+
+#define X_STRUCT_ACT_TOE_O(M)                                                       \
+        && x2struct::Util::equal(M, __x_o.M)
+
+#define X_STRUCT_ACT_TOE_A(M, A_NAME)   X_STRUCT_ACT_TOE_O(M)
+
+#define X_STRUCT_FUNC_TOE_END                                                       \
+        ;                                                                           \
+    }
+
 // struct to golang code
 #define X_STRUCT_FUNC_TOG_BEGIN                                                     \
     std::string __struct_to_go(x2struct::GoCode &obj) const {                       \
@@ -412,9 +743,19 @@ public:                                                                     \
 
 // struct to string
 #define X_STRUCT_L1_TOS_O(...)  X_STRUCT_WRAP_L2(TOS_O, X_DEC_LIST, __VA_ARGS__)
-#define X_STRUCT_L1_TOS_M       X_STRUCT_L1_TOS_O
+#define X_STRUCT_L1_TOS_M(...)  X_STRUCT_WRAP_L2(TOS_M, X_DEC_LIST, __VA_ARGS__)
 #define X_STRUCT_L1_TOS_A(M,A)  X_STRUCT_ACT_TOS_A(M,A)
 
+// struct to delta
+#define X_STRUCT_L1_TOD_O(...)  X_STRUCT_WRAP_L2(TOD_O, X_DEC_LIST, __VA_ARGS__)
+#define X_STRUCT_L1_TOD_M       X_STRUCT_L1_TOD_O
+#define X_STRUCT_L1_TOD_A(M,A)  X_STRUCT_ACT_TOD_A(M,A)
+
+// struct equal
+#define X_STRUCT_L1_TOE_O(...)  X_STRUCT_WRAP_L2(TOE_O, X_DEC_LIST, __VA_ARGS__)
+#define X_STRUCT_L1_TOE_M       X_STRUCT_L1_TOE_O
+#define X_STRUCT_L1_TOE_A(M,A)  X_STRUCT_ACT_TOE_A(M,A)
+
 // struct to golang code
 #define X_STRUCT_L1_TOG_O(...)  X_STRUCT_WRAP_L2(TOG_O, X_DEC_LIST, __VA_ARGS__)
 #define X_STRUCT_L1_TOG_M       X_STRUCT_L1_TOG_O
@@ -425,11 +766,15 @@ public:                                                                     \
 #define XTOSTRUCT(...)  \
     X_STRUCT_FUNC_TOX_BEGIN  X_STRUCT_WRAP_L1(TOX_, X_DEC_LIST, __VA_ARGS__) X_STRUCT_FUNC_TOX_END  \
     X_STRUCT_FUNC_TOS_BEGIN  X_STRUCT_WRAP_L1(TOS_, X_DEC_LIST, __VA_ARGS__) X_STRUCT_FUNC_TOS_END  \
+    X_STRUCT_FUNC_TOD_BEGIN  X_STRUCT_WRAP_L1(TOD_, X_DEC_LIST, __VA_ARGS__) X_STRUCT_FUNC_TOD_END  \
+    X_STRUCT_FUNC_TOE_BEGIN  X_STRUCT_WRAP_L1(TOE_, X_DEC_LIST, __VA_ARGS__) X_STRUCT_FUNC_TOE_END  \
     X_STRUCT_FUNC_TOG_BEGIN  X_STRUCT_WRAP_L1(TOG_, X_DEC_LIST, __VA_ARGS__) X_STRUCT_FUNC_TOG_END
 #else
 #define XTOSTRUCT(...)  \
     X_STRUCT_FUNC_TOX_BEGIN  X_STRUCT_WRAP_L1(TOX_, X_DEC_LIST, __VA_ARGS__) X_STRUCT_FUNC_TOX_END  \
-    X_STRUCT_FUNC_TOS_BEGIN  X_STRUCT_WRAP_L1(TOS_, X_DEC_LIST, __VA_ARGS__) X_STRUCT_FUNC_TOS_END
+    X_STRUCT_FUNC_TOS_BEGIN  X_STRUCT_WRAP_L1(TOS_, X_DEC_LIST, __VA_ARGS__) X_STRUCT_FUNC_TOS_END  \
+    X_STRUCT_FUNC_TOD_BEGIN  X_STRUCT_WRAP_L1(TOD_, X_DEC_LIST, __VA_ARGS__) X_STRUCT_FUNC_TOD_END  \
+    X_STRUCT_FUNC_TOE_BEGIN  X_STRUCT_WRAP_L1(TOE_, X_DEC_LIST, __VA_ARGS__) X_STRUCT_FUNC_TOE_END
 #endif
 
 
@@ -439,6 +784,19 @@ public:                                                                     \
     bool __x_condition(DOC& obj, const char* name) {            \
         return obj.attribute(attr1)==obj.attribute(attr2);      \
     }
+// match the element whose attribute attr equals value, readers look it up without decoding every element.
+// value is a const char* that outlives the decode, such as a literal or c_str() of a global string
+#define XTOSTRUCT_CONDITION_KV(attr, value)                     \
+    bool __x_condition_kv(const char*&__a, const char*&__v) {   \
+        __a = attr;                                             \
+        __v = value;                                            \
+        return true;                                            \
+    }                                                           \
+    template<typename DOC>                                      \
+    bool __x_condition(DOC& obj, const char* name) {            \
+        (void)name;                                             \
+        return obj.attribute(attr)==(value);                    \
+    }
 
 }
 
@@ -0,0 +1,149 @@
+﻿/*
+* Copyright (C) 2017 YY Inc. All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License"); 
+* you may not use this file except in compliance with the License. 
+* You may obtain a copy of the License at
+*
+*	http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, 
+* software distributed under the License is distributed on an "AS IS" BASIS, 
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. 
+* See the License for the specific language governing permissions and 
+* limitations under the License.
+*/
+
+#ifndef __X_ESCAPE_H
+#define __X_ESCAPE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#if defined __AVX2__
+#include <immintrin.h>
+#define X2STRUCT_AVX2
+#define X2STRUCT_SSE2
+#elif (defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define X2STRUCT_SSE2
+#endif
+
+#define X2STRUCT_ESCAPE_XML     0   // < > & ' " and control characters
+#define X2STRUCT_ESCAPE_CONFIG  1   // " \ and control characters
+
+namespace x2struct {
+
+/*
+  string escaping shared by XmlWriter/ConfigWriter.
+  clean() returns the length of the leading run that can be copied as is, it checks 32/16 bytes
+  at a time with AVX2/SSE2 and falls back to clean_scalar(), so writers append clean runs in bulk
+  and only call escape() for the byte that stops the run.
+*/
+class XEscape {
+public:
+    static bool need(unsigned char c, int mode) {
+        if (c < ' ') {
+            return true;
+        } else if (X2STRUCT_ESCAPE_XML == mode) {
+            return c=='<' || c=='>' || c=='&' || c=='\'' || c=='"';
+        } else {
+            return c=='"' || c=='\\';
+        }
+    }
+    static size_t clean_scalar(const char* str, size_t len, int mode) {
+        size_t i = 0;
+        for (; i<len && !need((unsigned char)str[i], mode); ++i);
+        return i;
+    }
+    static size_t clean(const char* str, size_t len, int mode) {
+        size_t i = 0;
+    #ifdef X2STRUCT_AVX2
+        const __m256i ctrl = _mm256_set1_epi8(0x1F);
+        const __m256i q = _mm256_set1_epi8('"');
+        const __m256i a = _mm256_set1_epi8(X2STRUCT_ESCAPE_XML==mode?'<':'\\');
+        const __m256i b = _mm256_set1_epi8(X2STRUCT_ESCAPE_XML==mode?'>':'\\');
+        const __m256i c = _mm256_set1_epi8(X2STRUCT_ESCAPE_XML==mode?'&':'\\');
+        const __m256i d = _mm256_set1_epi8(X2STRUCT_ESCAPE_XML==mode?'\'':'\\');
+        for (; i+32<=len; i+=32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(str+i));
+            __m256i m = _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl); // v <= 0x1F
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, q));
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, a));
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, b));
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, c));
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, d));
+            unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+            if (0 != mask) {
+                return i+first(mask);
+            }
+        }
+    #endif
+    #ifdef X2STRUCT_SSE2
+        const __m128i ctrl1 = _mm_set1_epi8(0x1F);
+        const __m128i q1 = _mm_set1_epi8('"');
+        const __m128i a1 = _mm_set1_epi8(X2STRUCT_ESCAPE_XML==mode?'<':'\\');
+        const __m128i b1 = _mm_set1_epi8(X2STRUCT_ESCAPE_XML==mode?'>':'\\');
+        const __m128i c1 = _mm_set1_epi8(X2STRUCT_ESCAPE_XML==mode?'&':'\\');
+        const __m128i d1 = _mm_set1_epi8(X2STRUCT_ESCAPE_XML==mode?'\'':'\\');
+        for (; i+16<=len; i+=16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(str+i));
+            __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl1), ctrl1);
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, q1));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, a1));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, b1));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c1));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, d1));
+            unsigned mask = (unsigned)_mm_movemask_epi8(m);
+            if (0 != mask) {
+                return i+first(mask);
+            }
+        }
+    #endif
+        return i+clean_scalar(str+i, len-i, mode);
+    }
+    // escape sequence of c into buf(at least 8 bytes), returns the length
+    static int escape(unsigned char c, int mode, char* buf) {
+        const char* s = 0;
+        if (X2STRUCT_ESCAPE_XML == mode) {
+            switch (c) {
+              case '<': s = "&lt;"; break;
+              case '>': s = "&gt;"; break;
+              case '&': s = "&amp;"; break;
+              case '\'': s = "&apos;"; break;
+              case '"': s = "&quot;"; break;
+            }
+        } else {
+            switch (c) {
+              case '"': s = "\\\""; break;
+              case '\\': s = "\\\\"; break;
+              case '\n': s = "\\n"; break;
+              case '\r': s = "\\r"; break;
+              case '\f': s = "\\f"; break;
+              case '\t': s = "\\t"; break;
+            }
+        }
+        if (0 == s) {
+            return sprintf(buf, "\\x%02X", (int)c);
+        }
+        int l = 0;
+        for (; s[l]; ++l) {
+            buf[l] = s[l];
+        }
+        return l;
+    }
+private:
+    static size_t first(unsigned mask) {
+    #if defined __GNUC__
+        return (size_t)__builtin_ctz(mask);
+    #else
+        size_t n = 0;
+        for (; 0==(mask&1); mask>>=1, ++n);
+        return n;
+    #endif
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,169 @@
+﻿/*
+* Copyright (C) 2017 YY Inc. All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License"); 
+* you may not use this file except in compliance with the License. 
+* You may obtain a copy of the License at
+*
+*	http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, 
+* software distributed under the License is distributed on an "AS IS" BASIS, 
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. 
+* See the License for the specific language governing permissions and 
+* limitations under the License.
+*/
+
+#ifndef __X_FILEMAP_H
+#define __X_FILEMAP_H
+
+#include <string>
+#include <fstream>
+#include <stdexcept>
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace x2struct {
+
+/*
+  map a file as a private copy-on-write buffer that can be parsed in place.
+  data()[size()] is always '\0': the tail of the last page is zero filled by mmap,
+  if file size is a multiple of page size(or on windows) the file is read into memory instead.
+  pipes, /proc and other files without a size are read until EOF.
+  writes to data() never reach the file.
+*/
+class XFileMap {
+public:
+    XFileMap(const std::string& path):_data(0),_size(0),_mapped(false) {
+    #ifndef WINDOWS
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Open file["+path+"] fail.");
+        }
+        struct stat st;
+        if (0 != fstat(fd, &st)) {
+            ::close(fd);
+            throw std::runtime_error("Stat file["+path+"] fail.");
+        }
+        try {
+            if (!S_ISREG(st.st_mode)) {
+                read_all(fd);
+            } else {
+                _size = (size_t)st.st_size;
+                long page = sysconf(_SC_PAGESIZE);
+                if (_size > 0 && page > 0 && 0 != _size%(size_t)page) {
+                    void *addr = mmap(0, _size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+                    if (MAP_FAILED != addr) {
+                        _data = (char*)addr;
+                        _mapped = true;
+                    }
+                }
+                if (!_mapped) {
+                    read_size(fd);
+                }
+            }
+        } catch (...) {
+            delete []_data;
+            _data = 0;
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+    #else
+        std::ifstream fs(path.c_str(), std::ifstream::binary);
+        if (!fs) {
+            throw std::runtime_error("Open file["+path+"] fail.");
+        }
+        fs.seekg(0, std::ios::end);
+        _size = (size_t)fs.tellg();
+        fs.seekg(0, std::ios::beg);
+        _data = new char[_size+1];
+        fs.read(_data, _size);
+        _size = (size_t)fs.gcount();
+        _data[_size] = '\0';
+    #endif
+    }
+    ~XFileMap() {
+    #ifndef WINDOWS
+        if (_mapped) {
+            munmap(_data, _size);
+            return;
+        }
+    #endif
+        delete []_data;
+    }
+    char* data() {
+        return _data;
+    }
+    size_t size() const {
+        return _size;
+    }
+    bool mapped() const {
+        return _mapped;
+    }
+private:
+    XFileMap(const XFileMap&);
+    XFileMap& operator=(const XFileMap&);
+
+#ifndef WINDOWS
+    // read _size bytes, a file that shrank since fstat is cut at EOF.
+    // on throw the caller frees _data
+    void read_size(int fd) {
+        _data = new char[_size+1];
+        size_t got = 0;
+        while (got < _size) {
+            ssize_t ret = ::read(fd, _data+got, _size-got);
+            if (ret > 0) {
+                got += (size_t)ret;
+            } else if (ret == 0) {
+                break;
+            } else if (errno != EINTR) {
+                throw std::runtime_error("Read file fail.");
+            }
+        }
+        _size = got;
+        _data[_size] = '\0';
+    }
+    // size unknown, grow the buffer until EOF. on throw the caller frees _data
+    void read_all(int fd) {
+        size_t cap = 4096;
+        _data = new char[cap+1];
+        _size = 0;
+        for (;;) {
+            if (_size == cap) {
+                char* bigger = new char[cap*2+1];
+                memcpy(bigger, _data, _size);
+                delete []_data;
+                _data = bigger;
+                cap *= 2;
+            }
+            ssize_t ret = ::read(fd, _data+_size, cap-_size);
+            if (ret > 0) {
+                _size += (size_t)ret;
+            } else if (ret == 0) {
+                break;
+            } else if (errno != EINTR) {
+                throw std::runtime_error("Read file fail.");
+            }
+        }
+        _data[_size] = '\0';
+    }
+#endif
+
+    char* _data;
+    size_t _size;
+    bool _mapped;
+};
+
+}
+
+#endif
@@ -18,7 +18,9 @@
 #define __X_XML_READER_H
 
 #include <map>
+#include <deque>
 #include <vector>
+#include <algorithm>
 #include <stdexcept>
 #include <fstream>
 #include <iostream>
@@ -28,77 +30,82 @@
 #include "thirdparty/rapidxml/rapidxml.hpp"
 
 #include "xreader.h"
+#include "xfilemap.h"
 
 
+/*
+  rapidxml parse flags used by XmlReader
+  NO_ENTITY: parse_no_entity_translation, entities are decoded when a value is read
+  NON_DESTRUCTIVE: parse_non_destructive, input buffer is not modified
+  FASTEST: parse_fastest, non destructive and no data nodes, for trusted machine-generated xml
+*/
+#define X2STRUCT_XML_PARSE_DEFAULT          0
+#define X2STRUCT_XML_PARSE_NO_ENTITY        1
+#define X2STRUCT_XML_PARSE_NON_DESTRUCTIVE  2
+#define X2STRUCT_XML_PARSE_FASTEST          3
+
 namespace x2struct {
 
 
+// mutable buffer parsed in place, data must outlive the reader and data[length] must be '\0'.
+// data is modified by parser unless a non-destructive profile is used
+struct XmlBuffer {
+    char* data;
+    size_t length;
+    XmlBuffer(char* d, size_t l):data(d),length(l) {}
+};
+
 // xml没有数组，适配起来有点恶心
 class XmlReader:public XReader<XmlReader> {
     typedef rapidxml::xml_document<> XML_READER_DOCUMENT;
     typedef rapidxml::xml_node<> XML_READER_NODE;  
 public:
     using xdoc_type::convert;
-    XmlReader(const std::string& str, bool isfile=false):xdoc_type(0, ""),_doc(new XML_READER_DOCUMENT),_val(0),_siblings(0) {
-        std::string err;
-        _xml_data = 0;
-
-        do {
-            try {
-                if (isfile) {
-                    std::ifstream fs(str.c_str(), std::ifstream::binary);
-                    if (!fs) {
-                        err = "Open file["+str+"] fail.";
-                        break;
-                    }
-                    std::string data((std::istreambuf_iterator<char>(fs)), std::istreambuf_iterator<char>());
-                    _xml_data = new char[data.length()+1];
-                    memcpy(_xml_data, data.data(), data.length());
-                    _xml_data[data.length()] = '\0';
-                } else  {
-                    _xml_data = new char[str.length()+1];
-                    memcpy(_xml_data, str.data(), str.length());
-                    _xml_data[str.length()] = '\0';
-                }
-                _doc->parse<0>(_xml_data);
-            } catch (const rapidxml::parse_error&e) {
-                err = std::string("parse error[")+e.what()+"] "+std::string(e.where<char>()).substr(0, 32);
-            } catch (const std::exception&e) {
-                err = std::string("unknow exception[")+e.what()+"]";
+    // file is mapped copy-on-write and parsed in place, string is copied once.
+    // profile is one of X2STRUCT_XML_PARSE_*
+    XmlReader(const std::string& str, bool isfile=false, int profile=X2STRUCT_XML_PARSE_DEFAULT):xdoc_type(0, ""),_doc(0) {
+        init(0, 0, 0, 0);
+        try {
+            if (isfile) {
+                _map = new XFileMap(str);
+                load(_map->data(), profile);
+            } else  {
+                _xml_data = new char[str.length()+1];
+                memcpy(_xml_data, str.data(), str.length());
+                _xml_data[str.length()] = '\0';
+                load(_xml_data, profile);
             }
-
-            if (!err.empty()) {
-                break;
-            }
-            _val = _doc->first_node();
-            init();
-            return;
-        } while (false);
-
-        delete _doc;
-        _doc = 0;
-        if (0 != _xml_data) {
-            delete []_xml_data;
-            _xml_data = 0;
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+    // parse caller-owned buffer in place, no copy. see XmlBuffer
+    explicit XmlReader(const XmlBuffer& buf, int profile=X2STRUCT_XML_PARSE_DEFAULT):xdoc_type(0, ""),_doc(0) {
+        char* data = buf.data;
+        init(0, 0, 0, 0);
+        if (0==data || '\0'!=data[buf.length]) {
+            throw std::runtime_error("xml buffer must be '\\0' terminated");
+        }
+        try {
+            load(data, profile);
+        } catch (...) {
+            release();
+            throw;
         }
-        throw std::runtime_error(err);
     }
     ~XmlReader() {
         if (0 != _doc) {
-            delete _doc;
-            delete []_xml_data;
-            _doc = 0;
+            release();
         }
     }
 public: // convert
     void convert(std::string &val) {
-        if (_val && _val->value()) {
-            val = _val->value();
-        }
+        value(val);
     }
     void convert(bool &val) {
-        if (_val && _val->value()) {
-            std::string tmp=_val->value();
+        std::string tmp;
+        if (value(tmp)) {
             if (tmp=="1" || tmp=="true" || tmp=="TRUE" || tmp=="True") {
                 val = true;
             } else {
@@ -109,43 +116,51 @@ public: // convert
         }
     }
     void convert(int16_t &val) {
-        if (_val && _val->value()) {
-            val = Util::tonum<int16_t>(_val->value());
+        std::string tmp;
+        if (value(tmp)) {
+            val = Util::tonum<int16_t>(tmp);
         }
     }
     void convert(uint16_t &val) {
-        if (_val && _val->value()) {
-            val = Util::tonum<uint16_t>(_val->value());
+        std::string tmp;
+        if (value(tmp)) {
+            val = Util::tonum<uint16_t>(tmp);
         }
     }
     void convert(int32_t &val) {
-        if (_val && _val->value()) {
-            val = Util::tonum<int32_t>(_val->value());
+        std::string tmp;
+        if (value(tmp)) {
+            val = Util::tonum<int32_t>(tmp);
         }
     }
     void convert(uint32_t &val) {
-        if (_val && _val->value()) {
-            val = Util::tonum<uint32_t>(_val->value());
+        std::string tmp;
+        if (value(tmp)) {
+            val = Util::tonum<uint32_t>(tmp);
         }
     }
     void convert(int64_t &val) {
-        if (_val && _val->value()) {
-            val = Util::tonum<int64_t>(_val->value());
+        std::string tmp;
+        if (value(tmp)) {
+            val = Util::tonum<int64_t>(tmp);
         }
     }
     void convert(uint64_t &val) {
-        if (_val && _val->value()) {
-            val = Util::tonum<uint64_t>(_val->value());
+        std::string tmp;
+        if (value(tmp)) {
+            val = Util::tonum<uint64_t>(tmp);
         }
     }
     void convert(double &val) {
-        if (_val && _val->value()) {
-            val = Util::tonum<double>(_val->value());
+        std::string tmp;
+        if (value(tmp)) {
+            val = Util::tonum<double>(tmp);
         }
     }
     void convert(float &val) {
-        if (_val && _val->value()) {
-            val = Util::tonum<float>(_val->value());
+        std::string tmp;
+        if (value(tmp)) {
+            val = Util::tonum<float>(tmp);
         }
     }
 
@@ -154,40 +169,47 @@ public: // convert
         return t;
     }
     bool has(const char*key) {
-        return _child_index.find(key)!=_child_index.end();
+        size_t begin, end;
+        return find(key, begin, end);
+    }
+    bool null() const { // xml has no null
+        return false;
     }
     size_t size(bool to_vec=true) {
-        if (0 != _siblings) {
-            return _siblings->size();
-        } else if (_index>=0 && to_vec && _childs.size()==1) {   // 嵌套数组
-            _siblings = &_childs[0];
-            return _siblings->size();
+        if (_sib_end > _sib_begin) {
+            return _sib_end-_sib_begin;
+        } else if (_index>=0 && to_vec && 1==group_count()) {   // 嵌套数组
+            _sib_begin = _idx_begin;
+            _sib_end = _idx_end;
+            return _sib_end-_sib_begin;
         } else {
             return 0;
         }
     }
     XmlReader operator[](const char *key) {
-        if (has(key)) {
-            return XmlReader(&_childs[_child_index[key]], this, key);
+        size_t begin, end;
+        if (find(key, begin, end)) {
+            return XmlReader(begin, end, this, key);
         } else {
             throw std::runtime_error(std::string("Did not have ")+key);
         }
         return XmlReader(0, 0, "");
     }
     XmlReader operator[](size_t index) {
-        if (0 != _siblings) {
-            return XmlReader((*_siblings)[index], this, index);
-        } else if (_index>=0 && index<_childs.size()) { //
-            return XmlReader(&_childs[index], this, index);
+        if (_sib_end > _sib_begin) {
+            return XmlReader(_pool->entries[_sib_begin+index].node, this, index);
+        } else if (_index>=0 && index<group_count()) { //
+            return XmlReader(group_begin(index), group_begin(index+1), this, index);
         } else {
             throw std::runtime_error("Out of index");
         }
         return XmlReader(0, 0, "");
     }
     XmlReader begin() {
-        _iter = _child_index.begin();
-        if (_iter != _child_index.end()) {
-            return XmlReader(&_childs[_iter->second], this, _iter->first);
+        build_index();
+        _iter = 0;
+        if (_iter < _grp_count) {
+            return XmlReader(group_begin(0), group_begin(1), this, name(group_begin(0)));
         } else {
             return XmlReader(0, this, "");
         }
@@ -196,71 +218,345 @@ public: // convert
         if (0 == _parent) {
             throw std::runtime_error("parent null");
         } else {
-            ++(_parent->_iter);
+            ++_parent->_iter;
         }
-        if (_parent->_iter != _parent->_child_index.end()) {
-            return XmlReader(&_parent->_childs[_parent->_iter->second], _parent, _parent->_iter->first);
+        size_t g = _parent->_iter;
+        if (g < _parent->_grp_count) {
+            size_t begin = _parent->group_begin(g);
+            return XmlReader(begin, _parent->group_begin(g+1), _parent, name(begin));
         } else {
             return XmlReader(0, _parent, "");
         }
     }
     operator bool() const {
-        return 0!=_val || 0!=_siblings;
+        return 0!=_val;
+    }
+
+    // compare attribute in place over the same name siblings, nothing is decoded or allocated
+    bool condition_find(const char* attr, const char* value, size_t& index) {
+        size_t vlen = strlen(value);
+        for (size_t i=_sib_begin; i<_sib_end; ++i) {
+            rapidxml::xml_attribute<char> *a = _pool->entries[i].node->first_attribute(attr);
+            if (0 == a) {
+                continue;
+            }
+            bool match = (a->value_size()==vlen && 0==memcmp(a->value(), value, vlen));
+            if (!match && X2STRUCT_XML_PARSE_DEFAULT!=_pool->profile && 0!=memchr(a->value(), '&', a->value_size())) {
+                std::string v;
+                text(a->value(), a->value_size(), v);
+                match = (v == value);
+            }
+            if (match) {
+                index = i-_sib_begin;
+                return true;
+            }
+        }
+        return false;
     }
 
     std::string attribute(const char* key) { // overwite
         if (0 != _val) {
             rapidxml::xml_attribute<char> *attr = _val->first_attribute(key);
             if (0!=attr && attr->value()) {
-                return attr->value();
+                std::string v;
+                text(attr->value(), attr->value_size(), v);
+                return v;
             }
         }
         return "";
     }
 
 private:
-    typedef std::vector<XML_READER_NODE*> sibling_type;
-    typedef std::vector<sibling_type> child_type;
-    typedef std::map<const char*, size_t, cmp_str> child_index_type;
-    
+    /*
+      child index of all nodes visited, owned by the root reader.
+      children of a node are appended once as a range and stable sorted by name,
+      so nodes with the same name(array) are adjacent and keep document order.
+      pool->nodes finds the range of a node already indexed, pool->groups keeps the
+      start of each name group followed by the end of the range.
+      readers only keep offsets, nothing is allocated when a reader is constructed.
+    */
+    struct IndexEntry {
+        const char* name;
+        size_t name_len;
+        XML_READER_NODE* node;
+    };
+    struct IndexLess {
+        bool operator()(const IndexEntry& a, const IndexEntry& b) const {
+            return compare(a.name, a.name_len, b.name, b.name_len) < 0;
+        }
+    };
+    struct NodeIndex {
+        size_t begin;           // entries[begin, end)
+        size_t end;
+        size_t group;           // groups[group, group+count], last one is end
+        size_t count;
+    };
+    struct IndexPool {
+        std::vector<IndexEntry> entries;
+        std::vector<size_t> groups;
+        std::map<const XML_READER_NODE*, NodeIndex> nodes;
+        std::deque<std::string> names; // terminated copy of names, non-destructive profiles only
+        int profile;
+    };
+
+    // siblings with the same name, pool->entries[begin, end)
+    XmlReader(size_t begin, size_t end, const XmlReader*parent, const char*key):xdoc_type(parent, key),_doc(0) {
+        init(parent, 0, begin, end);
+    }
+    XmlReader(size_t begin, size_t end, const XmlReader*parent, size_t index):xdoc_type(parent, index),_doc(0) {
+        init(parent, 0, begin, end);
+    }
+    XmlReader(const XML_READER_NODE* val, const XmlReader*parent, size_t index):xdoc_type(parent, index),_doc(0) {
+        init(parent, val, 0, 0);
+    }
+    // end reader of begin()/next()
+    XmlReader(const XML_READER_NODE* val, const XmlReader*parent, const char*key):xdoc_type(parent, key),_doc(0) {
+        init(parent, val, 0, 0);
+    }
+    void load(char* data, int profile) {
+        std::string err;
+        _doc = new XML_READER_DOCUMENT;
+        _pool = new IndexPool;
+        _pool->profile = profile;
+        try {
+            switch (profile) {
+              case X2STRUCT_XML_PARSE_DEFAULT:
+                _doc->parse<rapidxml::parse_default>(data);
+                break;
+              case X2STRUCT_XML_PARSE_NO_ENTITY:
+                _doc->parse<rapidxml::parse_no_entity_translation>(data);
+                break;
+              case X2STRUCT_XML_PARSE_NON_DESTRUCTIVE:
+                _doc->parse<rapidxml::parse_non_destructive>(data);
+                break;
+              case X2STRUCT_XML_PARSE_FASTEST:
+                _doc->parse<rapidxml::parse_fastest>(data);
+                break;
+              default:
+                err = "unknow xml parse profile";
+            }
+        } catch (const rapidxml::parse_error&e) {
+            err = std::string("parse error[")+e.what()+"] "+std::string(e.where<char>()).substr(0, 32);
+        } catch (const std::exception&e) {
+            err = std::string("unknow exception[")+e.what()+"]";
+        }
+        if (!err.empty()) {
+            throw std::runtime_error(err);
+        }
+        _val = _doc->first_node();
+    }
+    void release() { // root only
+        delete _pool;
+        delete _doc;
+        delete []_xml_data;
+        delete _map;
+        _pool = 0;
+        _doc = 0;
+        _xml_data = 0;
+        _map = 0;
+    }
+    void init(const XmlReader*parent, const XML_READER_NODE* val, size_t begin, size_t end) {
+        _xml_data = 0;
+        _map = 0;
+        _pool = (0!=parent)?parent->_pool:0;
+        _val = val;
+        _sib_begin = begin;
+        _sib_end = end;
+        _indexed = false;
+        _idx_begin = 0;
+        _idx_end = 0;
+        _grp_begin = 0;
+        _grp_count = 0;
+        _iter = 0;
+        if (end > begin) {
+            _val = _pool->entries[begin].node;
+        }
+    }
 
-    XmlReader(const sibling_type* val, const XmlReader*parent, const char*key):xdoc_type(parent, key),_doc(0),_val(0),_siblings(val) {
-        init();
+    // profiles without parse_no_string_terminators keep names and values '\0' terminated
+    bool terminated() const {
+        return X2STRUCT_XML_PARSE_NON_DESTRUCTIVE!=_pool->profile && X2STRUCT_XML_PARSE_FASTEST!=_pool->profile;
     }
-    XmlReader(const sibling_type* val, const XmlReader*parent, size_t index):xdoc_type(parent, index),_doc(0),_val(0),_siblings(val) {
-        init();
+    // terminated once per group by build_index
+    const char* name(size_t entry) const {
+        return _pool->entries[entry].name;
     }
-    XmlReader(const XML_READER_NODE* val, const XmlReader*parent, size_t index):xdoc_type(parent, index),_doc(0),_val(val),_siblings(0) {
-        init();
+    bool value(std::string& v) const {
+        if (_val && _val->value()) {
+            text(_val->value(), _val->value_size(), v);
+            return true;
+        }
+        return false;
     }
-    void init() {
-        if (0 != _siblings) {
-            _val=(*_siblings)[0];
+    // entities are decoded here if the parser skipped translation
+    void text(const char* str, size_t len, std::string& v) const {
+        if (X2STRUCT_XML_PARSE_DEFAULT==_pool->profile || 0==memchr(str, '&', len)) {
+            v.assign(str, len);
+        } else {
+            decode(str, len, v);
         }
-        if (0 != _val) {
-            XML_READER_NODE *tmp = _val->first_node();
-            for (; tmp; tmp=tmp->next_sibling()) {
-                child_index_type::iterator it = _child_index.find(tmp->name());
-                if (it != _child_index.end()) {
-                    _childs[it->second].push_back(tmp);
-                } else {
-                    sibling_type _v;
-                    _v.push_back(tmp);
-                    _childs.push_back(_v);
-                    _child_index[tmp->name()] = _childs.size()-1;
+    }
+    // same entities as rapidxml, unknown one is kept as is
+    static void decode(const char* str, size_t len, std::string& v) {
+        v.clear();
+        v.reserve(len);
+        for (size_t i=0; i<len; ++i) {
+            if (str[i] != '&') {
+                v.push_back(str[i]);
+                continue;
+            }
+            const char* s = str+i+1;
+            size_t left = len-i-1;
+            if (left>=3 && 0==memcmp(s, "lt;", 3)) {
+                v.push_back('<');
+                i += 3;
+            } else if (left>=3 && 0==memcmp(s, "gt;", 3)) {
+                v.push_back('>');
+                i += 3;
+            } else if (left>=4 && 0==memcmp(s, "amp;", 4)) {
+                v.push_back('&');
+                i += 4;
+            } else if (left>=5 && 0==memcmp(s, "quot;", 5)) {
+                v.push_back('"');
+                i += 5;
+            } else if (left>=5 && 0==memcmp(s, "apos;", 5)) {
+                v.push_back('\'');
+                i += 5;
+            } else if (left>=1 && s[0]=='#') {
+                unsigned long code = 0;
+                size_t j = 1;
+                bool hex = (left>=2 && s[1]=='x');
+                if (hex) {
+                    ++j;
+                }
+                size_t digit = j;
+                for (; j<left; ++j) {
+                    char c = s[j];
+                    if (c>='0' && c<='9') {
+                        code = code*(hex?16:10)+(c-'0');
+                    } else if (hex && c>='a' && c<='f') {
+                        code = code*16+(c-'a'+10);
+                    } else if (hex && c>='A' && c<='F') {
+                        code = code*16+(c-'A'+10);
+                    } else {
+                        break;
+                    }
                 }
+                if (j==digit || j>=left || s[j]!=';') {
+                    v.push_back('&');
+                    continue;
+                }
+                utf8(code, v);
+                i += j+1;
+            } else {
+                v.push_back('&');
             }
         }
     }
+    static void utf8(unsigned long code, std::string& v) {
+        if (code < 0x80) {
+            v.push_back((char)code);
+        } else if (code < 0x800) {
+            v.push_back((char)(0xC0|(code>>6)));
+            v.push_back((char)(0x80|(code&0x3F)));
+        } else if (code < 0x10000) {
+            v.push_back((char)(0xE0|(code>>12)));
+            v.push_back((char)(0x80|((code>>6)&0x3F)));
+            v.push_back((char)(0x80|(code&0x3F)));
+        } else {
+            v.push_back((char)(0xF0|(code>>18)));
+            v.push_back((char)(0x80|((code>>12)&0x3F)));
+            v.push_back((char)(0x80|((code>>6)&0x3F)));
+            v.push_back((char)(0x80|(code&0x3F)));
+        }
+    }
+
+    static int compare(const char* a, size_t alen, const char* b, size_t blen) {
+        int r = memcmp(a, b, (alen<blen)?alen:blen);
+        if (r != 0) {
+            return r;
+        }
+        return (alen<blen)?-1:((alen>blen)?1:0);
+    }
+    void build_index() {
+        if (_indexed) {
+            return;
+        }
+        _indexed = true;
+        if (0 == _val) {
+            return;
+        }
+        std::map<const XML_READER_NODE*, NodeIndex>::iterator it = _pool->nodes.find(_val);
+        if (it == _pool->nodes.end()) {
+            it = _pool->nodes.insert(std::make_pair(_val, index_node(_val))).first;
+        }
+        _idx_begin = it->second.begin;
+        _idx_end = it->second.end;
+        _grp_begin = it->second.group;
+        _grp_count = it->second.count;
+    }
+    NodeIndex index_node(const XML_READER_NODE* node) {
+        std::vector<IndexEntry>& entries = _pool->entries;
+        std::vector<size_t>& groups = _pool->groups;
+        NodeIndex ni;
+        ni.begin = entries.size();
+        for (XML_READER_NODE *tmp=node->first_node(); tmp; tmp=tmp->next_sibling()) {
+            IndexEntry e = {tmp->name(), tmp->name_size(), tmp};
+            entries.push_back(e);
+        }
+        ni.end = entries.size();
+        std::stable_sort(entries.begin()+ni.begin, entries.end(), IndexLess());
+
+        ni.group = groups.size();
+        for (size_t i=ni.begin; i<ni.end; ) {
+            groups.push_back(i);
+            size_t end = i+1;
+            for (; end<ni.end && 0==compare(entries[i].name, entries[i].name_len, entries[end].name, entries[end].name_len); ++end);
+            if (!terminated()) {
+                _pool->names.push_back(std::string(entries[i].name, entries[i].name_len));
+                for (size_t j=i; j<end; ++j) {
+                    entries[j].name = _pool->names.back().c_str();
+                }
+            }
+            i = end;
+        }
+        ni.count = groups.size()-ni.group;
+        groups.push_back(ni.end);
+        return ni;
+    }
+    bool find(const char* key, size_t& begin, size_t& end) {
+        build_index();
+        std::vector<IndexEntry>& entries = _pool->entries;
+        IndexEntry e = {key, strlen(key), 0};
+        std::pair<std::vector<IndexEntry>::iterator, std::vector<IndexEntry>::iterator> r;
+        r = std::equal_range(entries.begin()+_idx_begin, entries.begin()+_idx_end, e, IndexLess());
+        begin = (size_t)(r.first-entries.begin());
+        end = (size_t)(r.second-entries.begin());
+        return end > begin;
+    }
+    // first entry of the g-th name group, g==count gives the end
+    size_t group_begin(size_t g) const {
+        return _pool->groups[_grp_begin+g];
+    }
+    size_t group_count() {
+        build_index();
+        return _grp_count;
+    }
 
     XML_READER_DOCUMENT* _doc;
     char *_xml_data;
+    XFileMap* _map;
+    IndexPool* _pool;
 
     const XML_READER_NODE* _val;
-    const sibling_type *_siblings;
-    child_type _childs;
-    child_index_type _child_index; // 记录某个key在_childs中的索引
-    mutable child_index_type::iterator _iter;
+    size_t _sib_begin;      // same name siblings, pool->entries[_sib_begin, _sib_end)
+    size_t _sib_end;
+    bool   _indexed;        // child index looked up(or built) when first used
+    size_t _idx_begin;      // child index, pool->entries[_idx_begin, _idx_end)
+    size_t _idx_end;
+    size_t _grp_begin;      // name groups, pool->groups[_grp_begin, _grp_begin+_grp_count]
+    size_t _grp_count;
+    mutable size_t _iter;   // group of begin()/next()
 };
 
 }
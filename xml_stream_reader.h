@@ -0,0 +1,270 @@
+﻿/*
+* Copyright (C) 2017 YY Inc. All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License"); 
+* you may not use this file except in compliance with the License. 
+* You may obtain a copy of the License at
+*
+*	http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, 
+* software distributed under the License is distributed on an "AS IS" BASIS, 
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. 
+* See the License for the specific language governing permissions and 
+* limitations under the License.
+*/
+
+#ifndef __X_XML_STREAM_READER_H
+#define __X_XML_STREAM_READER_H
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+
+#include <string.h>
+
+#include "xml_reader.h"
+
+#define X2STRUCT_XML_STREAM_BUFFER 65536
+
+namespace x2struct {
+
+/*
+  decode repeated record elements of a huge xml one by one, memory is bounded by the largest record.
+  input is read by chunk and scanned(tags, comments, cdata, pi, doctype) without building a tree,
+  every record is then parsed by XmlReader in place.
+  record is element named name outside of other records, or every child of the root element if name is empty.
+
+  XmlStreamReader reader("feed.xml", "item");
+  item t;
+  while (reader.next(t)) {...}
+*/
+class XmlStreamReader {
+public:
+    XmlStreamReader(const std::string& file, const std::string& name="", size_t bufsize=X2STRUCT_XML_STREAM_BUFFER):_fs(0),_name(name),_bufsize(bufsize) {
+        _fs = new std::ifstream(file.c_str(), std::ifstream::binary);
+        if (!*_fs) {
+            delete _fs;
+            throw std::runtime_error("Open file["+file+"] fail.");
+        }
+        _is = _fs;
+        init();
+    }
+    XmlStreamReader(std::istream& is, const std::string& name="", size_t bufsize=X2STRUCT_XML_STREAM_BUFFER):_is(&is),_fs(0),_name(name),_bufsize(bufsize) {
+        init();
+    }
+    ~XmlStreamReader() {
+        delete _fs;
+    }
+
+    // next record as raw xml, false at end of input
+    bool next(std::string& xml) {
+        size_t begin, end;
+        if (!scan(begin, end)) {
+            return false;
+        }
+        xml.assign(_buf, begin, end-begin);
+        return true;
+    }
+    // decode next record into t, false at end of input
+    template <typename TYPE>
+    bool next(TYPE& t, int profile=X2STRUCT_XML_PARSE_DEFAULT) {
+        size_t begin, end;
+        if (!scan(begin, end)) {
+            return false;
+        }
+        _rec.assign(_buf.begin()+begin, _buf.begin()+end);
+        _rec.push_back('\0');
+        XmlReader reader(XmlBuffer(&_rec[0], end-begin), profile);
+        reader.convert(t);
+        return true;
+    }
+    size_t count() const {
+        return _count;
+    }
+private:
+    XmlStreamReader(const XmlStreamReader&);
+    XmlStreamReader& operator=(const XmlStreamReader&);
+
+    void init() {
+        _pos = 0;
+        _depth = 0;
+        _count = 0;
+        _eof = false;
+        if (_bufsize < 16) {
+            _bufsize = 16;
+        }
+    }
+    // append a chunk, false if input is exhausted
+    bool fill() {
+        if (_eof) {
+            return false;
+        }
+        size_t old = _buf.size();
+        _buf.resize(old+_bufsize);
+        _is->read(&_buf[old], _bufsize);
+        size_t got = (size_t)_is->gcount();
+        _buf.resize(old+got);
+        if (got < _bufsize) {
+            _eof = true;
+        }
+        return got > 0;
+    }
+    // pattern at or after from, npos if not found till end of input
+    size_t find(const char* pat, size_t from) {
+        size_t len = strlen(pat);
+        for (;;) {
+            size_t p = _buf.find(pat, from, len);
+            if (p != std::string::npos) {
+                return p;
+            }
+            if (_buf.size() >= len) {
+                from = std::max(from, _buf.size()-len+1);
+            }
+            if (!fill()) {
+                return std::string::npos;
+            }
+        }
+    }
+    bool ensure(size_t size) {
+        while (_buf.size() < size) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool prefix(size_t p, const char* pat) {
+        size_t len = strlen(pat);
+        return ensure(p+len) && 0==_buf.compare(p, len, pat);
+    }
+    // '>' closing the tag at p, quoted attribute value may contain '>'
+    size_t tag_end(size_t p) {
+        char quote = 0;
+        for (size_t i=p+1; ; ++i) {
+            if (i>=_buf.size() && !fill()) {
+                return std::string::npos;
+            }
+            char c = _buf[i];
+            if (quote) {
+                if (c == quote) {
+                    quote = 0;
+                }
+            } else if (c=='"' || c=='\'') {
+                quote = c;
+            } else if (c == '>') {
+                return i;
+            }
+        }
+    }
+    // <!DOCTYPE ...> may have an internal subset in []
+    size_t decl_end(size_t p) {
+        int bracket = 0;
+        for (size_t i=p+2; ; ++i) {
+            if (i>=_buf.size() && !fill()) {
+                return std::string::npos;
+            }
+            char c = _buf[i];
+            if (c == '[') {
+                ++bracket;
+            } else if (c == ']') {
+                --bracket;
+            } else if (c=='>' && bracket<=0) {
+                return i;
+            }
+        }
+    }
+    bool is_record(size_t p, size_t end) const {
+        if (_name.empty()) {
+            return 1 == _depth;
+        }
+        size_t n = p+1;
+        for (; n<end && !strchr(" \t\r\n/>", _buf[n]); ++n);
+        return n-p-1==_name.length() && 0==_buf.compare(p+1, _name.length(), _name);
+    }
+    size_t advance(size_t p, const char* what) {
+        if (p == std::string::npos) {
+            throw std::runtime_error(std::string("xml stream truncated in ")+what);
+        }
+        return p;
+    }
+    // locate next record, _buf[begin, end)
+    bool scan(size_t& begin, size_t& end) {
+        bool inrec = false;
+        int recdepth = 0;
+        begin = 0;
+        for (;;) {
+            if (!inrec && _pos>=_bufsize) { // drop consumed data
+                _buf.erase(0, _pos);
+                _pos = 0;
+            }
+            size_t p = find("<", _pos);
+            if (p == std::string::npos) {
+                if (inrec) {
+                    throw std::runtime_error("xml stream truncated in record");
+                }
+                _pos = _buf.size();
+                return false;
+            }
+            if (!ensure(p+2)) {
+                throw std::runtime_error("xml stream truncated in tag");
+            }
+            char c = _buf[p+1];
+            if (c == '?') {
+                _pos = advance(find("?>", p+2), "pi")+2;
+            } else if (c == '!') {
+                if (prefix(p, "<!--")) {
+                    _pos = advance(find("-->", p+4), "comment")+3;
+                } else if (prefix(p, "<![CDATA[")) {
+                    _pos = advance(find("]]>", p+9), "cdata")+3;
+                } else {
+                    _pos = advance(decl_end(p), "declaration")+1;
+                }
+            } else if (c == '/') {
+                _pos = advance(tag_end(p), "tag")+1;
+                --_depth;
+                if (inrec && _depth==recdepth) {
+                    end = _pos;
+                    ++_count;
+                    return true;
+                }
+            } else {
+                size_t e = advance(tag_end(p), "tag");
+                bool empty = (_buf[e-1] == '/');
+                if (!inrec && is_record(p, e)) {
+                    begin = p;
+                    if (empty) {
+                        _pos = end = e+1;
+                        ++_count;
+                        return true;
+                    }
+                    inrec = true;
+                    recdepth = _depth;
+                }
+                if (!empty) {
+                    ++_depth;
+                }
+                _pos = e+1;
+            }
+        }
+    }
+
+    std::istream* _is;
+    std::ifstream* _fs;         // owned when open by file name
+    std::string _name;
+    size_t _bufsize;
+
+    std::string _buf;           // unconsumed input, _buf[_pos...]
+    size_t _pos;
+    int _depth;                 // element depth at _pos
+    size_t _count;
+    bool _eof;
+    std::vector<char> _rec;     // record parsed in place
+};
+
+}
+
+#endif
@@ -26,8 +26,9 @@
 #include <string.h>
 
 #include "util.h"
-#include "xml_writer.h"
 #include "xtypes.h"
+#include "xstream.h"
+#include "xescape.h"
 
 #define X2STRUCT_BUFFER_SIZE 1024
 #define X2STRUCT_TYPE_OBJECT 0
@@ -39,39 +40,47 @@ class XmlWriter {
 private:
     class XmlKey{
     public:
-        XmlKey(const char*key, XmlWriter*writer, bool base) {
-            _key = key;
-            if (_key[0]=='\0') {
+        XmlKey(const XKey& key, XmlWriter*writer, bool base):_key(key) {
+            if (_key.empty()) {
                 return;
             }
             _writer = writer;
             _base = base;
             _writer->indent();
-            _writer->append("<", 1);
-            _writer->append(_key, -1);
-            _writer->append(">");
+            if (0 != _key.enc) {
+                _writer->append(_key.enc->xml_begin, (int)_key.enc->xml_begin_len);
+            } else {
+                _writer->append("<", 1);
+                _writer->append(_key.name, (int)_key.len);
+                _writer->append(">", 1);
+            }
             _lines = _writer->_lines;
         }
         ~XmlKey() {
-            if (_key[0]=='\0') {
+            if (_key.empty()) {
                 return;
             }
             if (!_base || _writer->_lines>_lines) {
                 _writer->indent();
             }
-            _writer->append("</", 2);
-            _writer->append(_key, -1);
-            _writer->append(">");
+            if (0 != _key.enc) {
+                _writer->append(_key.enc->xml_end, (int)_key.enc->xml_end_len);
+            } else {
+                _writer->append("</", 2);
+                _writer->append(_key.name, (int)_key.len);
+                _writer->append(">", 1);
+            }
         }
     private:
-        const char*_key;
+        const XKey& _key;
         XmlWriter* _writer;
         bool _base;
         int  _lines;
     };
     friend class XmlKey;
 public:
-    XmlWriter(int indentCount=0, char indentChar=' '):_indentCount(indentCount),_indentChar(indentChar) {
+    // if os not null, output is written to os instead of keep in memory, toStr() will return empty string
+    XmlWriter(int indentCount=0, char indentChar=' ', XOStream* os=0):_indentCount(indentCount),_indentChar(indentChar),_os(os) {
         if (_indentCount > 0) {
             if (_indentChar!=' ' && _indentChar!='\t') {
                 throw std::runtime_error("indentChar must be space or tab");
@@ -80,12 +89,18 @@ public:
         _buffer.resize(1);
         _buffer.reserve(X2STRUCT_BUFFER_SIZE);
         _cur = &_buffer[0];
+        _cur->reserve(X2STRUCT_BUFFER_SIZE);
         _lines = 0;
+        _precision = -1;
+        _omit_default = false;
     }
     ~XmlWriter() {
     }
 public:
     std::string toStr() {
+        if (_buffer.size() == 1) {
+            return _buffer[0];
+        }
         size_t total_len = 0;
         for (size_t i=0; i<_buffer.size(); ++i) {
             total_len += _buffer[i].length();
@@ -98,6 +113,35 @@ public:
         return buf;
     }
 
+    // allocate size bytes once and keep output in one chunk, size is usually X::xmlsize
+    void reserve(size_t size) {
+        if (0 == _os) {
+            _cur->reserve(_cur->length()+size);
+        }
+    }
+
+    // output chunks in order, for callers building their own iovec
+    const std::vector<std::string>& chunks() const {
+        return _buffer;
+    }
+    // write output chunks to fd with writev, no copy into one string. return bytes written
+    size_t write_to(int fd) const {
+        return XOStream::writev(fd, _buffer.empty()?0:&_buffer[0], _buffer.size());
+    }
+
+    // skip member with default value(0, false, empty string/container), see Util::is_default
+    void omit_default(bool omit) {
+        _omit_default = omit;
+    }
+    bool omit_default() const {
+        return _omit_default;
+    }
+
+    // <0(default) write shortest string that round-trip, >=0 write fixed decimals for float/double
+    void float_precision(int precision) {
+        _precision = precision;
+    }
+
     void array_begin() {
         _state.push_back(X2STRUCT_TYPE_ARRAY);
     }
@@ -115,41 +159,18 @@ public:
         return t;
     }
 
-    XmlWriter& convert(const char*key, const std::string &val) {
+    XmlWriter& convert(const XKey& key, const std::string &val) {
         XmlKey xkey(key, this, true);
-
-        for (size_t i=0; i<val.length(); ++i) {
-            int c = (int)(val[i]) & 0xFF;
-            switch (c) {
-              case '<':
-                append("&lt;", 4);
-                break;
-              case '>':
-                append("&gt;", 4);
-                break;
-              case '&':
-                append("&amp;", 5);
-                break;
-              case '\'':
-                append("&apos;", 6);
-                break;
-              case '\"':
-                append("&quot;", 6);
-                break;
-              default:
-                if(c >= ' ') {
-                    append(val[i]);
-                } else {
-                    char tmp[16];
-                    int l = sprintf(tmp, "\\x%02X", c);
-                    append(tmp, l);
-                }
-            }
-        }
+        escape(val.data(), val.length());
 
         return *this;
     }
-    XmlWriter& convert(const char*key, bool val) {
+    XmlWriter& convert(const XKey& key, const XStrView &val) {
+        XmlKey xkey(key, this, true);
+        escape(val.data(), val.size());
+        return *this;
+    }
+    XmlWriter& convert(const XKey& key, bool val) {
         XmlKey xkey(key, this, true);
         if (val) {
             append("true", 4);
@@ -158,53 +179,56 @@ public:
         }
         return *this;
     }
-    XmlWriter& convert(const char*key, int16_t val) {
+    XmlWriter& convert(const XKey& key, int16_t val) {
         XmlKey xkey(key, this, true);
         append(Util::tostr(val));
         return *this;
     }
-    XmlWriter& convert(const char*key, uint16_t val) {
+    XmlWriter& convert(const XKey& key, uint16_t val) {
         XmlKey xkey(key, this, true);
         append(Util::tostr(val));
         return *this;
     }
-    XmlWriter& convert(const char*key, int32_t val) {
+    XmlWriter& convert(const XKey& key, int32_t val) {
         XmlKey xkey(key, this, true);
         append(Util::tostr(val));
         return *this;
     }
-    XmlWriter& convert(const char*key, uint32_t val) {
+    XmlWriter& convert(const XKey& key, uint32_t val) {
         XmlKey xkey(key, this, true);
         append(Util::tostr(val));
         return *this;
     }
-    XmlWriter& convert(const char*key, int64_t val) {
+    XmlWriter& convert(const XKey& key, int64_t val) {
         XmlKey xkey(key, this, true);
         append(Util::tostr(val));
         return *this;
     }
-    XmlWriter& convert(const char*key, uint64_t val) {
+    XmlWriter& convert(const XKey& key, uint64_t val) {
         XmlKey xkey(key, this, true);
         append(Util::tostr(val));
         return *this;
     }
-    XmlWriter& convert(const char*key, double val) {
+    XmlWriter& convert(const XKey& key, double val) {
         XmlKey xkey(key, this, true);
-        append(Util::tostr(val));
+        char buf[X2STRUCT_FLOAT_BUFFER];
+        append(buf, Util::dtoa(val, buf, _precision));
         return *this;
     }
-    XmlWriter& convert(const char*key, float val) {
+    XmlWriter& convert(const XKey& key, float val) {
         XmlKey xkey(key, this, true);
-        append(Util::tostr(val));
+        char buf[X2STRUCT_FLOAT_BUFFER];
+        append(buf, Util::ftoa(val, buf, _precision));
         return *this;
     }
 
     template<typename T>
-    XmlWriter& convert(const char*key, const std::vector<T>&data) {
-        key=key[0]=='\0'?"x":key;
+    XmlWriter& convert(const XKey& key, const std::vector<T>&data) {
+        XKey x("x", 1);
+        const XKey& k = key.empty()?x:key;
         this->array_begin();
         for (size_t i=0; i<data.size(); ++i) {
-            XmlKey xkey(key, this, true);
+            XmlKey xkey(k, this, true);
             this->convert("", data[i]);
         }
         this->array_end();
@@ -212,11 +236,12 @@ public:
     }
 
     template<typename T>
-    XmlWriter& convert(const char*key, const std::set<T>&data) {
-        key=key[0]=='\0'?"x":key;
+    XmlWriter& convert(const XKey& key, const std::set<T>&data) {
+        XKey x("x", 1);
+        const XKey& k = key.empty()?x:key;
         this->array_begin();
         for (typename std::set<T>::const_iterator it=data.begin(); it!=data.end(); ++it) {
-            XmlKey xkey(key, this, true);
+            XmlKey xkey(k, this, true);
             this->convert("", *it);
         }
         this->array_end();
@@ -224,7 +249,7 @@ public:
     }
 
     template <typename T>
-    void convert(const char*key, const std::map<std::string, T> &data) {
+    void convert(const XKey& key, const std::map<std::string, T> &data) {
         XmlKey xkey(key, this, false);
         this->object_begin();
         for (typename std::map<std::string,T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
@@ -234,7 +259,7 @@ public:
     }
 
     template <typename KEY, typename T>
-    void convert(const char*key, const std::map<KEY, T> &data) {
+    void convert(const XKey& key, const std::map<KEY, T> &data) {
         XmlKey xkey(key, this, false);
         this->object_begin();
         for (typename std::map<KEY,T>::const_iterator iter=data.begin(); iter!=data.end(); ++iter) {
@@ -246,24 +271,46 @@ public:
     }
 
     template <typename T>
-    void convert(const char*key, const T& data) {
+    void convert(const XKey& key, const T& data) {
         XmlKey xkey(key, this, false);
         this->object_begin();
-        data.__struct_to_str(*this, key);
+        data.__struct_to_str(*this, key.name);
         this->object_end();
     }
 
     template <typename T>
-    void convert(const char*key, const XType<T>& data) {
+    void convert(const XKey& key, const XType<T>& data) {
         data.__struct_to_str(*this, key);
     }
 
+    // splice cached content between <key> and </key>, only when compact and options are default
+    template <typename T>
+    void convert(const XKey& key, const XCached<T>& data) {
+        if (_indentCount>=0 || _precision>=0 || _omit_default) {
+            this->convert(key, data.get());
+            return;
+        }
+        const std::string* bytes = data.cache_get(X2STRUCT_CACHE_XML);
+        if (0 == bytes) {
+            XmlWriter writer(-1);
+            writer.object_begin();
+            data.get().__struct_to_str(writer, key.name);
+            writer.object_end();
+            std::string str = writer.toStr();
+            bytes = &data.cache_set(X2STRUCT_CACHE_XML, str);
+        }
+        XmlKey xkey(key, this, false);
+        append(bytes->data(), (int)bytes->length());
+    }
+
 private:
     void append(const char* str, int len) {
         if (len < 0) {
             len = strlen(str);
         }
-        if (len+_cur->length() <= X2STRUCT_BUFFER_SIZE) {
+        if (0 != _os) {
+            _os->write(str, (size_t)len);
+        } else if (len+_cur->length() <= _cur->capacity()) {
             _cur->append(str, len);
         } else {
             _buffer.push_back(std::string());
@@ -275,6 +322,21 @@ private:
     void append(const std::string&str) {
         append(str.c_str(), str.length());
     }
+    void escape(const char* str, size_t len) {
+        size_t i = 0;
+        while (i < len) {
+            size_t n = XEscape::clean(str+i, len-i, X2STRUCT_ESCAPE_XML);
+            if (n > 0) {
+                append(str+i, (int)n);
+                i += n;
+            }
+            if (i < len) {
+                char tmp[16];
+                append(tmp, XEscape::escape((unsigned char)str[i], X2STRUCT_ESCAPE_XML, tmp));
+                ++i;
+            }
+        }
+    }
     void append(char ch) {
         char buf[1] = {ch};
         append(buf, 1);
@@ -299,9 +361,12 @@ private:
     int  _indentCount;
     char _indentChar;
     int  _lines;
+    int  _precision;
+    bool _omit_default;
     std::vector<std::string> _buffer;
     std::string *_cur;
     std::vector<int> _state;
+    XOStream* _os;
 };
 
 }
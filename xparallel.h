@@ -0,0 +1,83 @@
+﻿/*
+* Copyright (C) 2017 YY Inc. All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License"); 
+* you may not use this file except in compliance with the License. 
+* You may obtain a copy of the License at
+*
+*	http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, 
+* software distributed under the License is distributed on an "AS IS" BASIS, 
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. 
+* See the License for the specific language governing permissions and 
+* limitations under the License.
+*/
+
+#ifndef __X_PARALLEL_H
+#define __X_PARALLEL_H
+
+#include <stddef.h>
+#include <vector>
+
+#if __cplusplus >= 201103L
+#include <thread>
+#include <mutex>
+#include <exception>
+#define X2STRUCT_THREAD
+#endif
+
+#define X2STRUCT_PARALLEL_MIN 1024  // vector smaller than this is always encoded in caller thread
+
+namespace x2struct {
+
+/*
+  split [0,total) into parts ranges, call job(part, begin, end) for each range.
+  part 0 run in caller thread, others run in their own thread.
+  without c++11 all parts run in caller thread one by one, output is the same.
+*/
+template <class JOB>
+void parallel_run(JOB& job, size_t total, size_t parts) {
+    #ifdef X2STRUCT_THREAD
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> excepts(parts);
+    threads.reserve(parts-1);   // push_back of a started thread must not throw
+    try {
+        for (size_t i=1; i<parts; ++i) {
+            threads.push_back(std::thread([&job, &excepts, total, parts, i]() {
+                try {
+                    job(i, total*i/parts, total*(i+1)/parts);
+                } catch (...) {
+                    excepts[i] = std::current_exception();
+                }
+            }));
+        }
+    } catch (...) {     // thread creation failed, a joinable thread must not be destroyed
+        for (size_t i=0; i<threads.size(); ++i) {
+            threads[i].join();
+        }
+        throw;
+    }
+    try {
+        job(0, 0, total/parts);
+    } catch (...) {
+        excepts[0] = std::current_exception();
+    }
+    for (size_t i=0; i<threads.size(); ++i) {
+        threads[i].join();
+    }
+    for (size_t i=0; i<parts; ++i) {
+        if (excepts[i]) {
+            std::rethrow_exception(excepts[i]);
+        }
+    }
+    #else
+    for (size_t i=0; i<parts; ++i) {
+        job(i, total*i/parts, total*(i+1)/parts);
+    }
+    #endif
+}
+
+}
+
+#endif
@@ -35,6 +35,7 @@ namespace x2struct {
   DOC need implement
   bool has(const std::string)
   const std::string& type()
+  bool null()     value is null, used by delta mode
 */
 template<typename DOC>
 class XReader {
@@ -43,13 +44,24 @@ protected:
     typedef XReader<DOC> xdoc_type;
 public:
     // only c++0x support reference initialize, so use pointer
-    XReader(const doc_type *parent, const char* key):_parent(parent), _key(key), _index(-1){}
-    XReader(const doc_type *parent, size_t index):_parent(parent), _key(0), _index(int(index)){}
+    XReader(const doc_type *parent, const char* key):_parent(parent), _key(key), _index(-1), _delta(0!=parent&&parent->_delta){}
+    XReader(const doc_type *parent, size_t index):_parent(parent), _key(0), _index(int(index)), _delta(0!=parent&&parent->_delta){}
     ~XReader(){}
 public:
+    /*
+      apply a delta(X::tojson_delta/tobson_delta) to an existing object, call before convert.
+      missing member is kept, map is updated by key(null means erase), vector and set are replaced.
+    */
+    void delta_mode(bool delta) {
+        _delta = delta;
+    }
+
     template <typename TYPE>
     void convert(std::vector<TYPE> &val) {
         size_t s = static_cast<doc_type*>(this)->size();                // [implement] size_t size(bool to_vec=true)
+        if (_delta) {
+            val.clear();
+        }
         val.resize(s);
         for (size_t i=0; i<s; ++i) {
             (*static_cast<doc_type*>(this))[i].convert(val[i]);         // [implement] doc_type operator[](size_t)
@@ -59,6 +71,9 @@ public:
     template <typename TYPE>
     void convert(std::set<TYPE> &val) {
         size_t s = static_cast<doc_type*>(this)->size();
+        if (_delta) {
+            val.clear();
+        }
         for (size_t i=0; i<s; ++i) {
             TYPE _t;
             (*static_cast<doc_type*>(this))[i].convert(_t);
@@ -69,6 +84,14 @@ public:
     template <typename TYPE>
     void convert(std::map<std::string,TYPE> &val) {
         for (doc_type d=static_cast<doc_type*>(this)->begin(); d; d=d.next()) { // [implement] doc_type begin(); doc_type next(); operator bool() const;
+            if (_delta) {
+                if (d.null()) {
+                    val.erase(d.key());
+                } else {
+                    d.convert(val[d.key()]);
+                }
+                continue;
+            }
             TYPE _t;
             d.convert(_t);
             val[d.key()] = _t;
@@ -78,8 +101,6 @@ public:
     template <typename KEYTYPE, typename TYPE>
     void convert(std::map<KEYTYPE, TYPE> &val) {
         for (doc_type d=static_cast<doc_type*>(this)->begin(); d; d=d.next()) {
-            TYPE _t;
-            d.convert(_t);
             KEYTYPE _k;
             std::string key = d.key();
             if (key[0]!='x') {
@@ -87,6 +108,16 @@ public:
             } else { // libconfig/xml不支持数字作为key，所以用x开头，比如x11
                 _k = Util::tonum<KEYTYPE>(key.substr(1));
             }
+            if (_delta) {
+                if (d.null()) {
+                    val.erase(_k);
+                } else {
+                    d.convert(val[_k]);
+                }
+                continue;
+            }
+            TYPE _t;
+            d.convert(_t);
             val[_k] = _t;
         }
     }
@@ -94,8 +125,16 @@ public:
     template <typename TYPE>
     void convert(TYPE& val) {
         size_t len = (static_cast<doc_type*>(this))->size(false);
+        const char* attr;
+        const char* value;
         if (0==len) {
             val.__x_to_struct(*(static_cast<doc_type*>(this)));
+        } else if (val.__x_condition_kv(attr, value)) {
+            size_t i;
+            if ((static_cast<doc_type*>(this))->condition_find(attr, value, i)) {
+                doc_type sub = (*static_cast<doc_type*>(this))[i];
+                val.__x_to_struct(sub);
+            }
         } else {
             for (size_t i=0; i<len; ++i) {
                 doc_type sub = (*static_cast<doc_type*>(this))[i];
@@ -107,6 +146,25 @@ public:
         }
     }
 
+    // [implement, optional] first element whose attribute attr equals value
+    bool condition_find(const char* attr, const char* value, size_t& index) {
+        size_t len = (static_cast<doc_type*>(this))->size(false);
+        for (size_t i=0; i<len; ++i) {
+            doc_type sub = (*static_cast<doc_type*>(this))[i];
+            if (sub.has(attr) && sub.attribute(attr)==value) {
+                index = i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // [implement, optional] only zero-copy BsonReader can point into the input
+    void convert(XStrView& val) {
+        (void)val;
+        throw std::runtime_error("XStrView is only supported by zero-copy bson reader");
+    }
+
     std::string attribute(const char* key) {
         std::string val;
         (*static_cast<doc_type*>(this))[key].convert(val);
@@ -157,6 +215,9 @@ public:
         return p;
     }
     void me_exception(const std::string&key) {
+        if (_delta) {   // delta only carry changed member
+            return;
+        }
         std::string err;
         err.reserve(128);
         err.append("miss ");
@@ -171,6 +232,7 @@ protected:
     const doc_type* _parent;
     const char* _key;
     int _index;
+    bool _delta;
 };
 
 }
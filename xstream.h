@@ -0,0 +1,255 @@
+﻿/*
+* Copyright (C) 2017 YY Inc. All rights reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License"); 
+* you may not use this file except in compliance with the License. 
+* You may obtain a copy of the License at
+*
+*	http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, 
+* software distributed under the License is distributed on an "AS IS" BASIS, 
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. 
+* See the License for the specific language governing permissions and 
+* limitations under the License.
+*/
+
+#ifndef __X_STREAM_H
+#define __X_STREAM_H
+
+#include <string>
+#include <ostream>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef WINDOWS
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#else
+#include <io.h>
+#endif
+
+// may be defined before including x2struct
+#ifndef X2STRUCT_OSTREAM_SIZE
+#define X2STRUCT_OSTREAM_SIZE 65536
+#endif
+#ifndef X2STRUCT_IOV_MAX
+#if (!defined WINDOWS && defined IOV_MAX)
+#define X2STRUCT_IOV_MAX IOV_MAX
+#else
+#define X2STRUCT_IOV_MAX 1024
+#endif
+#endif
+
+namespace x2struct {
+
+/*
+  fixed-size output buffer, flushed to fd, FILE* or std::ostream when it is full,
+  so encoding a huge struct only needs bufsize bytes of memory.
+  implement rapidjson output stream concept(Put/Flush), used by JsonWriterT/XmlWriter.
+  without target(XOStream() or XOStream(XOStream::count_only, bufsize)), data is dropped
+  and only counted, see size(). the tag keeps an int from being taken as the buffer size of fd.
+  with a memory target, data is written in place and overflow throw runtime_error,
+  use X::jsonsize/xmlsize to get the exact size.
+*/
+class XOStream {
+    enum {
+        t_none,
+        t_fd,
+        t_file,
+        t_ostream,
+        t_mem
+    };
+public:
+    typedef char Ch;
+    enum count_only_t {
+        count_only
+    };
+
+    XOStream():_type(t_none),_fd(-1),_fp(0),_os(0) {
+        init(X2STRUCT_OSTREAM_SIZE);
+    }
+    XOStream(count_only_t, size_t bufsize):_type(t_none),_fd(-1),_fp(0),_os(0) {
+        init(bufsize);
+    }
+    explicit XOStream(int fd, size_t bufsize=X2STRUCT_OSTREAM_SIZE):_type(t_fd),_fd(fd),_fp(0),_os(0) {
+        init(bufsize);
+    }
+    explicit XOStream(FILE* fp, size_t bufsize=X2STRUCT_OSTREAM_SIZE):_type(t_file),_fd(-1),_fp(fp),_os(0) {
+        init(bufsize);
+    }
+    explicit XOStream(std::ostream& os, size_t bufsize=X2STRUCT_OSTREAM_SIZE):_type(t_ostream),_fd(-1),_fp(0),_os(&os) {
+        init(bufsize);
+    }
+    XOStream(char* mem, size_t size):_type(t_mem),_fd(-1),_fp(0),_os(0) {
+        _buf = mem;
+        _cur = mem;
+        _end = mem+size;
+        _size = size;
+        _total = 0;
+    }
+    ~XOStream() {
+        try {
+            flush_buffer();
+        } catch (...) {  // destructor can not report error, call Flush() to get it
+        }
+        if (_type != t_mem) {
+            delete []_buf;
+        }
+    }
+public:
+    void Put(char c) {
+        if (_cur == _end) {
+            make_room();
+        }
+        *_cur++ = c;
+    }
+    void write(const char* data, size_t len) {
+        if (len > (size_t)(_end-_cur)) {
+            make_room();
+            if (len >= _size) {     // bigger than buffer, write directly
+                output(data, len);
+                return;
+            }
+        }
+        memcpy(_cur, data, len);
+        _cur += len;
+    }
+    void write(const std::string& data) {
+        write(data.data(), data.length());
+    }
+    void Flush() {
+        flush_buffer();
+        if (_type == t_file) {
+            if (0 != fflush(_fp)) {
+                throw std::runtime_error("XOStream fflush fail");
+            }
+        } else if (_type == t_ostream) {
+            _os->flush();
+            if (!*_os) {
+                throw std::runtime_error("XOStream ostream flush fail");
+            }
+        }
+    }
+    // bytes written so far, include data still in buffer
+    size_t size() const {
+        return _total+(size_t)(_cur-_buf);
+    }
+
+    // write chunks to fd with writev, no concatenation. return bytes written, throw runtime_error if fail
+    static size_t writev(int fd, const std::string* chunks, size_t num) {
+        size_t total = 0;
+        size_t i = 0;
+        while (i < num) {
+        #ifndef WINDOWS
+            struct iovec iov[X2STRUCT_IOV_MAX];
+            size_t cnt = 0;
+            for (size_t j=i; j<num && cnt<X2STRUCT_IOV_MAX; ++j, ++cnt) {
+                iov[cnt].iov_base = (void*)chunks[j].data();
+                iov[cnt].iov_len = chunks[j].length();
+            }
+            ssize_t n = ::writev(fd, iov, (int)cnt);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("XOStream writev fail:")+strerror(errno));
+            }
+            total += (size_t)n;
+            for (; i<num && (size_t)n>=chunks[i].length(); ++i) {
+                n -= (ssize_t)chunks[i].length();
+            }
+            if (n > 0) { // partial chunk
+                XOStream os(fd, 1);
+                os.output(chunks[i].data()+n, chunks[i].length()-(size_t)n);
+                total += chunks[i].length()-(size_t)n;
+                ++i;
+            }
+        #else
+            XOStream os(fd, 1);
+            os.output(chunks[i].data(), chunks[i].length());
+            total += chunks[i].length();
+            ++i;
+        #endif
+        }
+        return total;
+    }
+private:
+    XOStream(const XOStream&);
+    XOStream& operator=(const XOStream&);
+
+    void init(size_t bufsize) {
+        _size = (bufsize>0)?bufsize:1;
+        _buf = new char[_size];
+        _cur = _buf;
+        _end = _buf+_size;
+        _total = 0;
+    }
+    void make_room() {
+        if (_type == t_mem) {
+            throw std::runtime_error("XOStream memory overflow");
+        }
+        flush_buffer();
+    }
+    void flush_buffer() {
+        if (_cur!=_buf && _type!=t_mem) {   // t_mem data is already in place
+            size_t len = (size_t)(_cur-_buf);
+            _cur = _buf;
+            output(_buf, len);
+        }
+    }
+    void output(const char* data, size_t len) {
+        _total += len;
+        switch (_type) {
+          case t_fd:
+            while (len > 0) {
+                #ifndef WINDOWS
+                ssize_t n = ::write(_fd, data, len);
+                #else
+                int n = ::_write(_fd, data, (unsigned int)len);
+                #endif
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error(std::string("XOStream write fail:")+strerror(errno));
+                }
+                data += n;
+                len -= (size_t)n;
+            }
+            break;
+          case t_file:
+            if (len != fwrite(data, 1, len, _fp)) {
+                throw std::runtime_error("XOStream fwrite fail");
+            }
+            break;
+          case t_ostream:
+            _os->write(data, (std::streamsize)len);
+            if (!*_os) {
+                throw std::runtime_error("XOStream ostream write fail");
+            }
+            break;
+          default:
+            break;
+        }
+    }
+
+    int    _type;
+    int    _fd;
+    FILE*  _fp;
+    std::ostream* _os;
+
+    char*  _buf;
+    char*  _cur;
+    char*  _end;
+    size_t _size;
+    size_t _total;
+};
+
+}
+
+#endif
@@ -24,6 +24,7 @@
 
 #include <time.h>
 #include <stdint.h>
+#include <string.h>
 #include <string>
 #include <stdexcept>
 
@@ -31,6 +32,14 @@
 #undef _XOPEN_SOURCE
 #endif
 
+#include "xparallel.h"
+
+// format index of XCached
+#define X2STRUCT_CACHE_JSON 0
+#define X2STRUCT_CACHE_XML  1
+#define X2STRUCT_CACHE_BSON 2
+#define X2STRUCT_CACHE_NUM  3
+
 namespace x2struct {
 
 template<typename TYPE>
@@ -48,11 +57,19 @@ public:
         (void)name;
         return true;
     }
-    template<class DOC>
-    void __struct_to_str(DOC& obj, const char*key) const {
+    bool __x_condition_kv(const char*&attr, const char*&value) const {
+        (void)attr;
+        (void)value;
+        return false;
+    }
+    template<class DOC, class KEY>
+    void __struct_to_str(DOC& obj, const KEY& key) const {
         std::string str = _t.format();
         obj.convert(key, str);
     }
+    bool __x_equal(const XType& o) const {
+        return _t.format() == o._t.format();
+    }
     TYPE* operator->() {
         return &_t;
     }
@@ -81,6 +98,8 @@ public:
     void parse(const std::string&str) {
         #ifndef WINDOWS
         tm ttm;
+        memset(&ttm, 0, sizeof(ttm));
+        ttm.tm_isdst = -1;  // strptime not set it, let mktime decide
 
         if (0 != strptime(str.c_str(), "%Y-%m-%d %H:%M:%S", &ttm)) {
             unix_time = mktime(&ttm);
@@ -97,6 +116,179 @@ public:
 
 typedef XType<_XDate> XDate;
 
+/*
+  XTOSTRUCT struct shared by many objects and rarely changed.
+  copies share one value and its encoded bytes(compact json, compact xml, bson),
+  writers splice the bytes instead of encoding it again.
+  read by get()/->, change by set() or through the Mut guard of mut(), which copy the value if
+  it is shared. bytes are not used while a guard is alive and are invalidated when it is released.
+  copy, set() and mut() are not thread safe. encoding the same value in threads is thread safe
+  only with X2STRUCT_THREAD(c++11), which locks the bytes.
+*/
+template<typename TYPE>
+class XCached {
+    struct Block {
+        TYPE value;
+        int  refs;
+        int  guards;            // Mut alive, bytes are neither used nor kept
+        unsigned version;
+        std::string bytes[X2STRUCT_CACHE_NUM];
+        unsigned bytes_version[X2STRUCT_CACHE_NUM];    // version when bytes encoded
+        #ifdef X2STRUCT_THREAD
+        std::mutex lock;
+        #endif
+
+        Block():refs(1),guards(0),version(1) {
+            init();
+        }
+        Block(const TYPE& v):value(v),refs(1),guards(0),version(1) {
+            init();
+        }
+        void init() {
+            for (int i=0; i<X2STRUCT_CACHE_NUM; ++i) {
+                bytes_version[i] = 0;
+            }
+        }
+    };
+public:
+    /*
+      write access of mut(), the bytes are invalidated when the last guard is released.
+        c.mut()->a = 1;
+        XCached<T>::Mut m = c.mut(); m->a = 1; m->b = 2;
+    */
+    class Mut {
+    public:
+        Mut(const Mut& o):_b(o._b) {
+            ++_b->refs;
+            ++_b->guards;
+        }
+        ~Mut() {
+            if (--_b->guards == 0) {
+                ++_b->version;
+            }
+            if (--_b->refs == 0) {
+                delete _b;
+            }
+        }
+        TYPE* operator->() const {
+            return &_b->value;
+        }
+        TYPE& operator*() const {
+            return _b->value;
+        }
+    private:
+        friend class XCached;
+        explicit Mut(Block* b):_b(b) {
+            ++_b->refs;
+            ++_b->guards;
+        }
+        Mut& operator=(const Mut&);
+
+        Block* _b;
+    };
+
+    XCached():_b(new Block) {
+    }
+    XCached(const TYPE& v):_b(new Block(v)) {
+    }
+    XCached(const XCached& o):_b(o.share()) {
+    }
+    XCached& operator=(const XCached& o) {
+        if (_b != o._b) {
+            Block* b = o.share();
+            release();
+            _b = b;
+        }
+        return *this;
+    }
+    ~XCached() {
+        release();
+    }
+public:
+    const TYPE& get() const {
+        return _b->value;
+    }
+    const TYPE* operator->() const {
+        return &_b->value;
+    }
+    Mut mut() {
+        if (_b->refs-_b->guards > 1) {   // guards hold refs too, but only of their own owner
+            Block* b = new Block(_b->value);
+            release();
+            _b = b;
+        }
+        return Mut(_b);
+    }
+    void set(const TYPE& v) {
+        *mut() = v;
+    }
+    unsigned version() const {
+        return _b->version;
+    }
+
+    // encoded bytes of format, 0 if not encoded or changed since
+    const std::string* cache_get(int format) const {
+        #ifdef X2STRUCT_THREAD
+        std::lock_guard<std::mutex> guard(_b->lock);
+        #endif
+        return (_b->guards==0 && _b->bytes_version[format]==_b->version)?&_b->bytes[format]:0;
+    }
+    // keep bytes(swapped) if no other thread did it, return the kept one.
+    // while a guard is alive they are kept but not valid, the release bumps the version anyway
+    const std::string& cache_set(int format, std::string& bytes) const {
+        #ifdef X2STRUCT_THREAD
+        std::lock_guard<std::mutex> guard(_b->lock);
+        #endif
+        if (_b->guards > 0) {
+            _b->bytes[format].swap(bytes);
+        } else if (_b->bytes_version[format] != _b->version) {
+            _b->bytes[format].swap(bytes);
+            _b->bytes_version[format] = _b->version;
+        }
+        return _b->bytes[format];
+    }
+
+    // forward to TYPE, used by readers/writers without cache support
+    template<class DOC>
+    void __x_to_struct(DOC& obj) {
+        mut()->__x_to_struct(obj);
+    }
+    template<class DOC>
+    bool __x_condition(DOC& obj, const char* name) {
+        return _b->value.__x_condition(obj, name);
+    }
+    bool __x_condition_kv(const char*&attr, const char*&value) const {
+        return _b->value.__x_condition_kv(attr, value);
+    }
+    template <class CLASS>
+    void __struct_to_str(CLASS& obj, const char *root) const {
+        _b->value.__struct_to_str(obj, root);
+    }
+    template <class CLASS>
+    void __struct_to_delta(CLASS& obj, const XCached& base) const {
+        _b->value.__struct_to_delta(obj, base._b->value);
+    }
+    bool __x_equal(const XCached& o) const {
+        return _b==o._b || _b->value.__x_equal(o._b->value);
+    }
+private:
+    // a value being changed is copied, not shared
+    Block* share() const {
+        if (_b->guards > 0) {
+            return new Block(_b->value);
+        }
+        ++_b->refs;
+        return _b;
+    }
+    void release() {
+        if (--_b->refs == 0) {
+            delete _b;
+        }
+    }
+
+    Block* _b;
+};
+
 }
 
 #endif